@@ -3,9 +3,34 @@
 #include "ToonShadeCaptureTargetActor.h"
 #include "Engine/SkeletalMesh.h"
 #include "Engine/SkinnedAssetCommon.h"
+#include "Engine/TextureRenderTarget2D.h"
 #include "Components/SceneCaptureComponent2D.h"
 #include "Materials/MaterialInstanceDynamic.h"
 #include "Kismet/KismetRenderingLibrary.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include "HAL/IConsoleManager.h"
+#include "CanvasTypes.h"
+#include "EngineGlobals.h"
+#include "EngineModule.h"
+#include "LegacyScreenPercentageDriver.h"
+#include "RendererInterface.h"
+#include "RenderingThread.h"
+#include "SceneInterface.h"
+#include "SceneView.h"
+#include "ToonShadePaintSubsystem.h"
+#include "ToonShadePaintMemory.h"
+
+static TAutoConsoleVariable<int32> CVarToonShadePaintBatchedCapture(
+	TEXT("r.ToonShadePaint.BatchedCapture"),
+	1,
+	TEXT("Render capture targets that share a format and resolution as views of one scene render (0 = one CaptureScene per target)"),
+	ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarToonShadePaintCaptureAtlasSize(
+	TEXT("r.ToonShadePaint.CaptureAtlasSize"),
+	4096,
+	TEXT("Maximum width and height of the atlas that batched captures render into. The scene render's transient targets scale with the atlas area and are not counted against r.ToonShadePaint.MemoryBudgetMB."),
+	ECVF_Default);
 
 static int32 ToInt32(EToonShadeResolution ToonShadeResolution)
 {
@@ -32,6 +57,39 @@ static int32 ToInt32(EToonShadeResolution ToonShadeResolution)
 	}
 }
 
+/**
+ * アトラスへ並べて撮るビューの射影 (SceneCaptureRendering.cppと同じ作り方)
+ * アトラスのビューでは再現できない設定ならfalseを返すので、Captureで1つずつ撮ること。
+ */
+static bool BuildBatchedProjectionMatrix(const USceneCaptureComponent2D* SceneCapture, FMatrix& OutProjectionMatrix)
+{
+	// 自動の奥行きはビューの位置から毎回決まり、クリップ面はビュー毎に持てない
+	if (SceneCapture->bEnableClipPlane || (SceneCapture->ProjectionType == ECameraProjectionMode::Orthographic && SceneCapture->bAutoCalculateOrthoPlanes))
+	{
+		return false;
+	}
+
+	if (SceneCapture->bUseCustomProjectionMatrix)
+	{
+		OutProjectionMatrix = AdjustProjectionMatrixForRHI(SceneCapture->CustomProjectionMatrix);
+		return true;
+	}
+
+	if (SceneCapture->ProjectionType == ECameraProjectionMode::Orthographic)
+	{
+		// bAutoCalculateOrthoPlanesを切っている時の奥行き
+		const float HalfOrthoWidth = SceneCapture->OrthoWidth * 0.5f;
+		OutProjectionMatrix = FReversedZOrthoMatrix(HalfOrthoWidth, HalfOrthoWidth, 0.5f / UE_OLD_HALF_WORLD_MAX, UE_OLD_HALF_WORLD_MAX);
+		return true;
+	}
+
+	// タイルは正方形なので縦横の比は揃える
+	const float HalfFOV = FMath::DegreesToRadians(SceneCapture->FOVAngle) * 0.5f;
+	const float NearClippingPlane = SceneCapture->bOverride_CustomNearClippingPlane ? SceneCapture->CustomNearClippingPlane : GNearClippingPlane;
+	OutProjectionMatrix = FReversedZPerspectiveMatrix(HalfFOV, HalfFOV, 1.0f, 1.0f, NearClippingPlane, NearClippingPlane);
+	return true;
+}
+
 AToonShadeCaptureTargetActor::AToonShadeCaptureTargetActor(const FObjectInitializer& ObjectInitializer)
 	: Super(ObjectInitializer)
 	, bEnabled(true)
@@ -87,6 +145,39 @@ void AToonShadeCaptureTargetActor::OnConstruction(const FTransform& Transform)
 		}
 		MID->SetScalarParameterValue(TEXT("CoordinateIndex"), static_cast<float>(CaptureMaterial.CoordinateIndex));
 	}
+
+	if (UToonShadePaintSubsystem* Subsystem = UToonShadePaintSubsystem::GetCurrent(GetWorld()); IsValid(Subsystem))
+	{
+		Subsystem->NotifyCaptureTargetChanged(this);
+	}
+}
+
+void AToonShadeCaptureTargetActor::PostRegisterAllComponents()
+{
+	Super::PostRegisterAllComponents();
+
+	if (UToonShadePaintSubsystem* Subsystem = UToonShadePaintSubsystem::GetCurrent(GetWorld()); IsValid(Subsystem))
+	{
+		Subsystem->RegisterCaptureTarget(this);
+	}
+}
+
+void AToonShadeCaptureTargetActor::PostUnregisterAllComponents()
+{
+	if (UToonShadePaintSubsystem* Subsystem = UToonShadePaintSubsystem::GetCurrent(GetWorld()); IsValid(Subsystem))
+	{
+		Subsystem->UnregisterCaptureTarget(this);
+	}
+
+	Super::PostUnregisterAllComponents();
+}
+
+void AToonShadeCaptureTargetActor::BeginDestroy()
+{
+	DEC_MEMORY_STAT_BY(STAT_ToonShadePaint_CaptureTargetMemory, TrackedRenderTargetBytes);
+	TrackedRenderTargetBytes = 0;
+
+	Super::BeginDestroy();
 }
 
 #if WITH_EDITOR
@@ -129,15 +220,25 @@ void AToonShadeCaptureTargetActor::PostEditChangeProperty(FPropertyChangedEvent&
 
 void AToonShadeCaptureTargetActor::CaptureSetup()
 {
+	TRACE_CPUPROFILER_EVENT_SCOPE(AToonShadeCaptureTargetActor::CaptureSetup);
+	LLM_SCOPE_BYTAG(ToonShadePaint);
+
 	const ETextureRenderTargetFormat TextureFormat = (ResolutionType == EResolutionType::Seed) ? RTF_RGBA8 : RTF_RGBA32f;
 	int32 SizeX = ToInt32(Resolution);
 
+	// 作り直した古い方はGCに任せる
+	DEC_MEMORY_STAT_BY(STAT_ToonShadePaint_CaptureTargetMemory, TrackedRenderTargetBytes);
+	TrackedRenderTargetBytes = 0;
+
 	TextureRenderTarget = UKismetRenderingLibrary::CreateRenderTarget2D(GetWorld(), ToInt32(Resolution), ToInt32(Resolution), TextureFormat, FLinearColor(0.0f, 0.0f, 0.0f, 0.0f));
 	if (!IsValid(TextureRenderTarget))
 	{
 		return;
 	}
 
+	TrackedRenderTargetBytes = TextureRenderTarget->CalcTextureMemorySizeEnum(TMC_ResidentMips);
+	INC_MEMORY_STAT_BY(STAT_ToonShadePaint_CaptureTargetMemory, TrackedRenderTargetBytes);
+
 	SkeletalMeshComponent->CastShadow = false;
 
 	int32 NumMaterials = SkeletalMeshComponent->GetNumMaterials();
@@ -181,6 +282,8 @@ void AToonShadeCaptureTargetActor::CaptureSetup()
 
 void AToonShadeCaptureTargetActor::Capture()
 {
+	TRACE_CPUPROFILER_EVENT_SCOPE(AToonShadeCaptureTargetActor::Capture);
+
 	if (!IsValid(TextureRenderTarget))
 	{
 		return;
@@ -189,6 +292,192 @@ void AToonShadeCaptureTargetActor::Capture()
 	SceneCaptureComponent->TextureTarget = TextureRenderTarget;
 	SceneCaptureComponent->CaptureScene();
 
+	ResetCaptureMode();
+}
+
+void AToonShadeCaptureTargetActor::CaptureAll(TArrayView<AToonShadeCaptureTargetActor* const> InCaptureTargets)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AToonShadeCaptureTargetActor::CaptureAll);
+
+	// アトラスへ並べられるのは形式と解像度が揃ったものだけ
+	TMap<TPair<ETextureRenderTargetFormat, int32>, TArray<AToonShadeCaptureTargetActor*>> Batches;
+	for (AToonShadeCaptureTargetActor* CaptureTarget : InCaptureTargets)
+	{
+		if (!IsValid(CaptureTarget) || !IsValid(CaptureTarget->TextureRenderTarget))
+		{
+			continue;
+		}
+
+		const UTextureRenderTarget2D* RenderTarget = CaptureTarget->TextureRenderTarget;
+		Batches.FindOrAdd({ RenderTarget->RenderTargetFormat, RenderTarget->SizeX }).Add(CaptureTarget);
+	}
+
+	const bool bBatched = CVarToonShadePaintBatchedCapture.GetValueOnGameThread() != 0;
+
+	for (auto& [Key, CaptureTargets] : Batches)
+	{
+		// CaptureSetupから設定を変えられたものはアトラスのビューで再現できないので1つずつ撮る
+		if (bBatched)
+		{
+			CaptureTargets.RemoveAll([](AToonShadeCaptureTargetActor* CaptureTarget)
+			{
+				FMatrix ProjectionMatrix;
+				if (BuildBatchedProjectionMatrix(CaptureTarget->SceneCaptureComponent, ProjectionMatrix))
+				{
+					return false;
+				}
+
+				CaptureTarget->Capture();
+				return true;
+			});
+		}
+
+		if (!bBatched || CaptureTargets.Num() <= 1)
+		{
+			for (AToonShadeCaptureTargetActor* CaptureTarget : CaptureTargets)
+			{
+				CaptureTarget->Capture();
+			}
+			continue;
+		}
+
+		CaptureBatch(CaptureTargets);
+	}
+}
+
+void AToonShadeCaptureTargetActor::CaptureBatch(TArrayView<AToonShadeCaptureTargetActor* const> InCaptureTargets)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AToonShadeCaptureTargetActor::CaptureBatch);
+	LLM_SCOPE_BYTAG(ToonShadePaint);
+
+	const UTextureRenderTarget2D* FirstRenderTarget = InCaptureTargets[0]->TextureRenderTarget;
+	const ETextureRenderTargetFormat TextureFormat = FirstRenderTarget->RenderTargetFormat;
+	const int32 SizeX = FirstRenderTarget->SizeX;
+
+	UWorld* World = InCaptureTargets[0]->GetWorld();
+	if (!World || !World->Scene)
+	{
+		return;
+	}
+
+	// CaptureSceneと同じく、同じフレームで差し替えたMIDや動かしたものをプロキシへ届けてから描く
+	World->SendAllEndOfFrameUpdates();
+
+	// アトラスに入りきらない分は次のアトラスで撮る
+	const int32 MaxAtlasSize = FMath::Min(CVarToonShadePaintCaptureAtlasSize.GetValueOnGameThread(), static_cast<int32>(GetMax2DTextureDimension()));
+	const int32 MaxTilesPerRow = FMath::Max(MaxAtlasSize / SizeX, 1);
+	const int32 MaxTilesPerAtlas = MaxTilesPerRow * MaxTilesPerRow;
+
+	for (int32 FirstIndex = 0; FirstIndex < InCaptureTargets.Num(); FirstIndex += MaxTilesPerAtlas)
+	{
+		TArrayView<AToonShadeCaptureTargetActor* const> CaptureTargets = InCaptureTargets.Mid(FirstIndex, MaxTilesPerAtlas);
+
+		const int32 NumTilesX = FMath::Min(CaptureTargets.Num(), MaxTilesPerRow);
+		const int32 NumTilesY = FMath::DivideAndRoundUp(CaptureTargets.Num(), NumTilesX);
+
+		// 撮り直す度に作り直さないように、形式と大きさ毎にサブシステムで使い回す
+		UToonShadePaintSubsystem* Subsystem = UToonShadePaintSubsystem::GetCurrent(World);
+		UTextureRenderTarget2D* AtlasRenderTarget = IsValid(Subsystem) ? Subsystem->GetCaptureAtlas(TextureFormat, NumTilesX * SizeX, NumTilesY * SizeX) : nullptr;
+		if (!IsValid(AtlasRenderTarget))
+		{
+			UE_LOG(LogToonShadePaint, Warning, TEXT("CaptureAll: failed to create a %dx%d capture atlas, capturing one target at a time"), NumTilesX * SizeX, NumTilesY * SizeX);
+			for (AToonShadeCaptureTargetActor* CaptureTarget : CaptureTargets)
+			{
+				CaptureTarget->Capture();
+			}
+			continue;
+		}
+
+		FTextureRenderTargetResource* AtlasResource = AtlasRenderTarget->GameThread_GetRenderTargetResource();
+
+		// ShowFlagsや撮るものの設定はCaptureSetupで揃えてあるので先頭のものを使う
+		const USceneCaptureComponent2D* FirstSceneCapture = CaptureTargets[0]->SceneCaptureComponent;
+
+		FSceneViewFamilyContext ViewFamily(FSceneViewFamily::ConstructionValues(AtlasResource, World->Scene, FirstSceneCapture->ShowFlags)
+			.SetResolveScene(false)
+			.SetRealtimeUpdate(false));
+		ViewFamily.SceneCaptureSource = FirstSceneCapture->CaptureSource;
+		ViewFamily.SceneCaptureCompositeMode = FirstSceneCapture->CompositeMode;
+		ViewFamily.SetScreenPercentageInterface(new FLegacyScreenPercentageDriver(ViewFamily, 1.0f));
+
+		TArray<TPair<FTextureRenderTargetResource*, FIntPoint>> Tiles;
+
+		for (int32 Index = 0; Index < CaptureTargets.Num(); ++Index)
+		{
+			AToonShadeCaptureTargetActor* CaptureTarget = CaptureTargets[Index];
+			const USceneCaptureComponent2D* SceneCapture = CaptureTarget->SceneCaptureComponent;
+
+			const FIntPoint TileMin(Index % NumTilesX * SizeX, Index / NumTilesX * SizeX);
+
+			FSceneViewInitOptions ViewInitOptions;
+			ViewInitOptions.SetViewRectangle(FIntRect(TileMin, TileMin + FIntPoint(SizeX, SizeX)));
+			ViewInitOptions.ViewFamily = &ViewFamily;
+			ViewInitOptions.ViewActor = CaptureTarget;
+			ViewInitOptions.ViewOrigin = SceneCapture->GetComponentLocation();
+
+			// SceneCaptureRendering.cppと同じくカメラの向きからビュー空間(Zが奥)へ入れ替える
+			ViewInitOptions.ViewRotationMatrix = FInverseRotationMatrix(SceneCapture->GetComponentRotation()) * FMatrix(
+				FPlane(0, 0, 1, 0),
+				FPlane(1, 0, 0, 0),
+				FPlane(0, 1, 0, 0),
+				FPlane(0, 0, 0, 1));
+
+			// 撮れないものはCaptureAllで弾いてある
+			verify(BuildBatchedProjectionMatrix(SceneCapture, ViewInitOptions.ProjectionMatrix));
+
+			ViewInitOptions.BackgroundColor = FLinearColor::Transparent;
+
+			// PRM_UseShowOnlyListでShowOnlyActorsに自分だけを入れているのと同じ
+			ViewInitOptions.ShowOnlyPrimitives.Emplace();
+			CaptureTarget->ForEachComponent<UPrimitiveComponent>(false, [&ViewInitOptions](const UPrimitiveComponent* PrimitiveComponent)
+			{
+				ViewInitOptions.ShowOnlyPrimitives->Add(PrimitiveComponent->GetPrimitiveSceneId());
+			});
+
+			FSceneView* View = new FSceneView(ViewInitOptions);
+			View->bIsSceneCapture = true;
+			View->StartFinalPostprocessSettings(ViewInitOptions.ViewOrigin);
+			View->OverridePostProcessSettings(SceneCapture->PostProcessSettings, SceneCapture->PostProcessBlendWeight);
+			View->EndFinalPostprocessSettings(ViewInitOptions);
+			ViewFamily.Views.Add(View);
+
+			Tiles.Add({ CaptureTarget->TextureRenderTarget->GameThread_GetRenderTargetResource(), TileMin });
+		}
+
+		FCanvas Canvas(AtlasResource, nullptr, World, World->GetFeatureLevel(), FCanvas::CDM_DeferDrawing, 1.0f);
+		Canvas.Clear(FLinearColor::Transparent);
+		GetRendererModule().BeginRenderingViewFamily(&Canvas, &ViewFamily);
+
+		ENQUEUE_RENDER_COMMAND(ToonShadeCaptureTargetActor_CopyCaptureAtlas)(
+			[AtlasResource, Tiles = MoveTemp(Tiles), SizeX](FRHICommandListImmediate& RHICmdList)
+		{
+			FRHITexture* AtlasTexture = AtlasResource->GetRenderTargetTexture();
+			RHICmdList.Transition(FRHITransitionInfo(AtlasTexture, ERHIAccess::Unknown, ERHIAccess::CopySrc));
+
+			for (const auto& [DstResource, TileMin] : Tiles)
+			{
+				FRHITexture* DstTexture = DstResource->GetRenderTargetTexture();
+
+				FRHICopyTextureInfo CopyInfo;
+				CopyInfo.Size = FIntVector(SizeX, SizeX, 1);
+				CopyInfo.SourcePosition = FIntVector(TileMin.X, TileMin.Y, 0);
+
+				RHICmdList.Transition(FRHITransitionInfo(DstTexture, ERHIAccess::Unknown, ERHIAccess::CopyDest));
+				RHICmdList.CopyTexture(AtlasTexture, DstTexture, CopyInfo);
+				RHICmdList.Transition(FRHITransitionInfo(DstTexture, ERHIAccess::CopyDest, ERHIAccess::SRVMask));
+			}
+		});
+
+		for (AToonShadeCaptureTargetActor* CaptureTarget : CaptureTargets)
+		{
+			CaptureTarget->SceneCaptureComponent->TextureTarget = CaptureTarget->TextureRenderTarget;
+			CaptureTarget->ResetCaptureMode();
+		}
+	}
+}
+
+void AToonShadeCaptureTargetActor::ResetCaptureMode()
+{
 	int32 NumMaterials = SkeletalMeshComponent->GetNumMaterials();
 
 	for (int32 ElementIndex = 0; ElementIndex < NumMaterials; ++ElementIndex)
@@ -24,6 +24,11 @@ AToonShadeShapeActor::AToonShadeShapeActor(const FObjectInitializer& ObjectIniti
 	, MaskAxis(FVector::YAxisVector)
 	, bFlip(false)
 	, FlipAxis(FVector::XAxisVector)
+	, ArrayType(EPaintArrayType::None)
+	, ArrayCount(2)
+	, ArrayOffset(FVector(0.0, 10.0, 0.0))
+	, ArrayAxis(FVector::ZAxisVector)
+	, ArrayAngle(30.0f)
 	, CachedLayer(INDEX_NONE)
 	, CachedScale(FVector::OneVector)
 {
@@ -66,17 +71,18 @@ void AToonShadeShapeActor::Destroyed()
 	{
 		if (UMaterialParameterCollectionInstance* MPCInstance = World->GetParameterCollectionInstance(MPC); IsValid(MPCInstance))
 		{
-			MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d00"), Layer), FLinearColor::Transparent);
-			MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d01"), Layer), FLinearColor::Transparent);
-			MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d02"), Layer), FLinearColor::Transparent);
-			MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d03"), Layer), FLinearColor::Transparent);
-			MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d04"), Layer), FLinearColor::Transparent);
-			MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d05"), Layer), FLinearColor::Transparent);
-			MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d06"), Layer), FLinearColor::Transparent);
-			MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d07"), Layer), FLinearColor::Transparent);
+			for (int32 Index = 0; Index < kNumShaderParameters; ++Index)
+			{
+				MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d%02d"), Layer, Index), FLinearColor::Transparent);
+			}
 		}
 	}
 
+	if (UToonShadePaintSubsystem* Subsystem = UToonShadePaintSubsystem::GetCurrent(GetWorld()); IsValid(Subsystem))
+	{
+		Subsystem->NotifyShapeChanged(this);
+	}
+
 	Super::Destroyed();
 }
 
@@ -87,6 +93,26 @@ void AToonShadeShapeActor::OnConstruction(const FTransform& Transform)
 	Initialize();
 }
 
+void AToonShadeShapeActor::PostRegisterAllComponents()
+{
+	Super::PostRegisterAllComponents();
+
+	if (UToonShadePaintSubsystem* Subsystem = UToonShadePaintSubsystem::GetCurrent(GetWorld()); IsValid(Subsystem))
+	{
+		Subsystem->RegisterShape(this);
+	}
+}
+
+void AToonShadeShapeActor::PostUnregisterAllComponents()
+{
+	if (UToonShadePaintSubsystem* Subsystem = UToonShadePaintSubsystem::GetCurrent(GetWorld()); IsValid(Subsystem))
+	{
+		Subsystem->UnregisterShape(this);
+	}
+
+	Super::PostUnregisterAllComponents();
+}
+
 #if WITH_EDITOR
 void AToonShadeShapeActor::PreEditChange(FProperty* PropertyThatWillChange)
 {
@@ -216,6 +242,22 @@ void AToonShadeShapeActor::Initialize()
 		CapsuleComponent->SetCapsuleRadius(Radius, true);
 	}
 
+	const TStaticArray<FLinearColor, kNumShaderParameters> ShaderParameters = GetShaderParameters();
+
+	UMaterialParameterCollectionInstance* MPCInstance = GetWorld()->GetParameterCollectionInstance(MPC);
+	if (IsValid(MPCInstance))
+	{
+		for (int32 Index = 0; Index < kNumShaderParameters; ++Index)
+		{
+			MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d%02d"), Layer, Index), ShaderParameters[Index]);
+		}
+	}
+
+	Subsystem->NotifyShapeChanged(this);
+}
+
+TStaticArray<FLinearColor, AToonShadeShapeActor::kNumShaderParameters> AToonShadeShapeActor::GetShaderParameters() const
+{
 	const FVector Location = GetActorLocation();
 	const FQuat   Rotation = GetActorQuat();
 	const FVector Scale = ShapeType == EPaintShapeType::Capsule ? FVector(Radius, Radius, Height) : GetActorScale3D();
@@ -232,28 +274,107 @@ void AToonShadeShapeActor::Initialize()
 
 	const bool bIsZeroDiv = Scale.GetAbsMin() < FLT_EPSILON;
 
-	const FLinearColor AxisXAndCenterX(AxisX.X, AxisX.Y, AxisX.Z, Location.X);
-	const FLinearColor AxisYAndCenterY(AxisY.X, AxisY.Y, AxisY.Z, Location.Y);
-	const FLinearColor AxisZAndCenterZ(AxisZ.X, AxisZ.Y, AxisZ.Z, Location.Z);
-	const FLinearColor ExtentAndPad(Scale.X, Scale.Y, Scale.Z, 0.0f);
-	const FLinearColor EnabledAndTypes(bEnabled && !bIsZeroDiv ? 1.0f : 0.0f, static_cast<float>(ShapeType), static_cast<float>(PaintType), static_cast<float>(InvalidType));
-	const FLinearColor MaskAxisAndMaskAngle(SafeMaskAxis.X, SafeMaskAxis.Y, SafeMaskAxis.Z, SafeMaskAngle);
-	const FLinearColor MaskIntensityAndPad(MaskIntensity.X, MaskIntensity.Y, MaskIntensity.Z, 0.0f);
-	const FLinearColor FlipCenterAndPad(SafeFlipCenter.X, SafeFlipCenter.Y, SafeFlipCenter.Z, 0.0f);
-	const FLinearColor FlipAxisAndPad(SafeFlipAxis.X, SafeFlipAxis.Y, SafeFlipAxis.Z, 0.0f);
+	// 配列はインスタンス毎ではなく規則だけを渡し、シェーダー側で展開する
+	const FVector SafeArrayOffset = ArrayType == EPaintArrayType::Linear ? ArrayOffset : FVector::ZeroVector;
+	const FVector SafeArrayCenter = ArrayType == EPaintArrayType::Radial || ArrayType == EPaintArrayType::Mirror ? ArrayCenter : FVector::ZeroVector;
+	const FVector SafeArrayAxis = ArrayType == EPaintArrayType::Radial || ArrayType == EPaintArrayType::Mirror ? ArrayAxis.GetSafeNormal() : FVector::ZeroVector;
+	const float   SafeArrayAngle = ArrayType == EPaintArrayType::Radial ? ArrayAngle : 0.0f;
+
+	TStaticArray<FLinearColor, kNumShaderParameters> ShaderParameters;
+	ShaderParameters[0] = FLinearColor(AxisX.X, AxisX.Y, AxisX.Z, Location.X);  // AxisXAndCenterX
+	ShaderParameters[1] = FLinearColor(AxisY.X, AxisY.Y, AxisY.Z, Location.Y);  // AxisYAndCenterY
+	ShaderParameters[2] = FLinearColor(AxisZ.X, AxisZ.Y, AxisZ.Z, Location.Z);  // AxisZAndCenterZ
+	ShaderParameters[3] = FLinearColor(Scale.X, Scale.Y, Scale.Z, 0.0f);  // ExtentAndPad
+	ShaderParameters[4] = FLinearColor(bEnabled && !bIsZeroDiv ? 1.0f : 0.0f, static_cast<float>(ShapeType), static_cast<float>(PaintType), static_cast<float>(InvalidType));  // EnabledAndTypes
+	ShaderParameters[5] = FLinearColor(SafeMaskAxis.X, SafeMaskAxis.Y, SafeMaskAxis.Z, SafeMaskAngle);  // MaskAxisAndMaskAngle
+	ShaderParameters[6] = FLinearColor(MaskIntensity.X, MaskIntensity.Y, MaskIntensity.Z, 0.0f);  // MaskIntensityAndPad
+	ShaderParameters[7] = FLinearColor(SafeFlipCenter.X, SafeFlipCenter.Y, SafeFlipCenter.Z, 0.0f);  // FlipCenterAndPad
+	ShaderParameters[8] = FLinearColor(SafeFlipAxis.X, SafeFlipAxis.Y, SafeFlipAxis.Z, 0.0f);  // FlipAxisAndPad
+	ShaderParameters[9] = FLinearColor(static_cast<float>(ArrayType), static_cast<float>(GetNumArrayInstances()), SafeArrayAngle, 0.0f);  // ArrayTypeAndCountAndAngle
+	ShaderParameters[10] = FLinearColor(SafeArrayOffset.X, SafeArrayOffset.Y, SafeArrayOffset.Z, 0.0f);  // ArrayOffsetAndPad
+	ShaderParameters[11] = FLinearColor(SafeArrayCenter.X, SafeArrayCenter.Y, SafeArrayCenter.Z, 0.0f);  // ArrayCenterAndPad
+	ShaderParameters[12] = FLinearColor(SafeArrayAxis.X, SafeArrayAxis.Y, SafeArrayAxis.Z, 0.0f);  // ArrayAxisAndPad
+
+	return ShaderParameters;
+}
 
-	UMaterialParameterCollectionInstance* MPCInstance = GetWorld()->GetParameterCollectionInstance(MPC);
-	if (IsValid(MPCInstance))
+FBox AToonShadeShapeActor::GetPaintBounds() const
+{
+	if (!bEnabled)
 	{
-		MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d00"), Layer), AxisXAndCenterX);
-		MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d01"), Layer), AxisYAndCenterY);
-		MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d02"), Layer), AxisZAndCenterZ);
-		MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d03"), Layer), ExtentAndPad);
-		MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d04"), Layer), EnabledAndTypes);
-		MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d05"), Layer), MaskAxisAndMaskAngle);
-		MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d06"), Layer), MaskIntensityAndPad);
-		MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d07"), Layer), FlipCenterAndPad);
-		MPCInstance->SetVectorParameterValue(*FString::Printf(TEXT("Params%02d08"), Layer), FlipAxisAndPad);
+		return FBox(ForceInit);
+	}
+
+	// シェーダーに渡すExtentを半径とした箱に収まる (カプセルの高さは端の半球を含めない想定で余裕を持たせる)
+	const FVector Extent = ShapeType == EPaintShapeType::Capsule ? FVector(Radius, Radius, Height + Radius) : GetActorScale3D().GetAbs();
+
+	const FBox ShapeBounds = FBox(-Extent, Extent).TransformBy(FTransform(GetActorQuat(), GetActorLocation()));
+
+	FBox Bounds = ShapeBounds;
+
+	if (const int32 NumInstances = GetNumArrayInstances(); NumInstances > 1)
+	{
+		FVector Vertices[8];
+		ShapeBounds.GetVertices(Vertices);
+		for (int32 Index = 1; Index < NumInstances; ++Index)
+		{
+			for (const FVector& Vertex : Vertices)
+			{
+				Bounds += TransformArrayInstance(Vertex, Index);
+			}
+		}
+	}
+
+	if (bFlip && !FlipAxis.IsNearlyZero())
+	{
+		// フリップ先はピボットを通る面で鏡映した位置
+		const FVector FlipNormal = FlipAxis.GetSafeNormal();
+
+		FVector Vertices[8];
+		Bounds.GetVertices(Vertices);
+		for (const FVector& Vertex : Vertices)
+		{
+			Bounds += Vertex - 2.0 * FVector::DotProduct(Vertex - FlipCenter, FlipNormal) * FlipNormal;
+		}
+	}
+
+	return Bounds;
+}
+
+int32 AToonShadeShapeActor::GetNumArrayInstances() const
+{
+	switch (ArrayType)
+	{
+	case EPaintArrayType::Linear:
+		return FMath::Clamp(ArrayCount, 1, 64);
+	case EPaintArrayType::Radial:
+		return ArrayAxis.IsNearlyZero() ? 1 : FMath::Clamp(ArrayCount, 1, 64);
+	case EPaintArrayType::Mirror:
+		return ArrayAxis.IsNearlyZero() ? 1 : 2;
+	case EPaintArrayType::None:
+	default:
+		return 1;
+	}
+}
+
+FVector AToonShadeShapeActor::TransformArrayInstance(const FVector& Position, int32 Index) const
+{
+	switch (ArrayType)
+	{
+	case EPaintArrayType::Linear:
+		return Position + ArrayOffset * Index;
+	case EPaintArrayType::Radial:
+		return ArrayCenter + FQuat(ArrayAxis.GetSafeNormal(), FMath::DegreesToRadians(ArrayAngle * Index)).RotateVector(Position - ArrayCenter);
+	case EPaintArrayType::Mirror:
+		if (Index > 0)
+		{
+			const FVector MirrorNormal = ArrayAxis.GetSafeNormal();
+			return Position - 2.0 * FVector::DotProduct(Position - ArrayCenter, MirrorNormal) * MirrorNormal;
+		}
+		return Position;
+	case EPaintArrayType::None:
+	default:
+		return Position;
 	}
 }
 
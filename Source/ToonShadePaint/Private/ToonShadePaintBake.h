@@ -0,0 +1,119 @@
+// Copyright © 2024-2025 kafues511 All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeBool.h"
+#include <atomic>
+#include "ToonShadePaintBlueprintLibrary.h"
+
+class UTextureRenderTarget2D;
+struct FToonShadeBakeTask;
+
+/** モデル座標のAABBを取るタイルのテクセル数 */
+static constexpr int32 kToonShadePositionTileSize = 32;
+
+/**
+ * 描画スレッドに積んだ閾値マップの焼き1回分
+ * bIsCompletedが立つまでStatsは描画スレッドが書き込み中です。
+ */
+struct FToonShadeBakeJob
+{
+	FToonShadeBakeStats Stats;
+
+	/** 積んだ時刻 (WallMillisecondsの起点) */
+	double StartTime = 0.0;
+
+	/** 縮小プレビューを書き込んだ (本焼きは後から) */
+	bool bIsPreview = false;
+
+	/** DirtyRectの範囲だけ焼き直した */
+	bool bIsPartial = false;
+
+	/**
+	 * bRetainIntermediatesで全体を焼いた時のタイル毎のモデル座標のAABB (行優先)
+	 * 有効なテクセルがないタイルはIsValidが0です。
+	 */
+	TArray<FBox3f> PositionTileBounds;
+	int32 NumPositionTilesX = 0;
+
+	/** PositionTileBoundsと一緒に拾った、実際に回した半径 (MaxRadiusが0以下なら見積もった値) */
+	int32 ResolvedMaxRadius = 0;
+
+	/** 積み終えた割合 (0-1) bTimeSlicedの時だけ途中の値になります。 */
+	std::atomic<float> Progress = 0.0f;
+
+	/** 立てると次の区切りで焼きを止める (出力は書き換えずにStats.bCancelledを立てて完了します) */
+	FThreadSafeBool bIsCancelRequested = false;
+
+	/**
+	 * 入力のキャプチャをGPUが読み終えた
+	 * 立った後に撮り直してもこの焼きの結果は変わらないので、続きを積んでいる間に次の焼きの分を撮れます。
+	 */
+	FThreadSafeBool bAreInputsConsumed = false;
+
+	FThreadSafeBool bIsCompleted = false;
+
+	/** bTimeSlicedで焼いている途中の状態 (中身は描画スレッド専用) */
+	TSharedPtr<FToonShadeBakeTask, ESPMode::ThreadSafe> Task;
+
+	/** AdvanceShadowThresholdMapで積んだ続きが描画スレッドでまだ終わっていない */
+	FThreadSafeBool bIsSliceQueued = false;
+
+	/**
+	 * bIsPreviewの後に続けて積んだ出力解像度の本焼き (bAutoRefineの時だけ)
+	 * 分けて積む別のジョブで、続きはコアのティッカーで積みます。進捗と取り消しはこちらを見てください。
+	 */
+	TSharedPtr<FToonShadeBakeJob, ESPMode::ThreadSafe> RefineJob;
+};
+
+/** EnqueueShadowThresholdMapの引数 */
+struct FToonShadeBakeRequest
+{
+	TArray<UTextureRenderTarget2D*> SeedTextures;
+	UTextureRenderTarget2D* PositionTexture = nullptr;
+	int32 MaxRadius = 0;
+	UTextureRenderTarget2D* OutShadowThresholdMapTexture = nullptr;
+	FToonShadeBakeSettings Settings;
+
+	/** 完了時にTriggerするイベント (任意) */
+	FEvent* Signal = nullptr;
+
+	/** プレビューを焼いた時に出力解像度の本焼きを別のジョブ(FToonShadeBakeJob::RefineJob)として続けて積むか */
+	bool bAutoRefine = true;
+
+	/**
+	 * 出力解像度で焼いた中間リソースを、次のDirtyRect指定の焼き直し用に出力毎に残す
+	 * 残す時は距離を全レイヤー分確保します。(残さない時は2枚を使い回す)
+	 */
+	bool bRetainIntermediates = false;
+
+	/**
+	 * 焼き直す範囲 (テクセル) 空なら全体
+	 * 前回bRetainIntermediatesで残した中間リソースと解像度・レイヤー数・設定が一致する時だけ使われ、
+	 * 範囲外は前回の結果を使い回します。モデル座標は前回から変わっていない前提です。
+	 */
+	FIntRect DirtyRect;
+
+	/**
+	 * 焼きをr.ToonShadePaint.DispatchesPerSlice回ずつに分けて積む (縮小プレビューと範囲を絞った焼き直しも)
+	 * 続きはAdvanceShadowThresholdMapを呼んだ分だけ積まれます。
+	 */
+	bool bTimeSliced = false;
+};
+
+/**
+ * CreateShadowThresholdMapを待たずに描画スレッドへ積む (ゲームスレッド専用)
+ * 入力のUObjectはbIsCompletedが立つまで呼び出し側で保持してください。
+ */
+TSharedRef<FToonShadeBakeJob, ESPMode::ThreadSafe> EnqueueShadowThresholdMap(const FToonShadeBakeRequest& Request);
+
+/**
+ * bTimeSlicedで積んだ焼きの続きを1回分積む (ゲームスレッド専用)
+ * 前に積んだ分がGPUで終わっていないか、続きがなければ何もしません。
+ * DispatchesPerSliceが0以下ならr.ToonShadePaint.DispatchesPerSlice回ずつ積みます。
+ */
+void AdvanceShadowThresholdMap(const TSharedRef<FToonShadeBakeJob, ESPMode::ThreadSafe>& Job, int32 DispatchesPerSlice = 0);
+
+/** bRetainIntermediatesで残した中間リソースを解放 (ゲームスレッド専用) */
+void ReleaseShadowThresholdMapIntermediates(const UTextureRenderTarget2D* OutShadowThresholdMapTexture);
@@ -0,0 +1,384 @@
+// Copyright © 2024-2025 kafues511 All Rights Reserved.
+
+#include "ToonShadePaintBakeCache.h"
+#include "Containers/Ticker.h"
+#include "Engine/SkeletalMesh.h"
+#include "Engine/Texture2D.h"
+#include "Engine/TextureRenderTarget2D.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/ThreadSafeBool.h"
+#include "Misc/SecureHash.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include "RHIGPUReadback.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+#include "ShaderCore.h"
+#include "UObject/Package.h"
+#include "ToonShadeCaptureTargetActor.h"
+#include "ToonShadePaintActor.h"
+#include "ToonShadePaintSubsystem.h"
+
+#if WITH_EDITOR
+#include "DerivedDataCacheInterface.h"
+#endif
+
+
+static TAutoConsoleVariable<int32> CVarToonShadePaintBakeCache(
+	TEXT("r.ToonShadePaint.BakeCache"),
+	1,
+	TEXT("Restore threshold maps from the Derived Data Cache when nothing that affects the bake has changed."),
+	ECVF_Default);
+
+
+// 焼きの結果が変わるC++側の変更をしたら更新すること
+#define TOONSHADEPAINT_BAKE_CACHE_VERSION TEXT("6C2A1F0E9B7D4E3A8F51D2C0B4A7E913")
+
+// キャッシュの中身の並びを変えたら更新すること
+static constexpr int32 kBakeCacheDataVersion = 1;
+
+
+/** 焼きに使うシェーダー (インクルードを含めてハッシュを取る) */
+static const TCHAR* const GBakeShaderFiles[] =
+{
+	TEXT("/Plugin/ToonShadePaint/Private/SetupSeedFlags.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/SetupPos.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/PositionBounds.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/MirrorMap.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/TileClassify.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/DistanceExtentRow.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/DistanceExtentColumn.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/DistanceMapSetup.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/DistanceMapIter.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/DistanceMapEDTRow.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/DistanceMapEDTColumn.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/SDFCalc.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/SDFMirror.usf"),
+	TEXT("/Plugin/ToonShadePaint/Private/SDFBlend.usf"),
+};
+
+
+/** 焼きの結果が変わるCVar (ToonShadePaintBlueprintLibrary.cppでstaticなので名前で引く) */
+static const TCHAR* const GBakeConsoleVariables[] =
+{
+	TEXT("r.ToonShadePaint.ConvergenceCheckInterval"),
+	TEXT("r.ToonShadePaint.IslandRects"),
+	TEXT("r.ToonShadePaint.Mirror.MaxMismatchRatio"),
+	TEXT("r.ToonShadePaint.TileClassification"),
+};
+
+
+template <typename T>
+static void UpdateHash(FSHA1& Hash, const T& Value)
+{
+	Hash.Update(reinterpret_cast<const uint8*>(&Value), sizeof(T));
+}
+
+
+static void UpdateHash(FSHA1& Hash, const FString& Value)
+{
+	Hash.UpdateWithString(*Value, Value.Len());
+}
+
+
+/** アセットのパスと保存時のハッシュ (保存し直したら変わる) */
+static void UpdateAssetHash(FSHA1& Hash, const UObject* Asset)
+{
+	if (Asset == nullptr)
+	{
+		UpdateHash(Hash, FString());
+		return;
+	}
+
+	UpdateHash(Hash, Asset->GetPathName());
+#if WITH_EDITORONLY_DATA
+	UpdateHash(Hash, LexToString(Asset->GetPackage()->GetSavedHash()));
+#endif
+}
+
+
+static void UpdateHash(FSHA1& Hash, const FTransform& Transform)
+{
+	UpdateHash(Hash, Transform.GetLocation());
+	UpdateHash(Hash, Transform.GetRotation());
+	UpdateHash(Hash, Transform.GetScale3D());
+}
+
+
+static void UpdateCaptureTargetHash(FSHA1& Hash, const AToonShadeCaptureTargetActor* CaptureTarget)
+{
+	UpdateHash(Hash, CaptureTarget->Layer);
+	UpdateHash(Hash, CaptureTarget->Resolution);
+	UpdateHash(Hash, CaptureTarget->ResolutionType);
+	UpdateHash(Hash, CaptureTarget->GetActorTransform());
+	UpdateAssetHash(Hash, CaptureTarget->SkeletalMeshAsset);
+
+	for (const FCaptureMaterial& CaptureMaterial : CaptureTarget->CaptureMaterials)
+	{
+		UpdateHash(Hash, CaptureMaterial.MaterialSlotName.ToString());
+		UpdateHash(Hash, static_cast<bool>(CaptureMaterial.bEnabled));
+		UpdateHash(Hash, CaptureMaterial.CoordinateIndex);
+		UpdateAssetHash(Hash, CaptureMaterial.BaseColorTexture);
+	}
+}
+
+
+FString BuildShadowThresholdMapCacheKey(
+	UWorld* World,
+	const TArray<AToonShadeCaptureTargetActor*>& SeedTargets,
+	const AToonShadeCaptureTargetActor* PositionTarget,
+	int32 MaxRadius,
+	const FToonShadeBakeSettings& Settings,
+	const UTextureRenderTarget2D* OutShadowThresholdMapTexture)
+{
+#if WITH_EDITOR
+	if (CVarToonShadePaintBakeCache.GetValueOnGameThread() == 0 || !IsValid(World) || !IsValid(PositionTarget) || !IsValid(OutShadowThresholdMapTexture))
+	{
+		return FString();
+	}
+
+	FSHA1 Hash;
+
+	for (const TCHAR* ShaderFile : GBakeShaderFiles)
+	{
+		UpdateHash(Hash, GetShaderFileHash(ShaderFile, GMaxRHIShaderPlatform));
+	}
+
+	// 並びはLayerSort済み
+	UpdateHash(Hash, SeedTargets.Num());
+	for (const AToonShadeCaptureTargetActor* CaptureTarget : SeedTargets)
+	{
+		UpdateCaptureTargetHash(Hash, CaptureTarget);
+	}
+	UpdateCaptureTargetHash(Hash, PositionTarget);
+
+	// 形状はMPCに書き込む値が同じなら同じSeedになる
+	TArray<const AToonShadeShapeActor*> ShapeActors;
+	if (const UToonShadePaintSubsystem* Subsystem = UToonShadePaintSubsystem::GetCurrent(World); IsValid(Subsystem))
+	{
+		for (const AToonShadeShapeActor* ShapeActor : Subsystem->GetShapes())
+		{
+			if (IsValid(ShapeActor))
+			{
+				ShapeActors.Add(ShapeActor);
+			}
+		}
+	}
+	ShapeActors.Sort([](const AToonShadeShapeActor& A, const AToonShadeShapeActor& B) { return A.Layer < B.Layer; });
+
+	UpdateHash(Hash, ShapeActors.Num());
+	for (const AToonShadeShapeActor* ShapeActor : ShapeActors)
+	{
+		UpdateHash(Hash, ShapeActor->Layer);
+		for (const FLinearColor& ShaderParameter : ShapeActor->GetShaderParameters())
+		{
+			UpdateHash(Hash, ShaderParameter);
+		}
+	}
+
+	UpdateHash(Hash, MaxRadius);
+	UpdateHash(Hash, Settings.DistanceMode);
+	UpdateHash(Hash, Settings.bMirrorSymmetry);
+	UpdateHash(Hash, Settings.MirrorCenter);
+	UpdateHash(Hash, Settings.MirrorAxis);
+	UpdateHash(Hash, Settings.bQuantizePosition);
+
+	for (const TCHAR* ConsoleVariableName : GBakeConsoleVariables)
+	{
+		const IConsoleVariable* ConsoleVariable = IConsoleManager::Get().FindConsoleVariable(ConsoleVariableName);
+		UpdateHash(Hash, ConsoleVariable != nullptr ? ConsoleVariable->GetString() : FString());
+	}
+
+	UpdateHash(Hash, OutShadowThresholdMapTexture->SizeX);
+	UpdateHash(Hash, OutShadowThresholdMapTexture->SizeY);
+	UpdateHash(Hash, OutShadowThresholdMapTexture->GetFormat());
+
+	Hash.Final();
+
+	FSHAHash Result;
+	Hash.GetHash(Result.Hash);
+
+	return FDerivedDataCacheInterface::BuildCacheKey(TEXT("TOONSHADEPAINT"), TOONSHADEPAINT_BAKE_CACHE_VERSION, *Result.ToString());
+#else
+	return FString();
+#endif
+}
+
+
+#if WITH_EDITOR
+/** DDCから引いた中身を出力へ書き込む 解像度か形式が食い違えばfalse */
+static bool WriteShadowThresholdMap(const TArray<uint8>& Data, UTextureRenderTarget2D* OutShadowThresholdMapTexture)
+{
+	FMemoryReader Reader(Data);
+
+	int32 DataVersion = 0;
+	FIntPoint Size = FIntPoint::ZeroValue;
+	int32 Format = PF_Unknown;
+	Reader << DataVersion << Size << Format;
+
+	const EPixelFormat PixelFormat = OutShadowThresholdMapTexture->GetFormat();
+	if (DataVersion != kBakeCacheDataVersion || Size != FIntPoint(OutShadowThresholdMapTexture->SizeX, OutShadowThresholdMapTexture->SizeY) || Format != PixelFormat)
+	{
+		return false;
+	}
+
+	const uint32 Pitch = Size.X * GPixelFormats[PixelFormat].BlockBytes;
+
+	TArray<uint8> Pixels;
+	Pixels.SetNumUninitialized(Pitch * Size.Y);
+	if (Reader.TotalSize() - Reader.Tell() != Pixels.Num())
+	{
+		return false;
+	}
+	Reader.Serialize(Pixels.GetData(), Pixels.Num());
+
+	FTextureRHIRef DstTexture = OutShadowThresholdMapTexture->GetResource()->TextureRHI;
+
+	ENQUEUE_RENDER_COMMAND(ToonShadePaintBakeCache_LoadShadowThresholdMap)(
+		[DstTexture, Size, Pitch, Pixels = MoveTemp(Pixels)](FRHICommandListImmediate& RHICmdList)
+	{
+		RHICmdList.UpdateTexture2D(DstTexture, 0, FUpdateTextureRegion2D(0, 0, 0, 0, Size.X, Size.Y), Pitch, Pixels.GetData());
+	});
+
+	return true;
+}
+#endif
+
+
+void LoadShadowThresholdMapFromCache(const FString& CacheKey, UTextureRenderTarget2D* OutShadowThresholdMapTexture, TFunction<void(bool)> OnCompleted)
+{
+#if WITH_EDITOR
+	TRACE_CPUPROFILER_EVENT_SCOPE(LoadShadowThresholdMapFromCache);
+
+	if (CacheKey.IsEmpty() || !IsValid(OutShadowThresholdMapTexture) || OutShadowThresholdMapTexture->GetResource() == nullptr)
+	{
+		OnCompleted(false);
+		return;
+	}
+
+	const uint32 Handle = GetDerivedDataCacheRef().GetAsynchronous(*CacheKey, OutShadowThresholdMapTexture->GetPathName());
+
+	// 引き終わるのを待たずに戻り、届いたら書き込んでから知らせる
+	FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda(
+		[Handle, WeakOutput = TWeakObjectPtr<UTextureRenderTarget2D>(OutShadowThresholdMapTexture), OnCompleted = MoveTemp(OnCompleted)](float DeltaTime)
+	{
+		if (!GetDerivedDataCacheRef().PollAsynchronousCompletion(Handle))
+		{
+			return true;
+		}
+
+		TArray<uint8> Data;
+		const bool bIsHit = GetDerivedDataCacheRef().GetAsynchronousResults(Handle, Data);
+
+		UTextureRenderTarget2D* Output = WeakOutput.Get();
+		const bool bIsFound = bIsHit && IsValid(Output) && Output->GetResource() != nullptr && WriteShadowThresholdMap(Data, Output);
+
+		OnCompleted(bIsFound);
+		return false;
+	}));
+#else
+	OnCompleted(false);
+#endif
+}
+
+
+/** 出力の読み戻し1回分 */
+struct FToonShadeBakeCacheStoreRequest
+{
+	TUniquePtr<FRHIGPUTextureReadback> Readback;
+
+	FString CacheKey;
+	FString DebugContext;
+	FIntPoint Size = FIntPoint::ZeroValue;
+	EPixelFormat Format = PF_Unknown;
+
+	FThreadSafeBool bIsPolling = false;
+	FThreadSafeBool bIsDone = false;
+};
+
+
+#if WITH_EDITOR
+static void PutShadowThresholdMap(FToonShadeBakeCacheStoreRequest& Request)
+{
+	int32 RowPitchInPixels = 0;
+	const uint8* Src = static_cast<const uint8*>(Request.Readback->Lock(RowPitchInPixels));
+	if (Src == nullptr)
+	{
+		return;
+	}
+
+	const int32 BlockBytes = GPixelFormats[Request.Format].BlockBytes;
+	const int32 Pitch = Request.Size.X * BlockBytes;
+
+	TArray<uint8> Data;
+	FMemoryWriter Writer(Data);
+
+	int32 DataVersion = kBakeCacheDataVersion;
+	int32 Format = Request.Format;
+	Writer << DataVersion << Request.Size << Format;
+
+	// 読み戻しは行の末尾が詰まっていないので1行ずつ
+	for (int32 Y = 0; Y < Request.Size.Y; ++Y)
+	{
+		Writer.Serialize(const_cast<uint8*>(Src + static_cast<SIZE_T>(Y) * RowPitchInPixels * BlockBytes), Pitch);
+	}
+
+	Request.Readback->Unlock();
+
+	GetDerivedDataCacheRef().Put(*Request.CacheKey, Data, Request.DebugContext, true);
+}
+#endif
+
+
+void StoreShadowThresholdMapToCache(const FString& CacheKey, UTextureRenderTarget2D* InShadowThresholdMapTexture)
+{
+#if WITH_EDITOR
+	if (CacheKey.IsEmpty() || !IsValid(InShadowThresholdMapTexture) || InShadowThresholdMapTexture->GetResource() == nullptr)
+	{
+		return;
+	}
+
+	TSharedRef<FToonShadeBakeCacheStoreRequest, ESPMode::ThreadSafe> Request = MakeShared<FToonShadeBakeCacheStoreRequest, ESPMode::ThreadSafe>();
+	Request->Readback = MakeUnique<FRHIGPUTextureReadback>(TEXT("ToonShadePaint.BakeCacheReadback"));
+	Request->CacheKey = CacheKey;
+	Request->DebugContext = InShadowThresholdMapTexture->GetPathName();
+	Request->Size = FIntPoint(InShadowThresholdMapTexture->SizeX, InShadowThresholdMapTexture->SizeY);
+	Request->Format = InShadowThresholdMapTexture->GetFormat();
+
+	FTextureRHIRef SourceTexture = InShadowThresholdMapTexture->GetResource()->TextureRHI;
+
+	ENQUEUE_RENDER_COMMAND(ToonShadePaintBakeCache_StoreShadowThresholdMap)(
+		[Request, SourceTexture](FRHICommandListImmediate& RHICmdList)
+	{
+		RHICmdList.Transition(FRHITransitionInfo(SourceTexture, ERHIAccess::Unknown, ERHIAccess::CopySrc));
+		Request->Readback->EnqueueCopy(RHICmdList, SourceTexture);
+		RHICmdList.Transition(FRHITransitionInfo(SourceTexture, ERHIAccess::CopySrc, ERHIAccess::SRVMask));
+	});
+
+	// 読み戻しを待たずに戻り、描画スレッドでフェンスを覗いて終わっていればDDCへ書き込む
+	FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([Request](float DeltaTime)
+	{
+		if (Request->bIsDone)
+		{
+			return false;
+		}
+
+		if (!Request->bIsPolling)
+		{
+			Request->bIsPolling = true;
+
+			ENQUEUE_RENDER_COMMAND(ToonShadePaintBakeCache_PollStoreReadback)(
+				[Request](FRHICommandListImmediate& RHICmdList)
+			{
+				if (Request->Readback->IsReady())
+				{
+					PutShadowThresholdMap(*Request);
+					Request->bIsDone = true;
+				}
+				Request->bIsPolling = false;
+			});
+		}
+
+		return true;
+	}));
+#endif
+}
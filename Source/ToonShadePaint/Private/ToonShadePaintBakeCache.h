@@ -0,0 +1,32 @@
+// Copyright © 2024-2025 kafues511 All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ToonShadePaintBlueprintLibrary.h"
+
+class AToonShadeCaptureTargetActor;
+class UTextureRenderTarget2D;
+class UWorld;
+
+/**
+ * 焼きの入力から閾値マップのDDCのキーを組む (ゲームスレッド専用)
+ * メッシュ・UVチャンネル・形状・解像度・MaxRadius・設定・シェーダーのハッシュを含みます。
+ * キャッシュが無効な場合は空を返します。
+ */
+FString BuildShadowThresholdMapCacheKey(
+	UWorld* World,
+	const TArray<AToonShadeCaptureTargetActor*>& SeedTargets,
+	const AToonShadeCaptureTargetActor* PositionTarget,
+	int32 MaxRadius,
+	const FToonShadeBakeSettings& Settings,
+	const UTextureRenderTarget2D* OutShadowThresholdMapTexture);
+
+/**
+ * DDCから閾値マップを引いて出力へ書き込む (ゲームスレッド専用、引くのは非同期)
+ * 引き終わったらゲームスレッドでOnCompletedに書き込んだかを渡します。(見つからなければfalse)
+ */
+void LoadShadowThresholdMapFromCache(const FString& CacheKey, UTextureRenderTarget2D* OutShadowThresholdMapTexture, TFunction<void(bool)> OnCompleted);
+
+/** 出力を読み戻してDDCへ書き込む (ゲームスレッド専用、読み戻しは非同期) */
+void StoreShadowThresholdMapToCache(const FString& CacheKey, UTextureRenderTarget2D* InShadowThresholdMapTexture);
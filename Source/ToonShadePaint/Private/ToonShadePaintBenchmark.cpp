@@ -0,0 +1,481 @@
+// Copyright © 2024-2025 kafues511 All Rights Reserved.
+
+#include "CoreMinimal.h"
+#include "HAL/IConsoleManager.h"
+#include "Engine/TextureRenderTarget2D.h"
+#include "Engine/World.h"
+#include "DataDrivenShaderPlatformInfo.h"
+#include "GlobalShader.h"
+#include "ShaderParameterUtils.h"
+#include "Misc/AutomationTest.h"
+#include "Misc/Crc.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "UObject/Package.h"
+#include "UObject/StrongObjectPtr.h"
+#include "ToonShadePaintBlueprintLibrary.h"
+
+
+static TAutoConsoleVariable<float> CVarToonShadePaintBenchmarkRegressionThreshold(
+	TEXT("r.ToonShadePaint.Benchmark.RegressionThreshold"),
+	0.2f,
+	TEXT("Relative slowdown against the stored baseline that fails a benchmark case. (0.2 = 20%)"),
+	ECVF_Default);
+
+
+enum class EToonShadeBenchmarkPattern : uint32
+{
+	/** UV展開した頭(球) */
+	Head,
+	/** ランダムな大きさのアイランド */
+	Islands,
+	/** 縞 */
+	Stripes,
+	Num,
+};
+
+
+class FBenchmarkSynthCS : public FGlobalShader
+{
+	DECLARE_SHADER_TYPE(FBenchmarkSynthCS, Global);
+
+public:
+	FBenchmarkSynthCS() = default;
+	explicit FBenchmarkSynthCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer)
+	{
+		Pattern.Bind(Initializer.ParameterMap, TEXT("Pattern"));
+		LayerIndex.Bind(Initializer.ParameterMap, TEXT("LayerIndex"));
+		NumLayers.Bind(Initializer.ParameterMap, TEXT("NumLayers"));
+		TextureSize.Bind(Initializer.ParameterMap, TEXT("TextureSize"));
+		RWSeedTexture.Bind(Initializer.ParameterMap, TEXT("RWSeedTexture"));
+		RWPositionTexture.Bind(Initializer.ParameterMap, TEXT("RWPositionTexture"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsPCPlatform(Parameters.Platform) && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM6);
+	}
+
+	void SetParameters(
+		FRHIBatchedShaderParameters& BatchedParameters,
+		uint32 InPattern,
+		uint32 InLayerIndex,
+		uint32 InNumLayers,
+		FIntPoint InTextureSize,
+		FRHIUnorderedAccessView* InRWSeedTexture,
+		FRHIUnorderedAccessView* InRWPositionTexture)
+	{
+		SetShaderValue(BatchedParameters, Pattern, InPattern);
+		SetShaderValue(BatchedParameters, LayerIndex, InLayerIndex);
+		SetShaderValue(BatchedParameters, NumLayers, InNumLayers);
+		SetShaderValue(BatchedParameters, TextureSize, InTextureSize);
+		SetUAVParameter(BatchedParameters, RWSeedTexture, InRWSeedTexture);
+		SetUAVParameter(BatchedParameters, RWPositionTexture, InRWPositionTexture);
+	}
+
+	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
+	{
+		UnsetUAVParameter(BatchedUnbinds, RWSeedTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWPositionTexture);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderParameter, Pattern);
+	LAYOUT_FIELD(FShaderParameter, LayerIndex);
+	LAYOUT_FIELD(FShaderParameter, NumLayers);
+	LAYOUT_FIELD(FShaderParameter, TextureSize);
+	LAYOUT_FIELD(FShaderResourceParameter, RWSeedTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWPositionTexture);
+};
+
+
+IMPLEMENT_SHADER_TYPE(, FBenchmarkSynthCS, TEXT("/Plugin/ToonShadePaint/Private/BenchmarkSynth.usf"), TEXT("MainCS"), SF_Compute);
+
+
+struct FToonShadeBenchmarkCase
+{
+	EToonShadeBenchmarkPattern Pattern;
+	int32 Resolution;
+	int32 NumLayers;
+	int32 MaxRadius;
+	EToonShadeDistanceMode DistanceMode;
+
+	FString GetKey() const
+	{
+		static const TCHAR* PatternNames[] = { TEXT("Head"), TEXT("Islands"), TEXT("Stripes") };
+		return FString::Printf(TEXT("%s_%d_%d_%d_%s"),
+			PatternNames[static_cast<uint32>(Pattern)],
+			Resolution,
+			NumLayers,
+			MaxRadius,
+			DistanceMode == EToonShadeDistanceMode::Separable ? TEXT("Separable") : TEXT("Propagation"));
+	}
+};
+
+struct FToonShadeBenchmarkResult
+{
+	FString Key;
+	float WallMilliseconds = 0.0f;
+	float GPUMilliseconds = 0.0f;
+	int64 AllocatedBytes = 0;
+	uint32 Checksum = 0;
+
+	FString ToCSVLine() const
+	{
+		return FString::Printf(TEXT("%s,%f,%f,%lld,%08x"), *Key, WallMilliseconds, GPUMilliseconds, AllocatedBytes, Checksum);
+	}
+
+	static bool FromCSVLine(const FString& InLine, FToonShadeBenchmarkResult& OutResult)
+	{
+		TArray<FString> Columns;
+		if (InLine.ParseIntoArray(Columns, TEXT(",")) != 5)
+		{
+			return false;
+		}
+
+		OutResult.Key = Columns[0];
+		OutResult.WallMilliseconds = FCString::Atof(*Columns[1]);
+		OutResult.GPUMilliseconds = FCString::Atof(*Columns[2]);
+		OutResult.AllocatedBytes = FCString::Atoi64(*Columns[3]);
+		OutResult.Checksum = FCString::Strtoui64(*Columns[4], nullptr, 16);
+		return true;
+	}
+};
+
+
+static UTextureRenderTarget2D* CreateBenchmarkRenderTarget(int32 Resolution, EPixelFormat Format)
+{
+	UTextureRenderTarget2D* RenderTarget = NewObject<UTextureRenderTarget2D>(GetTransientPackage());
+	RenderTarget->bCanCreateUAV = true;
+	RenderTarget->ClearColor = FLinearColor::Transparent;
+	RenderTarget->InitCustomFormat(Resolution, Resolution, Format, true);
+	RenderTarget->UpdateResourceImmediate(true);
+	return RenderTarget;
+}
+
+
+static void SynthesizeBenchmarkInputs(EToonShadeBenchmarkPattern Pattern, const TArray<UTextureRenderTarget2D*>& SeedTextures, UTextureRenderTarget2D* PositionTexture)
+{
+	TArray<FTextureRHIRef> SeedTexturesRHI;
+	for (UTextureRenderTarget2D* SeedTexture : SeedTextures)
+	{
+		SeedTexturesRHI.Add(SeedTexture->GetResource()->TextureRHI);
+	}
+
+	FTextureRHIRef PositionTextureRHI = PositionTexture->GetResource()->TextureRHI;
+
+	ENQUEUE_RENDER_COMMAND(ToonShadePaintBenchmark_Synthesize)(
+		[Pattern, SeedTexturesRHI, PositionTextureRHI](FRHICommandListImmediate& RHICmdList)
+	{
+		const int32 Resolution = PositionTextureRHI->GetSizeX();
+		const uint32 ThreadGroupCount = FMath::DivideAndRoundUp(Resolution, 32);
+
+		FUnorderedAccessViewRHIRef PositionUAV = RHICmdList.CreateUnorderedAccessView(PositionTextureRHI);
+		RHICmdList.Transition(FRHITransitionInfo(PositionUAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+		for (int32 LayerIndex = 0; LayerIndex < SeedTexturesRHI.Num(); ++LayerIndex)
+		{
+			FUnorderedAccessViewRHIRef SeedUAV = RHICmdList.CreateUnorderedAccessView(SeedTexturesRHI[LayerIndex]);
+			RHICmdList.Transition(FRHITransitionInfo(SeedUAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+			TShaderMapRef<FBenchmarkSynthCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+			SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+			SetShaderParametersLegacyCS(
+				RHICmdList,
+				ComputeShader,
+				static_cast<uint32>(Pattern),
+				LayerIndex,
+				SeedTexturesRHI.Num(),
+				FIntPoint(Resolution, Resolution),
+				SeedUAV,
+				PositionUAV);
+			DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCount, ThreadGroupCount, 1);
+			UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+
+			RHICmdList.Transition(FRHITransitionInfo(SeedTexturesRHI[LayerIndex], ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+		}
+
+		RHICmdList.Transition(FRHITransitionInfo(PositionTextureRHI, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+	});
+
+	FlushRenderingCommands();
+}
+
+
+static uint32 ComputeOutputChecksum(UTextureRenderTarget2D* OutputTexture)
+{
+	TArray<FLinearColor> Pixels;
+	OutputTexture->GameThread_GetRenderTargetResource()->ReadLinearColorPixels(Pixels);
+
+	// 環境差の丸め誤差を吸収するため10bitに量子化してから計算
+	TArray<uint16> Quantized;
+	Quantized.Reserve(Pixels.Num() * 2);
+	for (const FLinearColor& Pixel : Pixels)
+	{
+		Quantized.Add(static_cast<uint16>(FMath::RoundToInt(FMath::Clamp(Pixel.R, 0.0f, 1.0f) * 1023.0f)));
+		Quantized.Add(static_cast<uint16>(FMath::RoundToInt(FMath::Clamp(Pixel.G, 0.0f, 1.0f) * 1023.0f)));
+	}
+
+	return FCrc::MemCrc32(Quantized.GetData(), Quantized.Num() * Quantized.GetTypeSize());
+}
+
+
+static FToonShadeBenchmarkResult RunBenchmarkCase(UWorld* World, const FToonShadeBenchmarkCase& Case)
+{
+	TArray<TStrongObjectPtr<UTextureRenderTarget2D>> SeedTextureRefs;
+	TArray<UTextureRenderTarget2D*> SeedTextures;
+	for (int32 LayerIndex = 0; LayerIndex < Case.NumLayers; ++LayerIndex)
+	{
+		UTextureRenderTarget2D* SeedTexture = CreateBenchmarkRenderTarget(Case.Resolution, PF_R8G8B8A8);
+		SeedTextureRefs.Emplace(SeedTexture);
+		SeedTextures.Add(SeedTexture);
+	}
+
+	TStrongObjectPtr<UTextureRenderTarget2D> PositionTexture(CreateBenchmarkRenderTarget(Case.Resolution, PF_A32B32G32R32F));
+	TStrongObjectPtr<UTextureRenderTarget2D> OutputTexture(CreateBenchmarkRenderTarget(Case.Resolution, PF_A32B32G32R32F));
+
+	SynthesizeBenchmarkInputs(Case.Pattern, SeedTextures, PositionTexture.Get());
+
+	FToonShadeBakeSettings Settings;
+	Settings.DistanceMode = Case.DistanceMode;
+
+	FToonShadeBakeStats Stats;
+	UToonShadePaintBlueprintLibrary::CreateShadowThresholdMap(World, SeedTextures, PositionTexture.Get(), Case.MaxRadius, OutputTexture.Get(), Settings, Stats);
+
+	FToonShadeBenchmarkResult Result;
+	Result.Key = Case.GetKey();
+	Result.WallMilliseconds = Stats.WallMilliseconds;
+	Result.GPUMilliseconds = Stats.GPUMilliseconds;
+	Result.AllocatedBytes = Stats.AllocatedBytes;
+	Result.Checksum = ComputeOutputChecksum(OutputTexture.Get());
+	return Result;
+}
+
+
+static TArray<FToonShadeBenchmarkCase> GatherBenchmarkCases(const TArray<FString>& Args)
+{
+	TArray<int32> Resolutions = { 128, 256, 512, 1024, 2048 };
+	TArray<int32> NumLayersList = { 2, 8, 32 };
+	TArray<int32> MaxRadii = { 8, 32, 128 };
+
+	// "Resolution=512 Layers=8 Radius=32 Pattern=Head Mode=Separable" で絞り込み
+	FString Filter = FString::Join(Args, TEXT(" "));
+
+	int32 Value = 0;
+	if (FParse::Value(*Filter, TEXT("Resolution="), Value))
+	{
+		Resolutions = { Value };
+	}
+	if (FParse::Value(*Filter, TEXT("Layers="), Value))
+	{
+		NumLayersList = { Value };
+	}
+	if (FParse::Value(*Filter, TEXT("Radius="), Value))
+	{
+		MaxRadii = { Value };
+	}
+
+	FString PatternFilter;
+	FParse::Value(*Filter, TEXT("Pattern="), PatternFilter);
+
+	FString ModeFilter;
+	FParse::Value(*Filter, TEXT("Mode="), ModeFilter);
+
+	TArray<FToonShadeBenchmarkCase> Cases;
+
+	for (uint32 Pattern = 0; Pattern < static_cast<uint32>(EToonShadeBenchmarkPattern::Num); ++Pattern)
+	{
+		for (EToonShadeDistanceMode DistanceMode : { EToonShadeDistanceMode::Propagation, EToonShadeDistanceMode::Separable })
+		{
+			for (int32 Resolution : Resolutions)
+			{
+				for (int32 NumLayers : NumLayersList)
+				{
+					for (int32 MaxRadius : MaxRadii)
+					{
+						FToonShadeBenchmarkCase Case{ static_cast<EToonShadeBenchmarkPattern>(Pattern), Resolution, NumLayers, MaxRadius, DistanceMode };
+
+						const FString Key = Case.GetKey();
+						if ((!PatternFilter.IsEmpty() && !Key.StartsWith(PatternFilter + TEXT("_"))) || (!ModeFilter.IsEmpty() && !Key.EndsWith(TEXT("_") + ModeFilter)))
+						{
+							continue;
+						}
+
+						Cases.Add(Case);
+
+						if (DistanceMode == EToonShadeDistanceMode::Separable)
+						{
+							break;  // 分離型EDTはMaxRadiusに依存しない
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return Cases;
+}
+
+
+static FString GetBenchmarkDir()
+{
+	return FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("ToonShadePaint"));
+}
+
+
+static TMap<FString, FToonShadeBenchmarkResult> LoadBenchmarkResults(const FString& Path)
+{
+	TMap<FString, FToonShadeBenchmarkResult> Results;
+
+	TArray<FString> Lines;
+	if (FFileHelper::LoadFileToStringArray(Lines, *Path))
+	{
+		for (const FString& Line : Lines)
+		{
+			FToonShadeBenchmarkResult Result;
+			if (FToonShadeBenchmarkResult::FromCSVLine(Line, Result))
+			{
+				Results.Add(Result.Key, Result);
+			}
+		}
+	}
+
+	return Results;
+}
+
+
+/** 同じケースの行だけ差し替えて書き込む (ケース毎に走らせても結果が溜まる) */
+static void SaveBenchmarkResults(const FString& Path, const TArray<FToonShadeBenchmarkResult>& InResults)
+{
+	TMap<FString, FToonShadeBenchmarkResult> Results = LoadBenchmarkResults(Path);
+	for (const FToonShadeBenchmarkResult& Result : InResults)
+	{
+		Results.Add(Result.Key, Result);
+	}
+
+	Results.KeySort(TLess<FString>());
+
+	TArray<FString> Lines;
+	for (const TPair<FString, FToonShadeBenchmarkResult>& Pair : Results)
+	{
+		Lines.Add(Pair.Value.ToCSVLine());
+	}
+
+	FFileHelper::SaveStringToFile(FString::Join(Lines, LINE_TERMINATOR), *Path);
+}
+
+
+/** ベースラインから退行した内容 (時間・メモリ・出力) を返す */
+static TArray<FString> FindBenchmarkRegressions(const FToonShadeBenchmarkResult& Result, const FToonShadeBenchmarkResult& Baseline)
+{
+	const float RegressionThreshold = CVarToonShadePaintBenchmarkRegressionThreshold.GetValueOnGameThread();
+
+	TArray<FString> Regressions;
+
+	// GPU時間が取れない環境は経過時間で比較
+	const bool bHasGPUTime = Baseline.GPUMilliseconds > 0.0f && Result.GPUMilliseconds > 0.0f;
+	const float BaselineMilliseconds = bHasGPUTime ? Baseline.GPUMilliseconds : Baseline.WallMilliseconds;
+	const float ResultMilliseconds = bHasGPUTime ? Result.GPUMilliseconds : Result.WallMilliseconds;
+
+	if (BaselineMilliseconds > 0.0f && ResultMilliseconds > BaselineMilliseconds * (1.0f + RegressionThreshold))
+	{
+		Regressions.Add(FString::Printf(TEXT("%s regressed: %.3fms -> %.3fms (threshold %.0f%%)"),
+			*Result.Key, BaselineMilliseconds, ResultMilliseconds, RegressionThreshold * 100.0f));
+	}
+
+	if (Result.AllocatedBytes > Baseline.AllocatedBytes * (1.0 + RegressionThreshold))
+	{
+		Regressions.Add(FString::Printf(TEXT("%s allocates more memory: %lld -> %lld bytes"),
+			*Result.Key, Baseline.AllocatedBytes, Result.AllocatedBytes));
+	}
+
+	if (Result.Checksum != Baseline.Checksum)
+	{
+		Regressions.Add(FString::Printf(TEXT("%s output changed: checksum %08x -> %08x"),
+			*Result.Key, Baseline.Checksum, Result.Checksum));
+	}
+
+	return Regressions;
+}
+
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+/**
+ * 手続き生成した入力で閾値マップを焼き、Saved/ToonShadePaint/BenchmarkBaseline.csvと比べる
+ * 時間・メモリがr.ToonShadePaint.Benchmark.RegressionThresholdを超えて増えるか、出力のチェックサムが変わったら失敗します。
+ * ベースラインはToonShadePaint.UpdateBenchmarkBaselineで更新します。
+ */
+IMPLEMENT_COMPLEX_AUTOMATION_TEST(FToonShadePaintBenchmarkTest, "ToonShadePaint.Benchmark", EAutomationTestFlags::EditorContext | EAutomationTestFlags::PerfFilter)
+
+void FToonShadePaintBenchmarkTest::GetTests(TArray<FString>& OutBeautifiedNames, TArray<FString>& OutTestCommands) const
+{
+	for (const FToonShadeBenchmarkCase& Case : GatherBenchmarkCases(TArray<FString>()))
+	{
+		OutBeautifiedNames.Add(Case.GetKey());
+		OutTestCommands.Add(Case.GetKey());
+	}
+}
+
+bool FToonShadePaintBenchmarkTest::RunTest(const FString& Parameters)
+{
+	const TArray<FToonShadeBenchmarkCase> Cases = GatherBenchmarkCases(TArray<FString>());
+	const FToonShadeBenchmarkCase* Case = Cases.FindByPredicate([&Parameters](const FToonShadeBenchmarkCase& InCase) { return InCase.GetKey() == Parameters; });
+	if (Case == nullptr)
+	{
+		AddError(FString::Printf(TEXT("Unknown benchmark case '%s'"), *Parameters));
+		return false;
+	}
+
+	const FToonShadeBenchmarkResult Result = RunBenchmarkCase(nullptr, *Case);
+
+	AddInfo(FString::Printf(TEXT("Wall %.3fms, GPU %.3fms, Allocated %.1fMB, Checksum %08x"),
+		Result.WallMilliseconds, Result.GPUMilliseconds, Result.AllocatedBytes / (1024.0 * 1024.0), Result.Checksum));
+
+	SaveBenchmarkResults(FPaths::Combine(GetBenchmarkDir(), TEXT("BenchmarkResults.csv")), { Result });
+
+	const TMap<FString, FToonShadeBenchmarkResult> Baselines = LoadBenchmarkResults(FPaths::Combine(GetBenchmarkDir(), TEXT("BenchmarkBaseline.csv")));
+	const FToonShadeBenchmarkResult* Baseline = Baselines.Find(Result.Key);
+	if (Baseline == nullptr)
+	{
+		AddWarning(FString::Printf(TEXT("No baseline for %s. Run 'ToonShadePaint.UpdateBenchmarkBaseline' to record one."), *Result.Key));
+		return true;
+	}
+
+	for (const FString& Regression : FindBenchmarkRegressions(Result, *Baseline))
+	{
+		AddError(Regression);
+	}
+
+	return !HasAnyErrors();
+}
+
+#endif
+
+
+/** ベースラインを焼き直す (退行の判定はAutomation RunTests ToonShadePaint.Benchmarkで行う) */
+static void UpdateToonShadePaintBenchmarkBaseline(const TArray<FString>& Args, UWorld* World)
+{
+	const FString BaselinePath = FPaths::Combine(GetBenchmarkDir(), TEXT("BenchmarkBaseline.csv"));
+
+	TArray<FToonShadeBenchmarkResult> Results;
+	for (const FToonShadeBenchmarkCase& Case : GatherBenchmarkCases(Args))
+	{
+		const FToonShadeBenchmarkResult& Result = Results.Add_GetRef(RunBenchmarkCase(World, Case));
+
+		UE_LOG(LogToonShadePaint, Display, TEXT("Benchmark %s: Wall %.3fms, GPU %.3fms, Allocated %.1fMB, Checksum %08x"),
+			*Result.Key, Result.WallMilliseconds, Result.GPUMilliseconds, Result.AllocatedBytes / (1024.0 * 1024.0), Result.Checksum);
+	}
+
+	SaveBenchmarkResults(BaselinePath, Results);
+	UE_LOG(LogToonShadePaint, Display, TEXT("Benchmark baseline updated: %d case(s) in %s"), Results.Num(), *BaselinePath);
+}
+
+
+static FAutoConsoleCommandWithWorldAndArgs ToonShadePaintBenchmarkCommand(
+	TEXT("ToonShadePaint.UpdateBenchmarkBaseline"),
+	TEXT("Runs the threshold-map benchmark on procedural inputs and stores the results as the baseline.\n")
+	TEXT("Filters: Resolution=<n> Layers=<n> Radius=<n> Pattern=<Head|Islands|Stripes> Mode=<Propagation|Separable>\n")
+	TEXT("Regressions are checked by the automation test: Automation RunTests ToonShadePaint.Benchmark"),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&UpdateToonShadePaintBenchmarkBaseline));
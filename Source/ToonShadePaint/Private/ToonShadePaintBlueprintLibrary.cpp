@@ -2,13 +2,89 @@
 
 #include "ToonShadePaintBlueprintLibrary.h"
 #include "Engine/TextureRenderTarget2D.h"
+#include "Algo/AllOf.h"
 #include "Algo/Count.h"
+#include "Containers/Ticker.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "Misc/ScopedSlowTask.h"
+#include "UObject/ObjectKey.h"
 #include "DataDrivenShaderPlatformInfo.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+#include "ProfilingDebugging/RealtimeGPUProfiler.h"
+#include "RHIGPUReadback.h"
+#include "RenderingThread.h"
 #include "ToonShadeCaptureTargetActor.h"
+#include "ToonShadePaintBake.h"
+#include "ToonShadePaintMemory.h"
 
 
 DEFINE_LOG_CATEGORY(LogToonShadePaint);
 
+LLM_DEFINE_TAG(ToonShadePaint);
+
+DEFINE_STAT(STAT_ToonShadePaint_LastBakeMemory);
+DEFINE_STAT(STAT_ToonShadePaint_RetainedMemory);
+DEFINE_STAT(STAT_ToonShadePaint_CaptureTargetMemory);
+DEFINE_STAT(STAT_ToonShadePaint_CaptureAtlasMemory);
+
+CSV_DEFINE_CATEGORY(ToonShadePaint, true);
+
+DECLARE_GPU_STAT_NAMED(ToonShadePaint_SetupSeedFlags, TEXT("ToonShadePaint.SetupSeedFlags"));
+DECLARE_GPU_STAT_NAMED(ToonShadePaint_SetupPos, TEXT("ToonShadePaint.SetupPos"));
+DECLARE_GPU_STAT_NAMED(ToonShadePaint_EstimateMaxRadius, TEXT("ToonShadePaint.EstimateMaxRadius"));
+DECLARE_GPU_STAT_NAMED(ToonShadePaint_MirrorMap, TEXT("ToonShadePaint.MirrorMap"));
+DECLARE_GPU_STAT_NAMED(ToonShadePaint_TileClassify, TEXT("ToonShadePaint.TileClassify"));
+DECLARE_GPU_STAT_NAMED(ToonShadePaint_DistanceMapSetup, TEXT("ToonShadePaint.DistanceMapSetup"));
+DECLARE_GPU_STAT_NAMED(ToonShadePaint_DistanceMapIter, TEXT("ToonShadePaint.DistanceMapIter"));
+DECLARE_GPU_STAT_NAMED(ToonShadePaint_DistanceMapEDT, TEXT("ToonShadePaint.DistanceMapEDT"));
+DECLARE_GPU_STAT_NAMED(ToonShadePaint_SDFCalc, TEXT("ToonShadePaint.SDFCalc"));
+DECLARE_GPU_STAT_NAMED(ToonShadePaint_SDFMirror, TEXT("ToonShadePaint.SDFMirror"));
+DECLARE_GPU_STAT_NAMED(ToonShadePaint_SDFBlend, TEXT("ToonShadePaint.SDFBlend"));
+
+static TAutoConsoleVariable<float> CVarToonShadePaintMirrorMaxMismatchRatio(
+	TEXT("r.ToonShadePaint.Mirror.MaxMismatchRatio"),
+	0.01f,
+	TEXT("Largest fraction of texels without a symmetric counterpart before bMirrorSymmetry falls back to baking the whole map."),
+	ECVF_RenderThreadSafe);
+
+static TAutoConsoleVariable<int32> CVarToonShadePaintLayersInFlight(
+	TEXT("r.ToonShadePaint.LayersInFlight"),
+	2,
+	TEXT("Number of layers whose distance fields are dispatched interleaved. Each extra layer allocates its own distance textures."),
+	ECVF_RenderThreadSafe);
+
+static TAutoConsoleVariable<int32> CVarToonShadePaintTileClassification(
+	TEXT("r.ToonShadePaint.TileClassification"),
+	1,
+	TEXT("Skip 32x32 tiles that are invalid in every layer by dispatching the propagation, SDFCalc and SDFBlend passes indirectly over a list of valid tiles."),
+	ECVF_RenderThreadSafe);
+
+static TAutoConsoleVariable<int32> CVarToonShadePaintMemoryBudgetMB(
+	TEXT("r.ToonShadePaint.MemoryBudgetMB"),
+	0,
+	TEXT("Largest estimated VRAM a single bake may allocate. Over budget, the bake drops retained intermediates, then interleaved layers, and refuses if it still does not fit. 0 disables the check."),
+	ECVF_RenderThreadSafe);
+
+static TAutoConsoleVariable<int32> CVarToonShadePaintIslandRects(
+	TEXT("r.ToonShadePaint.IslandRects"),
+	1,
+	TEXT("Dispatch the distance passes once per UV island bounding rectangle instead of over the whole map. Requires r.ToonShadePaint.TileClassification."),
+	ECVF_RenderThreadSafe);
+
+static TAutoConsoleVariable<int32> CVarToonShadePaintConvergenceCheckInterval(
+	TEXT("r.ToonShadePaint.ConvergenceCheckInterval"),
+	4,
+	TEXT("Number of propagation passes between asynchronous readbacks of the changed texel count. A layer stops propagating once a whole interval changes nothing; MaxRadius stays the upper bound. 0 always runs MaxRadius passes."),
+	ECVF_RenderThreadSafe);
+
+static TAutoConsoleVariable<int32> CVarToonShadePaintDispatchesPerSlice(
+	TEXT("r.ToonShadePaint.DispatchesPerSlice"),
+	512,
+	TEXT("Dispatches a time-sliced bake (full, preview or dirty-rect) submits per slice before yielding the render thread, unless the caller passes its own count. Slices stop between propagation passes, so a slice may run over by one pass. 0 submits the whole bake at once."),
+	ECVF_Default);
+
 
 class FSetupSeedFlagsCS : public FGlobalShader
 {
@@ -20,6 +96,8 @@ public:
 		: FGlobalShader(Initializer)
 	{
 		LayerIndex.Bind(Initializer.ParameterMap, TEXT("LayerIndex"));
+		SampleScale.Bind(Initializer.ParameterMap, TEXT("SampleScale"));
+		DispatchOffset.Bind(Initializer.ParameterMap, TEXT("DispatchOffset"));
 		SeedTexture.Bind(Initializer.ParameterMap, TEXT("SeedTexture"));
 		RWSeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("RWSeedFlagsTexture"));
 	}
@@ -32,10 +110,14 @@ public:
 	void SetParameters(
 		FRHIBatchedShaderParameters& BatchedParameters,
 		uint32 InLayerIndex,
+		uint32 InSampleScale,
+		FIntPoint InDispatchOffset,
 		FRHITexture* InSeedTexture,
 		FRHIUnorderedAccessView* InRWSeedFlagsTexture)
 	{
 		SetShaderValue(BatchedParameters, LayerIndex, InLayerIndex);
+		SetShaderValue(BatchedParameters, SampleScale, InSampleScale);
+		SetShaderValue(BatchedParameters, DispatchOffset, InDispatchOffset);
 		SetTextureParameter(BatchedParameters, SeedTexture, InSeedTexture);
 		SetUAVParameter(BatchedParameters, RWSeedFlagsTexture, InRWSeedFlagsTexture);
 	}
@@ -47,6 +129,8 @@ public:
 
 private:
 	LAYOUT_FIELD(FShaderParameter, LayerIndex);
+	LAYOUT_FIELD(FShaderParameter, SampleScale);
+	LAYOUT_FIELD(FShaderParameter, DispatchOffset);
 	LAYOUT_FIELD(FShaderResourceParameter, SeedTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, RWSeedFlagsTexture);
 };
@@ -60,7 +144,10 @@ public:
 	explicit FSetupPosCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
 		: FGlobalShader(Initializer)
 	{
+		SampleScale.Bind(Initializer.ParameterMap, TEXT("SampleScale"));
+		SeedTexture.Bind(Initializer.ParameterMap, TEXT("SeedTexture"));
 		PositionTexture.Bind(Initializer.ParameterMap, TEXT("PositionTexture"));
+		PositionBoundsBuffer.Bind(Initializer.ParameterMap, TEXT("PositionBoundsBuffer"));
 		RWPositionTexture.Bind(Initializer.ParameterMap, TEXT("RWPositionTexture"));
 	}
 
@@ -71,23 +158,78 @@ public:
 
 	void SetParameters(
 		FRHIBatchedShaderParameters& BatchedParameters,
+		uint32 InSampleScale,
+		FRHITexture* InSeedTexture,
 		FRHITexture* InPositionTexture,
+		FRHIShaderResourceView* InPositionBoundsBuffer,
 		FRHIUnorderedAccessView* InRWPositionTexture)
 	{
+		SetShaderValue(BatchedParameters, SampleScale, InSampleScale);
+		SetTextureParameter(BatchedParameters, SeedTexture, InSeedTexture);
 		SetTextureParameter(BatchedParameters, PositionTexture, InPositionTexture);
+		SetSRVParameter(BatchedParameters, PositionBoundsBuffer, InPositionBoundsBuffer);
 		SetUAVParameter(BatchedParameters, RWPositionTexture, InRWPositionTexture);
 	}
 
 	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
 	{
+		UnsetSRVParameter(BatchedUnbinds, PositionBoundsBuffer);
 		UnsetUAVParameter(BatchedUnbinds, RWPositionTexture);
 	}
 
 private:
+	LAYOUT_FIELD(FShaderParameter, SampleScale);
+	LAYOUT_FIELD(FShaderResourceParameter, SeedTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, PositionTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, PositionBoundsBuffer);
 	LAYOUT_FIELD(FShaderResourceParameter, RWPositionTexture);
 };
 
+class FPositionBoundsCS : public FGlobalShader
+{
+	DECLARE_SHADER_TYPE(FPositionBoundsCS, Global);
+
+public:
+	FPositionBoundsCS() = default;
+	explicit FPositionBoundsCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer)
+	{
+		SampleScale.Bind(Initializer.ParameterMap, TEXT("SampleScale"));
+		SeedTexture.Bind(Initializer.ParameterMap, TEXT("SeedTexture"));
+		PositionTexture.Bind(Initializer.ParameterMap, TEXT("PositionTexture"));
+		RWPositionBoundsBuffer.Bind(Initializer.ParameterMap, TEXT("RWPositionBoundsBuffer"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsPCPlatform(Parameters.Platform) && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM6);
+	}
+
+	void SetParameters(
+		FRHIBatchedShaderParameters& BatchedParameters,
+		uint32 InSampleScale,
+		FRHITexture* InSeedTexture,
+		FRHITexture* InPositionTexture,
+		FRHIUnorderedAccessView* InRWPositionBoundsBuffer)
+	{
+		SetShaderValue(BatchedParameters, SampleScale, InSampleScale);
+		SetTextureParameter(BatchedParameters, SeedTexture, InSeedTexture);
+		SetTextureParameter(BatchedParameters, PositionTexture, InPositionTexture);
+		SetUAVParameter(BatchedParameters, RWPositionBoundsBuffer, InRWPositionBoundsBuffer);
+	}
+
+	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
+	{
+		UnsetUAVParameter(BatchedUnbinds, RWPositionBoundsBuffer);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderParameter, SampleScale);
+	LAYOUT_FIELD(FShaderResourceParameter, SeedTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, PositionTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWPositionBoundsBuffer);
+};
+
 class FDistanceMapSetupCS : public FGlobalShader
 {
 	DECLARE_SHADER_TYPE(FDistanceMapSetupCS, Global);
@@ -98,6 +240,7 @@ public:
 		: FGlobalShader(Initializer)
 	{
 		LayerIndex.Bind(Initializer.ParameterMap, TEXT("LayerIndex"));
+		DispatchOffset.Bind(Initializer.ParameterMap, TEXT("DispatchOffset"));
 		SeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("SeedFlagsTexture"));
 		RWSDFInnerTexture.Bind(Initializer.ParameterMap, TEXT("RWSDFInnerTexture"));
 		RWSDFOuterTexture.Bind(Initializer.ParameterMap, TEXT("RWSDFOuterTexture"));
@@ -111,11 +254,13 @@ public:
 	void SetParameters(
 		FRHIBatchedShaderParameters& BatchedParameters,
 		uint32 InLayerIndex,
+		FIntPoint InDispatchOffset,
 		FRHIShaderResourceView* InSeedFlagsTexture,
 		FRHIUnorderedAccessView* InRWSDFInnerTexture,
 		FRHIUnorderedAccessView* InRWSDFOuterTexture)
 	{
 		SetShaderValue(BatchedParameters, LayerIndex, InLayerIndex);
+		SetShaderValue(BatchedParameters, DispatchOffset, InDispatchOffset);
 		SetSRVParameter(BatchedParameters, SeedFlagsTexture, InSeedFlagsTexture);
 		SetUAVParameter(BatchedParameters, RWSDFInnerTexture, InRWSDFInnerTexture);
 		SetUAVParameter(BatchedParameters, RWSDFOuterTexture, InRWSDFOuterTexture);
@@ -130,6 +275,7 @@ public:
 
 private:
 	LAYOUT_FIELD(FShaderParameter, LayerIndex);
+	LAYOUT_FIELD(FShaderParameter, DispatchOffset);
 	LAYOUT_FIELD(FShaderResourceParameter, SeedFlagsTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, RWSDFInnerTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, RWSDFOuterTexture);
@@ -140,8 +286,10 @@ class FDistanceMapIterCS : public FGlobalShader
 	DECLARE_SHADER_TYPE(FDistanceMapIterCS, Global);
 
 	class FFlip : SHADER_PERMUTATION_BOOL("FLIP");
+	class FTileList : SHADER_PERMUTATION_BOOL("TILE_LIST");
+	class FCountChangedTexels : SHADER_PERMUTATION_BOOL("COUNT_CHANGED_TEXELS");
 
-	using FPermutationDomain = TShaderPermutationDomain<FFlip>;
+	using FPermutationDomain = TShaderPermutationDomain<FFlip, FTileList, FCountChangedTexels>;
 
 public:
 	FDistanceMapIterCS() = default;
@@ -149,12 +297,16 @@ public:
 		: FGlobalShader(Initializer)
 	{
 		LayerIndex.Bind(Initializer.ParameterMap, TEXT("LayerIndex"));
-		TextureSize.Bind(Initializer.ParameterMap, TEXT("TextureSize"));
+		DispatchOffset.Bind(Initializer.ParameterMap, TEXT("DispatchOffset"));
+		ValidRect.Bind(Initializer.ParameterMap, TEXT("ValidRect"));
 		Radius.Bind(Initializer.ParameterMap, TEXT("Radius"));
 		SeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("SeedFlagsTexture"));
 		PositionTexture.Bind(Initializer.ParameterMap, TEXT("PositionTexture"));
+		TileListBuffer.Bind(Initializer.ParameterMap, TEXT("TileListBuffer"));
 		RWSDFInnerTexture.Bind(Initializer.ParameterMap, TEXT("RWSDFInnerTexture"));
 		RWSDFOuterTexture.Bind(Initializer.ParameterMap, TEXT("RWSDFOuterTexture"));
+		ChangedTexelIndex.Bind(Initializer.ParameterMap, TEXT("ChangedTexelIndex"));
+		RWChangedTexelBuffer.Bind(Initializer.ParameterMap, TEXT("RWChangedTexelBuffer"));
 	}
 
 	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
@@ -165,38 +317,252 @@ public:
 	void SetParameters(
 		FRHIBatchedShaderParameters& BatchedParameters,
 		uint32 InLayerIndex,
-		FIntPoint InTextureSize,
+		FIntPoint InDispatchOffset,
+		FIntRect InValidRect,
 		int32 InRadius,
 		FRHIShaderResourceView* InSeedFlagsTexture,
 		FRHIShaderResourceView* InPositionTexture,
+		FRHIShaderResourceView* InTileListBuffer,
 		FRHIUnorderedAccessView* InRWSDFInnerTexture,
-		FRHIUnorderedAccessView* InRWSDFOuterTexture)
+		FRHIUnorderedAccessView* InRWSDFOuterTexture,
+		uint32 InChangedTexelIndex,
+		FRHIUnorderedAccessView* InRWChangedTexelBuffer)
 	{
 		SetShaderValue(BatchedParameters, LayerIndex, InLayerIndex);
-		SetShaderValue(BatchedParameters, TextureSize, InTextureSize);
+		SetShaderValue(BatchedParameters, DispatchOffset, InDispatchOffset);
+		SetShaderValue(BatchedParameters, ValidRect, InValidRect);
 		SetShaderValue(BatchedParameters, Radius, InRadius);
 		SetSRVParameter(BatchedParameters, SeedFlagsTexture, InSeedFlagsTexture);
 		SetSRVParameter(BatchedParameters, PositionTexture, InPositionTexture);
+		SetSRVParameter(BatchedParameters, TileListBuffer, InTileListBuffer);
 		SetUAVParameter(BatchedParameters, RWSDFInnerTexture, InRWSDFInnerTexture);
 		SetUAVParameter(BatchedParameters, RWSDFOuterTexture, InRWSDFOuterTexture);
+		SetShaderValue(BatchedParameters, ChangedTexelIndex, InChangedTexelIndex);
+		SetUAVParameter(BatchedParameters, RWChangedTexelBuffer, InRWChangedTexelBuffer);
 	}
 
 	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
 	{
 		UnsetSRVParameter(BatchedUnbinds, SeedFlagsTexture);
 		UnsetSRVParameter(BatchedUnbinds, PositionTexture);
+		UnsetSRVParameter(BatchedUnbinds, TileListBuffer);
 		UnsetUAVParameter(BatchedUnbinds, RWSDFInnerTexture);
 		UnsetUAVParameter(BatchedUnbinds, RWSDFOuterTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWChangedTexelBuffer);
 	}
 
 private:
 	LAYOUT_FIELD(FShaderParameter, LayerIndex);
-	LAYOUT_FIELD(FShaderParameter, TextureSize);
+	LAYOUT_FIELD(FShaderParameter, DispatchOffset);
+	LAYOUT_FIELD(FShaderParameter, ValidRect);
 	LAYOUT_FIELD(FShaderParameter, Radius);
 	LAYOUT_FIELD(FShaderResourceParameter, SeedFlagsTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, PositionTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, TileListBuffer);
+	LAYOUT_FIELD(FShaderResourceParameter, RWSDFInnerTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWSDFOuterTexture);
+	LAYOUT_FIELD(FShaderParameter, ChangedTexelIndex);
+	LAYOUT_FIELD(FShaderResourceParameter, RWChangedTexelBuffer);
+};
+
+class FDistanceMapEDTRowCS : public FGlobalShader
+{
+	DECLARE_SHADER_TYPE(FDistanceMapEDTRowCS, Global);
+
+public:
+	FDistanceMapEDTRowCS() = default;
+	explicit FDistanceMapEDTRowCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer)
+	{
+		LayerIndex.Bind(Initializer.ParameterMap, TEXT("LayerIndex"));
+		TextureSize.Bind(Initializer.ParameterMap, TEXT("TextureSize"));
+		SeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("SeedFlagsTexture"));
+		RWSDFInnerTexture.Bind(Initializer.ParameterMap, TEXT("RWSDFInnerTexture"));
+		RWSDFOuterTexture.Bind(Initializer.ParameterMap, TEXT("RWSDFOuterTexture"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsPCPlatform(Parameters.Platform) && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM6);
+	}
+
+	void SetParameters(
+		FRHIBatchedShaderParameters& BatchedParameters,
+		uint32 InLayerIndex,
+		FIntPoint InTextureSize,
+		FRHIShaderResourceView* InSeedFlagsTexture,
+		FRHIUnorderedAccessView* InRWSDFInnerTexture,
+		FRHIUnorderedAccessView* InRWSDFOuterTexture)
+	{
+		SetShaderValue(BatchedParameters, LayerIndex, InLayerIndex);
+		SetShaderValue(BatchedParameters, TextureSize, InTextureSize);
+		SetSRVParameter(BatchedParameters, SeedFlagsTexture, InSeedFlagsTexture);
+		SetUAVParameter(BatchedParameters, RWSDFInnerTexture, InRWSDFInnerTexture);
+		SetUAVParameter(BatchedParameters, RWSDFOuterTexture, InRWSDFOuterTexture);
+	}
+
+	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
+	{
+		UnsetSRVParameter(BatchedUnbinds, SeedFlagsTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWSDFInnerTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWSDFOuterTexture);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderParameter, LayerIndex);
+	LAYOUT_FIELD(FShaderParameter, TextureSize);
+	LAYOUT_FIELD(FShaderResourceParameter, SeedFlagsTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWSDFInnerTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWSDFOuterTexture);
+};
+
+class FDistanceMapEDTColumnCS : public FGlobalShader
+{
+	DECLARE_SHADER_TYPE(FDistanceMapEDTColumnCS, Global);
+
+public:
+	FDistanceMapEDTColumnCS() = default;
+	explicit FDistanceMapEDTColumnCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer)
+	{
+		TextureSize.Bind(Initializer.ParameterMap, TEXT("TextureSize"));
+		PositionTexture.Bind(Initializer.ParameterMap, TEXT("PositionTexture"));
+		RWSDFInnerTexture.Bind(Initializer.ParameterMap, TEXT("RWSDFInnerTexture"));
+		RWSDFOuterTexture.Bind(Initializer.ParameterMap, TEXT("RWSDFOuterTexture"));
+		RWEnvelopeTexture.Bind(Initializer.ParameterMap, TEXT("RWEnvelopeTexture"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsPCPlatform(Parameters.Platform) && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM6);
+	}
+
+	void SetParameters(
+		FRHIBatchedShaderParameters& BatchedParameters,
+		FIntPoint InTextureSize,
+		FRHIShaderResourceView* InPositionTexture,
+		FRHIUnorderedAccessView* InRWSDFInnerTexture,
+		FRHIUnorderedAccessView* InRWSDFOuterTexture,
+		FRHIUnorderedAccessView* InRWEnvelopeTexture)
+	{
+		SetShaderValue(BatchedParameters, TextureSize, InTextureSize);
+		SetSRVParameter(BatchedParameters, PositionTexture, InPositionTexture);
+		SetUAVParameter(BatchedParameters, RWSDFInnerTexture, InRWSDFInnerTexture);
+		SetUAVParameter(BatchedParameters, RWSDFOuterTexture, InRWSDFOuterTexture);
+		SetUAVParameter(BatchedParameters, RWEnvelopeTexture, InRWEnvelopeTexture);
+	}
+
+	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
+	{
+		UnsetSRVParameter(BatchedUnbinds, PositionTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWSDFInnerTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWSDFOuterTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWEnvelopeTexture);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderParameter, TextureSize);
+	LAYOUT_FIELD(FShaderResourceParameter, PositionTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, RWSDFInnerTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, RWSDFOuterTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWEnvelopeTexture);
+};
+
+class FDistanceExtentRowCS : public FGlobalShader
+{
+	DECLARE_SHADER_TYPE(FDistanceExtentRowCS, Global);
+
+public:
+	FDistanceExtentRowCS() = default;
+	explicit FDistanceExtentRowCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer)
+	{
+		LayerIndex.Bind(Initializer.ParameterMap, TEXT("LayerIndex"));
+		TextureSize.Bind(Initializer.ParameterMap, TEXT("TextureSize"));
+		SeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("SeedFlagsTexture"));
+		RWRowExtentTexture.Bind(Initializer.ParameterMap, TEXT("RWRowExtentTexture"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsPCPlatform(Parameters.Platform) && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM6);
+	}
+
+	void SetParameters(
+		FRHIBatchedShaderParameters& BatchedParameters,
+		uint32 InLayerIndex,
+		FIntPoint InTextureSize,
+		FRHIShaderResourceView* InSeedFlagsTexture,
+		FRHIUnorderedAccessView* InRWRowExtentTexture)
+	{
+		SetShaderValue(BatchedParameters, LayerIndex, InLayerIndex);
+		SetShaderValue(BatchedParameters, TextureSize, InTextureSize);
+		SetSRVParameter(BatchedParameters, SeedFlagsTexture, InSeedFlagsTexture);
+		SetUAVParameter(BatchedParameters, RWRowExtentTexture, InRWRowExtentTexture);
+	}
+
+	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
+	{
+		UnsetSRVParameter(BatchedUnbinds, SeedFlagsTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWRowExtentTexture);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderParameter, LayerIndex);
+	LAYOUT_FIELD(FShaderParameter, TextureSize);
+	LAYOUT_FIELD(FShaderResourceParameter, SeedFlagsTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWRowExtentTexture);
+};
+
+class FDistanceExtentColumnCS : public FGlobalShader
+{
+	DECLARE_SHADER_TYPE(FDistanceExtentColumnCS, Global);
+
+public:
+	FDistanceExtentColumnCS() = default;
+	explicit FDistanceExtentColumnCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer)
+	{
+		LayerIndex.Bind(Initializer.ParameterMap, TEXT("LayerIndex"));
+		TextureSize.Bind(Initializer.ParameterMap, TEXT("TextureSize"));
+		SeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("SeedFlagsTexture"));
+		RowExtentTexture.Bind(Initializer.ParameterMap, TEXT("RowExtentTexture"));
+		RWMaxExtentBuffer.Bind(Initializer.ParameterMap, TEXT("RWMaxExtentBuffer"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsPCPlatform(Parameters.Platform) && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM6);
+	}
+
+	void SetParameters(
+		FRHIBatchedShaderParameters& BatchedParameters,
+		uint32 InLayerIndex,
+		FIntPoint InTextureSize,
+		FRHIShaderResourceView* InSeedFlagsTexture,
+		FRHIShaderResourceView* InRowExtentTexture,
+		FRHIUnorderedAccessView* InRWMaxExtentBuffer)
+	{
+		SetShaderValue(BatchedParameters, LayerIndex, InLayerIndex);
+		SetShaderValue(BatchedParameters, TextureSize, InTextureSize);
+		SetSRVParameter(BatchedParameters, SeedFlagsTexture, InSeedFlagsTexture);
+		SetSRVParameter(BatchedParameters, RowExtentTexture, InRowExtentTexture);
+		SetUAVParameter(BatchedParameters, RWMaxExtentBuffer, InRWMaxExtentBuffer);
+	}
+
+	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
+	{
+		UnsetSRVParameter(BatchedUnbinds, SeedFlagsTexture);
+		UnsetSRVParameter(BatchedUnbinds, RowExtentTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWMaxExtentBuffer);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderParameter, LayerIndex);
+	LAYOUT_FIELD(FShaderParameter, TextureSize);
+	LAYOUT_FIELD(FShaderResourceParameter, SeedFlagsTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RowExtentTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWMaxExtentBuffer);
 };
 
 class FSDFCalcCS : public FGlobalShader
@@ -204,8 +570,9 @@ class FSDFCalcCS : public FGlobalShader
 	DECLARE_SHADER_TYPE(FSDFCalcCS, Global);
 
 	class FFlip : SHADER_PERMUTATION_BOOL("FLIP");
+	class FTileList : SHADER_PERMUTATION_BOOL("TILE_LIST");
 
-	using FPermutationDomain = TShaderPermutationDomain<FFlip>;
+	using FPermutationDomain = TShaderPermutationDomain<FFlip, FTileList>;
 
 public:
 	FSDFCalcCS() = default;
@@ -213,11 +580,15 @@ public:
 		: FGlobalShader(Initializer)
 	{
 		LayerIndex.Bind(Initializer.ParameterMap, TEXT("LayerIndex"));
+		SDFSliceIndex.Bind(Initializer.ParameterMap, TEXT("SDFSliceIndex"));
 		TextureSize.Bind(Initializer.ParameterMap, TEXT("TextureSize"));
+		DispatchOffset.Bind(Initializer.ParameterMap, TEXT("DispatchOffset"));
 		SeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("SeedFlagsTexture"));
 		PositionTexture.Bind(Initializer.ParameterMap, TEXT("PositionTexture"));
+		PositionBoundsBuffer.Bind(Initializer.ParameterMap, TEXT("PositionBoundsBuffer"));
 		SDFInnerTexture.Bind(Initializer.ParameterMap, TEXT("SDFInnerTexture"));
 		SDFOuterTexture.Bind(Initializer.ParameterMap, TEXT("SDFOuterTexture"));
+		TileListBuffer.Bind(Initializer.ParameterMap, TEXT("TileListBuffer"));
 		RWSDFTexture.Bind(Initializer.ParameterMap, TEXT("RWSDFTexture"));
 		RWMaxDistanceBuffer.Bind(Initializer.ParameterMap, TEXT("RWMaxDistanceBuffer"));
 	}
@@ -230,20 +601,28 @@ public:
 	void SetParameters(
 		FRHIBatchedShaderParameters& BatchedParameters,
 		uint32 InLayerIndex,
+		uint32 InSDFSliceIndex,
 		FIntPoint InTextureSize,
+		FIntPoint InDispatchOffset,
 		FRHIShaderResourceView* InSeedFlagsTexture,
 		FRHIShaderResourceView* InPositionTexture,
+		FRHIShaderResourceView* InPositionBoundsBuffer,
 		FRHIShaderResourceView* InSDFInnerTexture,
 		FRHIShaderResourceView* InSDFOuterTexture,
+		FRHIShaderResourceView* InTileListBuffer,
 		FRHIUnorderedAccessView* InRWSDFTexture,
 		FRHIUnorderedAccessView* InRWMaxDistanceBuffer)
 	{
 		SetShaderValue(BatchedParameters, LayerIndex, InLayerIndex);
+		SetShaderValue(BatchedParameters, SDFSliceIndex, InSDFSliceIndex);
 		SetShaderValue(BatchedParameters, TextureSize, InTextureSize);
+		SetShaderValue(BatchedParameters, DispatchOffset, InDispatchOffset);
 		SetSRVParameter(BatchedParameters, SeedFlagsTexture, InSeedFlagsTexture);
 		SetSRVParameter(BatchedParameters, PositionTexture, InPositionTexture);
+		SetSRVParameter(BatchedParameters, PositionBoundsBuffer, InPositionBoundsBuffer);
 		SetSRVParameter(BatchedParameters, SDFInnerTexture, InSDFInnerTexture);
 		SetSRVParameter(BatchedParameters, SDFOuterTexture, InSDFOuterTexture);
+		SetSRVParameter(BatchedParameters, TileListBuffer, InTileListBuffer);
 		SetUAVParameter(BatchedParameters, RWSDFTexture, InRWSDFTexture);
 		SetUAVParameter(BatchedParameters, RWMaxDistanceBuffer, InRWMaxDistanceBuffer);
 	}
@@ -252,35 +631,43 @@ public:
 	{
 		UnsetSRVParameter(BatchedUnbinds, SeedFlagsTexture);
 		UnsetSRVParameter(BatchedUnbinds, PositionTexture);
+		UnsetSRVParameter(BatchedUnbinds, PositionBoundsBuffer);
 		UnsetSRVParameter(BatchedUnbinds, SDFInnerTexture);
 		UnsetSRVParameter(BatchedUnbinds, SDFOuterTexture);
+		UnsetSRVParameter(BatchedUnbinds, TileListBuffer);
 		UnsetUAVParameter(BatchedUnbinds, RWSDFTexture);
 		UnsetUAVParameter(BatchedUnbinds, RWMaxDistanceBuffer);
 	}
 
 private:
 	LAYOUT_FIELD(FShaderParameter, LayerIndex);
+	LAYOUT_FIELD(FShaderParameter, SDFSliceIndex);
 	LAYOUT_FIELD(FShaderParameter, TextureSize);
+	LAYOUT_FIELD(FShaderParameter, DispatchOffset);
 	LAYOUT_FIELD(FShaderResourceParameter, SeedFlagsTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, PositionTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, PositionBoundsBuffer);
 	LAYOUT_FIELD(FShaderResourceParameter, SDFInnerTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, SDFOuterTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, TileListBuffer);
 	LAYOUT_FIELD(FShaderResourceParameter, RWSDFTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, RWMaxDistanceBuffer);
 };
 
-class FSDFNormalizedCS : public FGlobalShader
+class FSDFRegionMaxCS : public FGlobalShader
 {
-	DECLARE_SHADER_TYPE(FSDFNormalizedCS, Global);
+	DECLARE_SHADER_TYPE(FSDFRegionMaxCS, Global);
 
 public:
-	FSDFNormalizedCS() = default;
-	explicit FSDFNormalizedCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+	FSDFRegionMaxCS() = default;
+	explicit FSDFRegionMaxCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
 		: FGlobalShader(Initializer)
 	{
 		LayerIndex.Bind(Initializer.ParameterMap, TEXT("LayerIndex"));
-		MaxDistanceBuffer.Bind(Initializer.ParameterMap, TEXT("MaxDistanceBuffer"));
-		RWSDFNormalizedTexture.Bind(Initializer.ParameterMap, TEXT("RWSDFNormalizedTexture"));
+		DirtyRect.Bind(Initializer.ParameterMap, TEXT("DirtyRect"));
+		SeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("SeedFlagsTexture"));
+		SDFTexture.Bind(Initializer.ParameterMap, TEXT("SDFTexture"));
+		RWMaxDistanceBuffer.Bind(Initializer.ParameterMap, TEXT("RWMaxDistanceBuffer"));
 	}
 
 	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
@@ -291,44 +678,55 @@ public:
 	void SetParameters(
 		FRHIBatchedShaderParameters& BatchedParameters,
 		uint32 InLayerIndex,
-		FRHIShaderResourceView* InMaxDistanceBuffer,
-		FRHIUnorderedAccessView* InRWSDFNormalizedTexture)
+		FIntRect InDirtyRect,
+		FRHIShaderResourceView* InSeedFlagsTexture,
+		FRHIShaderResourceView* InSDFTexture,
+		FRHIUnorderedAccessView* InRWMaxDistanceBuffer)
 	{
 		SetShaderValue(BatchedParameters, LayerIndex, InLayerIndex);
-		SetSRVParameter(BatchedParameters, MaxDistanceBuffer, InMaxDistanceBuffer);
-		SetUAVParameter(BatchedParameters, RWSDFNormalizedTexture, InRWSDFNormalizedTexture);
+		SetShaderValue(BatchedParameters, DirtyRect, InDirtyRect);
+		SetSRVParameter(BatchedParameters, SeedFlagsTexture, InSeedFlagsTexture);
+		SetSRVParameter(BatchedParameters, SDFTexture, InSDFTexture);
+		SetUAVParameter(BatchedParameters, RWMaxDistanceBuffer, InRWMaxDistanceBuffer);
 	}
 
 	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
 	{
-		UnsetSRVParameter(BatchedUnbinds, MaxDistanceBuffer);
-		UnsetUAVParameter(BatchedUnbinds, RWSDFNormalizedTexture);
+		UnsetSRVParameter(BatchedUnbinds, SeedFlagsTexture);
+		UnsetSRVParameter(BatchedUnbinds, SDFTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWMaxDistanceBuffer);
 	}
 
 private:
 	LAYOUT_FIELD(FShaderParameter, LayerIndex);
-	LAYOUT_FIELD(FShaderResourceParameter, MaxDistanceBuffer);
-	LAYOUT_FIELD(FShaderResourceParameter, RWSDFNormalizedTexture);
+	LAYOUT_FIELD(FShaderParameter, DirtyRect);
+	LAYOUT_FIELD(FShaderResourceParameter, SeedFlagsTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, SDFTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWMaxDistanceBuffer);
 };
 
 class FSDFBlendCS : public FGlobalShader
 {
 	DECLARE_SHADER_TYPE(FSDFBlendCS, Global);
 
-	class FFlip : SHADER_PERMUTATION_BOOL("FLIP");
+	class FLayerPair : SHADER_PERMUTATION_BOOL("LAYER_PAIR");
+	class FTileList : SHADER_PERMUTATION_BOOL("TILE_LIST");
 
-	using FPermutationDomain = TShaderPermutationDomain<FFlip>;
+	using FPermutationDomain = TShaderPermutationDomain<FLayerPair, FTileList>;
 
 public:
 	FSDFBlendCS() = default;
 	explicit FSDFBlendCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
 		: FGlobalShader(Initializer)
 	{
-		Start.Bind(Initializer.ParameterMap, TEXT("Start"));
-		End.Bind(Initializer.ParameterMap, TEXT("End"));
+		NumLayers.Bind(Initializer.ParameterMap, TEXT("NumLayers"));
 		LayerIndex.Bind(Initializer.ParameterMap, TEXT("LayerIndex"));
+		NumSDFSlices.Bind(Initializer.ParameterMap, TEXT("NumSDFSlices"));
 		SeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("SeedFlagsTexture"));
-		SDFNormalizedTexture.Bind(Initializer.ParameterMap, TEXT("SDFNormalizedTexture"));
+		SDFTexture.Bind(Initializer.ParameterMap, TEXT("SDFTexture"));
+		MaxDistanceBuffer.Bind(Initializer.ParameterMap, TEXT("MaxDistanceBuffer"));
+		TileListBuffer.Bind(Initializer.ParameterMap, TEXT("TileListBuffer"));
+		RWAccumulatedThresholdTexture.Bind(Initializer.ParameterMap, TEXT("RWAccumulatedThresholdTexture"));
 		RWShadowThresholdTexture.Bind(Initializer.ParameterMap, TEXT("RWShadowThresholdTexture"));
 	}
 
@@ -339,52 +737,62 @@ public:
 
 	void SetParameters(
 		FRHIBatchedShaderParameters& BatchedParameters,
-		float InStart,
-		float InEnd,
+		uint32 InNumLayers,
 		uint32 InLayerIndex,
+		uint32 InNumSDFSlices,
 		FRHIShaderResourceView* InSeedFlagsTexture,
-		FRHIShaderResourceView* InSDFNormalizedTexture,
+		FRHIShaderResourceView* InSDFTexture,
+		FRHIShaderResourceView* InMaxDistanceBuffer,
+		FRHIShaderResourceView* InTileListBuffer,
+		FRHIUnorderedAccessView* InRWAccumulatedThresholdTexture,
 		FRHIUnorderedAccessView* InRWShadowThresholdTexture)
 	{
-		SetShaderValue(BatchedParameters, Start, InStart);
-		SetShaderValue(BatchedParameters, End, InEnd);
+		SetShaderValue(BatchedParameters, NumLayers, InNumLayers);
 		SetShaderValue(BatchedParameters, LayerIndex, InLayerIndex);
+		SetShaderValue(BatchedParameters, NumSDFSlices, InNumSDFSlices);
 		SetSRVParameter(BatchedParameters, SeedFlagsTexture, InSeedFlagsTexture);
-		SetSRVParameter(BatchedParameters, SDFNormalizedTexture, InSDFNormalizedTexture);
+		SetSRVParameter(BatchedParameters, SDFTexture, InSDFTexture);
+		SetSRVParameter(BatchedParameters, MaxDistanceBuffer, InMaxDistanceBuffer);
+		SetSRVParameter(BatchedParameters, TileListBuffer, InTileListBuffer);
+		SetUAVParameter(BatchedParameters, RWAccumulatedThresholdTexture, InRWAccumulatedThresholdTexture);
 		SetUAVParameter(BatchedParameters, RWShadowThresholdTexture, InRWShadowThresholdTexture);
 	}
 
 	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
 	{
 		UnsetSRVParameter(BatchedUnbinds, SeedFlagsTexture);
-		UnsetSRVParameter(BatchedUnbinds, SDFNormalizedTexture);
+		UnsetSRVParameter(BatchedUnbinds, SDFTexture);
+		UnsetSRVParameter(BatchedUnbinds, MaxDistanceBuffer);
+		UnsetSRVParameter(BatchedUnbinds, TileListBuffer);
+		UnsetUAVParameter(BatchedUnbinds, RWAccumulatedThresholdTexture);
 		UnsetUAVParameter(BatchedUnbinds, RWShadowThresholdTexture);
 	}
 
 private:
-	LAYOUT_FIELD(FShaderParameter, Start);
-	LAYOUT_FIELD(FShaderParameter, End);
+	LAYOUT_FIELD(FShaderParameter, NumLayers);
 	LAYOUT_FIELD(FShaderParameter, LayerIndex);
+	LAYOUT_FIELD(FShaderParameter, NumSDFSlices);
 	LAYOUT_FIELD(FShaderResourceParameter, SeedFlagsTexture);
-	LAYOUT_FIELD(FShaderResourceParameter, SDFNormalizedTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, SDFTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, MaxDistanceBuffer);
+	LAYOUT_FIELD(FShaderResourceParameter, TileListBuffer);
+	LAYOUT_FIELD(FShaderResourceParameter, RWAccumulatedThresholdTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, RWShadowThresholdTexture);
 };
 
-class FShadowThresholdCS : public FGlobalShader
+class FPreviewUpsampleCS : public FGlobalShader
 {
-	DECLARE_SHADER_TYPE(FShadowThresholdCS, Global);
-
-	class FFlip : SHADER_PERMUTATION_BOOL("FLIP");
-
-	using FPermutationDomain = TShaderPermutationDomain<FFlip>;
+	DECLARE_SHADER_TYPE(FPreviewUpsampleCS, Global);
 
 public:
-	FShadowThresholdCS() = default;
-	explicit FShadowThresholdCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+	FPreviewUpsampleCS() = default;
+	explicit FPreviewUpsampleCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
 		: FGlobalShader(Initializer)
 	{
-		SeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("SeedFlagsTexture"));
-		ShadowThresholdTexture.Bind(Initializer.ParameterMap, TEXT("ShadowThresholdTexture"));
+		SampleScale.Bind(Initializer.ParameterMap, TEXT("SampleScale"));
+		PreviewSize.Bind(Initializer.ParameterMap, TEXT("PreviewSize"));
+		SeedTexture.Bind(Initializer.ParameterMap, TEXT("SeedTexture"));
+		PreviewShadowThresholdTexture.Bind(Initializer.ParameterMap, TEXT("PreviewShadowThresholdTexture"));
 		RWShadowThresholdTexture.Bind(Initializer.ParameterMap, TEXT("RWShadowThresholdTexture"));
 	}
 
@@ -395,389 +803,3147 @@ public:
 
 	void SetParameters(
 		FRHIBatchedShaderParameters& BatchedParameters,
-		FRHIShaderResourceView* InSeedFlagsTexture,
-		FRHIShaderResourceView* InShadowThresholdTexture,
+		uint32 InSampleScale,
+		FIntPoint InPreviewSize,
+		FRHITexture* InSeedTexture,
+		FRHIShaderResourceView* InPreviewShadowThresholdTexture,
 		FRHIUnorderedAccessView* InRWShadowThresholdTexture)
 	{
-		SetSRVParameter(BatchedParameters, SeedFlagsTexture, InSeedFlagsTexture);
-		SetSRVParameter(BatchedParameters, ShadowThresholdTexture, InShadowThresholdTexture);
+		SetShaderValue(BatchedParameters, SampleScale, InSampleScale);
+		SetShaderValue(BatchedParameters, PreviewSize, InPreviewSize);
+		SetTextureParameter(BatchedParameters, SeedTexture, InSeedTexture);
+		SetSRVParameter(BatchedParameters, PreviewShadowThresholdTexture, InPreviewShadowThresholdTexture);
 		SetUAVParameter(BatchedParameters, RWShadowThresholdTexture, InRWShadowThresholdTexture);
 	}
 
 	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
 	{
-		UnsetSRVParameter(BatchedUnbinds, SeedFlagsTexture);
-		UnsetSRVParameter(BatchedUnbinds, ShadowThresholdTexture);
+		UnsetSRVParameter(BatchedUnbinds, PreviewShadowThresholdTexture);
 		UnsetUAVParameter(BatchedUnbinds, RWShadowThresholdTexture);
 	}
 
 private:
-	LAYOUT_FIELD(FShaderResourceParameter, SeedFlagsTexture);
-	LAYOUT_FIELD(FShaderResourceParameter, ShadowThresholdTexture);
+	LAYOUT_FIELD(FShaderParameter, SampleScale);
+	LAYOUT_FIELD(FShaderParameter, PreviewSize);
+	LAYOUT_FIELD(FShaderResourceParameter, SeedTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, PreviewShadowThresholdTexture);
 	LAYOUT_FIELD(FShaderResourceParameter, RWShadowThresholdTexture);
 };
 
+class FPositionTileBoundsCS : public FGlobalShader
+{
+	DECLARE_SHADER_TYPE(FPositionTileBoundsCS, Global);
 
-IMPLEMENT_SHADER_TYPE(, FSetupSeedFlagsCS,		TEXT("/Plugin/ToonShadePaint/Private/SetupSeedFlags.usf"),		TEXT("MainCS"), SF_Compute);
-IMPLEMENT_SHADER_TYPE(, FSetupPosCS,			TEXT("/Plugin/ToonShadePaint/Private/SetupPos.usf"),			TEXT("MainCS"), SF_Compute);
-IMPLEMENT_SHADER_TYPE(, FDistanceMapSetupCS,	TEXT("/Plugin/ToonShadePaint/Private/DistanceMapSetup.usf"),	TEXT("MainCS"), SF_Compute);
-IMPLEMENT_SHADER_TYPE(, FDistanceMapIterCS,		TEXT("/Plugin/ToonShadePaint/Private/DistanceMapIter.usf"),		TEXT("MainCS"), SF_Compute);
-IMPLEMENT_SHADER_TYPE(, FSDFCalcCS,				TEXT("/Plugin/ToonShadePaint/Private/SDFCalc.usf"),				TEXT("MainCS"), SF_Compute);
-IMPLEMENT_SHADER_TYPE(, FSDFNormalizedCS,		TEXT("/Plugin/ToonShadePaint/Private/SDFNormalized.usf"),		TEXT("MainCS"), SF_Compute);
-IMPLEMENT_SHADER_TYPE(, FSDFBlendCS,			TEXT("/Plugin/ToonShadePaint/Private/SDFBlend.usf"),			TEXT("MainCS"), SF_Compute);
-IMPLEMENT_SHADER_TYPE(, FShadowThresholdCS,		TEXT("/Plugin/ToonShadePaint/Private/ShadowThreshold.usf"),		TEXT("MainCS"), SF_Compute);
+public:
+	FPositionTileBoundsCS() = default;
+	explicit FPositionTileBoundsCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer)
+	{
+		NumTilesX.Bind(Initializer.ParameterMap, TEXT("NumTilesX"));
+		SeedTexture.Bind(Initializer.ParameterMap, TEXT("SeedTexture"));
+		PositionTexture.Bind(Initializer.ParameterMap, TEXT("PositionTexture"));
+		RWTileBoundsBuffer.Bind(Initializer.ParameterMap, TEXT("RWTileBoundsBuffer"));
+	}
 
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsPCPlatform(Parameters.Platform) && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM6);
+	}
 
-static void Initialize2DArray(FRHICommandListBase& RHICmdList, FTextureRWBuffer& SeedFlagsTexture, const TCHAR* InDebugName, uint32 BytesPerElement, uint32 SizeX, uint32 SizeY, int32 ArraySize, EPixelFormat Format, ETextureCreateFlags Flags)
+	void SetParameters(
+		FRHIBatchedShaderParameters& BatchedParameters,
+		uint32 InNumTilesX,
+		FRHITexture* InSeedTexture,
+		FRHITexture* InPositionTexture,
+		FRHIUnorderedAccessView* InRWTileBoundsBuffer)
+	{
+		SetShaderValue(BatchedParameters, NumTilesX, InNumTilesX);
+		SetTextureParameter(BatchedParameters, SeedTexture, InSeedTexture);
+		SetTextureParameter(BatchedParameters, PositionTexture, InPositionTexture);
+		SetUAVParameter(BatchedParameters, RWTileBoundsBuffer, InRWTileBoundsBuffer);
+	}
+
+	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
+	{
+		UnsetUAVParameter(BatchedUnbinds, RWTileBoundsBuffer);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderParameter, NumTilesX);
+	LAYOUT_FIELD(FShaderResourceParameter, SeedTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, PositionTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWTileBoundsBuffer);
+};
+
+class FMirrorMapCS : public FGlobalShader
+{
+	DECLARE_SHADER_TYPE(FMirrorMapCS, Global);
+
+public:
+	FMirrorMapCS() = default;
+	explicit FMirrorMapCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer)
+	{
+		TextureSize.Bind(Initializer.ParameterMap, TEXT("TextureSize"));
+		NumLayers.Bind(Initializer.ParameterMap, TEXT("NumLayers"));
+		MirrorCenter.Bind(Initializer.ParameterMap, TEXT("MirrorCenter"));
+		MirrorNormal.Bind(Initializer.ParameterMap, TEXT("MirrorNormal"));
+		SeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("SeedFlagsTexture"));
+		PositionTexture.Bind(Initializer.ParameterMap, TEXT("PositionTexture"));
+		PositionBoundsBuffer.Bind(Initializer.ParameterMap, TEXT("PositionBoundsBuffer"));
+		RWMirrorSourceTexture.Bind(Initializer.ParameterMap, TEXT("RWMirrorSourceTexture"));
+		RWMirrorStatsBuffer.Bind(Initializer.ParameterMap, TEXT("RWMirrorStatsBuffer"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsPCPlatform(Parameters.Platform) && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM6);
+	}
+
+	void SetParameters(
+		FRHIBatchedShaderParameters& BatchedParameters,
+		FIntPoint InTextureSize,
+		uint32 InNumLayers,
+		FVector3f InMirrorCenter,
+		FVector3f InMirrorNormal,
+		FRHIShaderResourceView* InSeedFlagsTexture,
+		FRHIShaderResourceView* InPositionTexture,
+		FRHIShaderResourceView* InPositionBoundsBuffer,
+		FRHIUnorderedAccessView* InRWMirrorSourceTexture,
+		FRHIUnorderedAccessView* InRWMirrorStatsBuffer)
+	{
+		SetShaderValue(BatchedParameters, TextureSize, InTextureSize);
+		SetShaderValue(BatchedParameters, NumLayers, InNumLayers);
+		SetShaderValue(BatchedParameters, MirrorCenter, InMirrorCenter);
+		SetShaderValue(BatchedParameters, MirrorNormal, InMirrorNormal);
+		SetSRVParameter(BatchedParameters, SeedFlagsTexture, InSeedFlagsTexture);
+		SetSRVParameter(BatchedParameters, PositionTexture, InPositionTexture);
+		SetSRVParameter(BatchedParameters, PositionBoundsBuffer, InPositionBoundsBuffer);
+		SetUAVParameter(BatchedParameters, RWMirrorSourceTexture, InRWMirrorSourceTexture);
+		SetUAVParameter(BatchedParameters, RWMirrorStatsBuffer, InRWMirrorStatsBuffer);
+	}
+
+	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
+	{
+		UnsetSRVParameter(BatchedUnbinds, SeedFlagsTexture);
+		UnsetSRVParameter(BatchedUnbinds, PositionTexture);
+		UnsetSRVParameter(BatchedUnbinds, PositionBoundsBuffer);
+		UnsetUAVParameter(BatchedUnbinds, RWMirrorSourceTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWMirrorStatsBuffer);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderParameter, TextureSize);
+	LAYOUT_FIELD(FShaderParameter, NumLayers);
+	LAYOUT_FIELD(FShaderParameter, MirrorCenter);
+	LAYOUT_FIELD(FShaderParameter, MirrorNormal);
+	LAYOUT_FIELD(FShaderResourceParameter, SeedFlagsTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, PositionTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, PositionBoundsBuffer);
+	LAYOUT_FIELD(FShaderResourceParameter, RWMirrorSourceTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWMirrorStatsBuffer);
+};
+
+class FSDFMirrorCS : public FGlobalShader
+{
+	DECLARE_SHADER_TYPE(FSDFMirrorCS, Global);
+
+public:
+	FSDFMirrorCS() = default;
+	explicit FSDFMirrorCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer)
+	{
+		TextureSize.Bind(Initializer.ParameterMap, TEXT("TextureSize"));
+		SliceIndex.Bind(Initializer.ParameterMap, TEXT("SliceIndex"));
+		MirrorSourceTexture.Bind(Initializer.ParameterMap, TEXT("MirrorSourceTexture"));
+		RWSDFTexture.Bind(Initializer.ParameterMap, TEXT("RWSDFTexture"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsPCPlatform(Parameters.Platform) && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM6);
+	}
+
+	void SetParameters(
+		FRHIBatchedShaderParameters& BatchedParameters,
+		FIntPoint InTextureSize,
+		uint32 InSliceIndex,
+		FRHIShaderResourceView* InMirrorSourceTexture,
+		FRHIUnorderedAccessView* InRWSDFTexture)
+	{
+		SetShaderValue(BatchedParameters, TextureSize, InTextureSize);
+		SetShaderValue(BatchedParameters, SliceIndex, InSliceIndex);
+		SetSRVParameter(BatchedParameters, MirrorSourceTexture, InMirrorSourceTexture);
+		SetUAVParameter(BatchedParameters, RWSDFTexture, InRWSDFTexture);
+	}
+
+	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
+	{
+		UnsetSRVParameter(BatchedUnbinds, MirrorSourceTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWSDFTexture);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderParameter, TextureSize);
+	LAYOUT_FIELD(FShaderParameter, SliceIndex);
+	LAYOUT_FIELD(FShaderResourceParameter, MirrorSourceTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWSDFTexture);
+};
+
+class FTileClassifyCS : public FGlobalShader
+{
+	DECLARE_SHADER_TYPE(FTileClassifyCS, Global);
+
+public:
+	FTileClassifyCS() = default;
+	explicit FTileClassifyCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer)
+	{
+		NumLayers.Bind(Initializer.ParameterMap, TEXT("NumLayers"));
+		SeedFlagsTexture.Bind(Initializer.ParameterMap, TEXT("SeedFlagsTexture"));
+		RWTileListBuffer.Bind(Initializer.ParameterMap, TEXT("RWTileListBuffer"));
+		RWTileIndirectArgsBuffer.Bind(Initializer.ParameterMap, TEXT("RWTileIndirectArgsBuffer"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsPCPlatform(Parameters.Platform) && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM6);
+	}
+
+	void SetParameters(
+		FRHIBatchedShaderParameters& BatchedParameters,
+		uint32 InNumLayers,
+		FRHIShaderResourceView* InSeedFlagsTexture,
+		FRHIUnorderedAccessView* InRWTileListBuffer,
+		FRHIUnorderedAccessView* InRWTileIndirectArgsBuffer)
+	{
+		SetShaderValue(BatchedParameters, NumLayers, InNumLayers);
+		SetSRVParameter(BatchedParameters, SeedFlagsTexture, InSeedFlagsTexture);
+		SetUAVParameter(BatchedParameters, RWTileListBuffer, InRWTileListBuffer);
+		SetUAVParameter(BatchedParameters, RWTileIndirectArgsBuffer, InRWTileIndirectArgsBuffer);
+	}
+
+	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
+	{
+		UnsetSRVParameter(BatchedUnbinds, SeedFlagsTexture);
+		UnsetUAVParameter(BatchedUnbinds, RWTileListBuffer);
+		UnsetUAVParameter(BatchedUnbinds, RWTileIndirectArgsBuffer);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderParameter, NumLayers);
+	LAYOUT_FIELD(FShaderResourceParameter, SeedFlagsTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWTileListBuffer);
+	LAYOUT_FIELD(FShaderResourceParameter, RWTileIndirectArgsBuffer);
+};
+
+
+IMPLEMENT_SHADER_TYPE(, FSetupSeedFlagsCS,		TEXT("/Plugin/ToonShadePaint/Private/SetupSeedFlags.usf"),		TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FSetupPosCS,			TEXT("/Plugin/ToonShadePaint/Private/SetupPos.usf"),			TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FPositionBoundsCS,		TEXT("/Plugin/ToonShadePaint/Private/PositionBounds.usf"),		TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FDistanceMapSetupCS,	TEXT("/Plugin/ToonShadePaint/Private/DistanceMapSetup.usf"),	TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FDistanceMapIterCS,		TEXT("/Plugin/ToonShadePaint/Private/DistanceMapIter.usf"),		TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FDistanceMapEDTRowCS,	TEXT("/Plugin/ToonShadePaint/Private/DistanceMapEDTRow.usf"),	TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FDistanceMapEDTColumnCS,	TEXT("/Plugin/ToonShadePaint/Private/DistanceMapEDTColumn.usf"),	TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FDistanceExtentRowCS,	TEXT("/Plugin/ToonShadePaint/Private/DistanceExtentRow.usf"),	TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FDistanceExtentColumnCS,	TEXT("/Plugin/ToonShadePaint/Private/DistanceExtentColumn.usf"),	TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FSDFCalcCS,				TEXT("/Plugin/ToonShadePaint/Private/SDFCalc.usf"),				TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FSDFRegionMaxCS,		TEXT("/Plugin/ToonShadePaint/Private/SDFRegionMax.usf"),		TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FSDFBlendCS,			TEXT("/Plugin/ToonShadePaint/Private/SDFBlend.usf"),			TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FPreviewUpsampleCS,		TEXT("/Plugin/ToonShadePaint/Private/PreviewUpsample.usf"),		TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FPositionTileBoundsCS,	TEXT("/Plugin/ToonShadePaint/Private/PositionTileBounds.usf"),	TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FMirrorMapCS,			TEXT("/Plugin/ToonShadePaint/Private/MirrorMap.usf"),			TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FSDFMirrorCS,			TEXT("/Plugin/ToonShadePaint/Private/SDFMirror.usf"),			TEXT("MainCS"), SF_Compute);
+IMPLEMENT_SHADER_TYPE(, FTileClassifyCS,		TEXT("/Plugin/ToonShadePaint/Private/TileClassify.usf"),		TEXT("MainCS"), SF_Compute);
+
+
+static const char* GetStageName(EToonShadeBakeStage Stage)
+{
+	switch (Stage)
+	{
+	case EToonShadeBakeStage::SetupSeedFlags:
+		return "SetupSeedFlags";
+	case EToonShadeBakeStage::SetupPos:
+		return "SetupPos";
+	case EToonShadeBakeStage::EstimateMaxRadius:
+		return "EstimateMaxRadius";
+	case EToonShadeBakeStage::MirrorMap:
+		return "MirrorMap";
+	case EToonShadeBakeStage::TileClassify:
+		return "TileClassify";
+	case EToonShadeBakeStage::DistanceMapSetup:
+		return "DistanceMapSetup";
+	case EToonShadeBakeStage::DistanceMapIter:
+		return "DistanceMapIter";
+	case EToonShadeBakeStage::DistanceMapEDT:
+		return "DistanceMapEDT";
+	case EToonShadeBakeStage::SDFCalc:
+		return "SDFCalc";
+	case EToonShadeBakeStage::SDFMirror:
+		return "SDFMirror";
+	case EToonShadeBakeStage::SDFBlend:
+		return "SDFBlend";
+	default:
+		return "Unknown";
+	}
+}
+
+
+/**
+ * ステージ毎のGPU時間をタイムスタンプクエリで集計
+ * 同じステージを複数回(レイヤー毎)計測した場合は合算します。
+ */
+class FToonShadeStageTimer
+{
+public:
+	void Begin(FRHICommandListImmediate& RHICmdList, EToonShadeBakeStage Stage)
+	{
+		FQueryPair& QueryPair = QueryPairs.AddDefaulted_GetRef();
+		QueryPair.Stage = Stage;
+		QueryPair.Begin = RHICreateRenderQuery(RQT_AbsoluteTime);
+		QueryPair.End = RHICreateRenderQuery(RQT_AbsoluteTime);
+		RHICmdList.EndRenderQuery(QueryPair.Begin);
+	}
+
+	void End(FRHICommandListImmediate& RHICmdList)
+	{
+		RHICmdList.EndRenderQuery(QueryPairs.Last().End);
+	}
+
+	void AddDispatch(EToonShadeBakeStage Stage, int32 InNumDispatches = 1)
+	{
+		NumDispatches[static_cast<int32>(Stage)] += InNumDispatches;
+	}
+
+	/** 全ステージのディスパッチ回数 */
+	int32 GetNumDispatches() const
+	{
+		int32 TotalDispatches = 0;
+		for (int32 StageDispatches : NumDispatches)
+		{
+			TotalDispatches += StageDispatches;
+		}
+		return TotalDispatches;
+	}
+
+	/**
+	 * 全ディスパッチの後に呼んで集計する
+	 * bWaitがfalseなら結果の揃っていないクエリがある時はOutStatsを書き換えずにfalseを返すので、後で呼び直すこと。
+	 */
+	bool Resolve(FToonShadeBakeStats& OutStats, bool bWait) const
+	{
+		double Milliseconds[static_cast<int32>(EToonShadeBakeStage::Num)] = {};
+
+		for (const FQueryPair& QueryPair : QueryPairs)
+		{
+			uint64 BeginMicroseconds = 0;
+			uint64 EndMicroseconds = 0;
+			const bool bHasBegin = RHIGetRenderQueryResult(QueryPair.Begin, BeginMicroseconds, bWait);
+			const bool bHasEnd = bHasBegin && RHIGetRenderQueryResult(QueryPair.End, EndMicroseconds, bWait);
+			if (!bHasEnd && !bWait)
+			{
+				return false;  // GPUがまだ届いていない
+			}
+
+			if (bHasEnd && EndMicroseconds > BeginMicroseconds)
+			{
+				Milliseconds[static_cast<int32>(QueryPair.Stage)] += (EndMicroseconds - BeginMicroseconds) / 1000.0;
+			}
+		}
+
+		OutStats.Stages.Reset();
+		OutStats.GPUMilliseconds = 0.0f;
+		OutStats.NumDispatches = 0;
+
+		for (int32 StageIndex = 0; StageIndex < static_cast<int32>(EToonShadeBakeStage::Num); ++StageIndex)
+		{
+			if (NumDispatches[StageIndex] == 0)
+			{
+				continue;  // 通らなかったステージ
+			}
+
+			FToonShadeBakeStageStats& StageStats = OutStats.Stages.AddDefaulted_GetRef();
+			StageStats.Stage = static_cast<EToonShadeBakeStage>(StageIndex);
+			StageStats.Milliseconds = static_cast<float>(Milliseconds[StageIndex]);
+			StageStats.NumDispatches = NumDispatches[StageIndex];
+
+			OutStats.GPUMilliseconds += StageStats.Milliseconds;
+			OutStats.NumDispatches += StageStats.NumDispatches;
+
+#if CSV_PROFILER
+			FCsvProfiler::RecordCustomStat(GetStageName(StageStats.Stage), CSV_CATEGORY_INDEX(ToonShadePaint), StageStats.Milliseconds, ECsvCustomStatOp::Set);
+#endif
+		}
+
+		return true;
+	}
+
+private:
+	struct FQueryPair
+	{
+		EToonShadeBakeStage Stage;
+		FRenderQueryRHIRef Begin;
+		FRenderQueryRHIRef End;
+	};
+
+	TArray<FQueryPair> QueryPairs;
+
+	int32 NumDispatches[static_cast<int32>(EToonShadeBakeStage::Num)] = {};
+};
+
+
+class FToonShadeStageScope
+{
+public:
+	FToonShadeStageScope(FRHICommandListImmediate& InRHICmdList, FToonShadeStageTimer& InStageTimer, EToonShadeBakeStage Stage)
+		: RHICmdList(InRHICmdList)
+		, StageTimer(InStageTimer)
+	{
+		StageTimer.Begin(RHICmdList, Stage);
+	}
+
+	~FToonShadeStageScope()
+	{
+		StageTimer.End(RHICmdList);
+	}
+
+private:
+	FRHICommandListImmediate& RHICmdList;
+	FToonShadeStageTimer& StageTimer;
+};
+
+
+// ドローイベント(RHIのブレッドクラム)・GPUスタット・タイムスタンプをまとめて積む
+#define TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, Stage) \
+	SCOPED_DRAW_EVENT(RHICmdList, ToonShadePaint_##Stage); \
+	SCOPED_GPU_STAT(RHICmdList, ToonShadePaint_##Stage); \
+	CSV_SCOPED_TIMING_STAT(ToonShadePaint, Stage); \
+	FToonShadeStageScope ToonShadeStageScope_##Stage(RHICmdList, StageTimer, EToonShadeBakeStage::Stage)
+
+
+static void Initialize2DArray(FRHICommandListBase& RHICmdList, FTextureRWBuffer& SeedFlagsTexture, const TCHAR* InDebugName, uint32 BytesPerElement, uint32 SizeX, uint32 SizeY, int32 ArraySize, EPixelFormat Format, ETextureCreateFlags Flags)
+{
+	SeedFlagsTexture.NumBytes = SizeX * SizeY * ArraySize * BytesPerElement;
+
+	const FRHITextureCreateDesc Desc =
+		FRHITextureCreateDesc::Create2DArray(InDebugName, SizeX, SizeY, ArraySize, Format)
+		.SetFlags(Flags);
+
+	SeedFlagsTexture.Buffer = RHICreateTexture(Desc);
+	SeedFlagsTexture.UAV = RHICmdList.CreateUnorderedAccessView(SeedFlagsTexture.Buffer);
+	SeedFlagsTexture.SRV = RHICmdList.CreateShaderResourceView(SeedFlagsTexture.Buffer, 0);
+}
+
+
+static int32 GetPreviewResolution(int32 Resolution)
+{
+	// 1/4に縮小するが、EToonShadeResolutionの最小(128)は下回らない
+	const int32 PreviewResolution = FMath::Max(Resolution / 4, 128);
+	return Resolution % PreviewResolution == 0 ? PreviewResolution : Resolution;
+}
+
+
+/** CreateShadowThresholdMapの入力 (描画スレッドで解決済みのもの) */
+struct FToonShadeBakeInputs
+{
+	/** 有効なSeedだけを詰めたもの */
+	TArray<FTextureRHIRef> SeedTextures;
+	FTextureRHIRef PositionTexture;
+
+	/** 焼く解像度 */
+	int32 Resolution = 0;
+	/** 入力を間引いて読む間隔 (入力の解像度 = Resolution * SampleScale) */
+	int32 SampleScale = 1;
+
+	int32 MaxRadius = 0;
+	EPixelFormat PixelFormat = PF_Unknown;
+	FToonShadeBakeSettings Settings;
+
+	/** 部分的な焼き直し用に全レイヤーの距離をIntermediatesへ残す (falseなら距離は2枚だけ確保して使い回す) */
+	bool bKeepAllLayers = false;
+
+	/** r.ToonShadePaint.LayersInFlightの上限 (メモリの予算に収める時に絞る) */
+	int32 MaxLayersInFlight = MAX_int32;
+};
+
+
+/**
+ * 焼きの中間リソースのうち、部分的な焼き直しで範囲外を使い回すもの
+ * bRetainIntermediatesの時は出力毎に描画スレッドで保持します。
+ */
+struct FToonShadeBakeIntermediates
+{
+	FTextureRWBuffer SeedFlagsTexture;
+	FTextureRWBuffer PositionTexture;
+	/** PositionTextureを量子化した基準のAABB (量子化しない時は空のまま) */
+	FRWBuffer PositionBoundsBuffer;
+	/** 正規化前の距離 (正規化はSDFBlendで行う) */
+	FTextureRWBuffer SDFTexture;
+	/** 正規化に使うレイヤー毎の最大値 */
+	FRWByteAddressBuffer MaxDistanceBuffer;
+
+	/** 焼いた時の入力 (使い回せるかの判定用) */
+	int32 Resolution = 0;
+	int32 NumLayers = 0;
+	int32 MaxRadius = 0;
+	EToonShadeDistanceMode DistanceMode = EToonShadeDistanceMode::Propagation;
+
+	/** 実際に回した半径 (MaxRadiusが0以下なら見積もった値) */
+	int32 ResolvedMaxRadius = 0;
+};
+
+
+/** Intermediatesが保持しているバイト数 */
+static int64 GetIntermediatesBytes(const FToonShadeBakeIntermediates& Intermediates)
+{
+	return static_cast<int64>(Intermediates.SeedFlagsTexture.NumBytes) +
+		Intermediates.PositionTexture.NumBytes +
+		Intermediates.PositionBoundsBuffer.NumBytes +
+		Intermediates.SDFTexture.NumBytes +
+		Intermediates.MaxDistanceBuffer.NumBytes;
+}
+
+
+/** 中間のモデル座標の形式 */
+static EPixelFormat GetPositionFormat(const FToonShadeBakeSettings& Settings)
+{
+	return Settings.bQuantizePosition ? PF_A16B16G16R16 : PF_A32B32G32R32F;
+}
+
+
+/**
+ * BakeShadowThresholdMapが同時に確保する量の見積もり
+ * 出力・距離・中間リソースの合計で、見積もりやタイルの一覧など数MBに満たないものは含みません。
+ */
+static int64 EstimateBakePeakBytes(const FToonShadeBakeInputs& Inputs)
+{
+	const int64 NumTexels = static_cast<int64>(Inputs.Resolution) * Inputs.Resolution;
+	const int32 NumSeedTextures = Inputs.SeedTextures.Num();
+	const bool bIsSeparable = Inputs.Settings.DistanceMode == EToonShadeDistanceMode::Separable;
+
+	const int32 NumLayersInFlight = FMath::Clamp(CVarToonShadePaintLayersInFlight.GetValueOnRenderThread(), 1, FMath::Min(NumSeedTextures, Inputs.MaxLayersInFlight));
+	const int32 NumSDFSlices = Inputs.bKeepAllLayers ? NumSeedTextures : FMath::Min(NumLayersInFlight + 1, NumSeedTextures);
+
+	int64 NumBytesPerTexel =
+		GPixelFormats[PF_R8_UINT].BlockBytes * NumSeedTextures +
+		GPixelFormats[GetPositionFormat(Inputs.Settings)].BlockBytes +
+		GPixelFormats[PF_R32_FLOAT].BlockBytes * NumSDFSlices +
+		GPixelFormats[Inputs.PixelFormat].BlockBytes;
+
+	// 並べて積むレイヤー毎のSDFInner/SDFOuter (分離型EDTは包絡線も)
+	NumBytesPerTexel += NumLayersInFlight * (GPixelFormats[PF_FloatRGBA].BlockBytes * 2 + (bIsSeparable ? GPixelFormats[PF_R16G16_UINT].BlockBytes : 0));
+
+	if (!Inputs.bKeepAllLayers && NumSeedTextures > 2)
+	{
+		NumBytesPerTexel += GPixelFormats[PF_G32R32F].BlockBytes;
+	}
+
+	if (Inputs.Settings.bMirrorSymmetry)
+	{
+		NumBytesPerTexel += GPixelFormats[PF_R16G16_UINT].BlockBytes / 2;
+	}
+
+	return NumTexels * NumBytesPerTexel;
+}
+
+
+/**
+ * 見積もりがr.ToonShadePaint.MemoryBudgetMBを超えるなら、全レイヤーの距離を残すのをやめ、次に並べて積むレイヤーを1つに絞って収める
+ * それでも収まらなければfalseを返します。
+ */
+static bool FitBakeToMemoryBudget(FToonShadeBakeInputs& Inputs)
+{
+	const int64 BudgetBytes = static_cast<int64>(CVarToonShadePaintMemoryBudgetMB.GetValueOnRenderThread()) * 1024 * 1024;
+	if (BudgetBytes <= 0)
+	{
+		return true;
+	}
+
+	const int64 RequestedBytes = EstimateBakePeakBytes(Inputs);
+	int64 PeakBytes = RequestedBytes;
+
+	if (PeakBytes > BudgetBytes && Inputs.bKeepAllLayers)
+	{
+		Inputs.bKeepAllLayers = false;
+		PeakBytes = EstimateBakePeakBytes(Inputs);
+	}
+
+	if (PeakBytes > BudgetBytes && Inputs.MaxLayersInFlight > 1)
+	{
+		Inputs.MaxLayersInFlight = 1;
+		PeakBytes = EstimateBakePeakBytes(Inputs);
+	}
+
+	if (PeakBytes > BudgetBytes)
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("Bake refused: %dx%d with %d layers needs an estimated %.1fMB, over r.ToonShadePaint.MemoryBudgetMB (%.1fMB)"),
+			Inputs.Resolution, Inputs.Resolution, Inputs.SeedTextures.Num(), PeakBytes / (1024.0 * 1024.0), BudgetBytes / (1024.0 * 1024.0));
+		return false;
+	}
+
+	if (PeakBytes < RequestedBytes)
+	{
+		UE_LOG(LogToonShadePaint, Display, TEXT("Bake reduced from %.1fMB to %.1fMB to fit r.ToonShadePaint.MemoryBudgetMB (KeepAllLayers: %d, MaxLayersInFlight: %d)"),
+			RequestedBytes / (1024.0 * 1024.0), PeakBytes / (1024.0 * 1024.0), Inputs.bKeepAllLayers ? 1 : 0, Inputs.MaxLayersInFlight == MAX_int32 ? -1 : Inputs.MaxLayersInFlight);
+	}
+
+	return true;
+}
+
+
+/** 出力毎に残す中間リソースを差し替える (描画スレッド専用) */
+static void SetRetainedIntermediates(FToonShadeBakeIntermediates& RetainedIntermediates, const FToonShadeBakeIntermediates& Intermediates)
+{
+	DEC_MEMORY_STAT_BY(STAT_ToonShadePaint_RetainedMemory, GetIntermediatesBytes(RetainedIntermediates));
+	RetainedIntermediates = Intermediates;
+	INC_MEMORY_STAT_BY(STAT_ToonShadePaint_RetainedMemory, GetIntermediatesBytes(RetainedIntermediates));
+}
+
+
+/** 範囲をPadding分広げて、スレッドグループ(32x32)の境界に揃える */
+static FIntRect PadDirtyRect(const FIntRect& DirtyRect, int32 Padding, int32 Resolution)
+{
+	const int32 MinX = FMath::Clamp(DirtyRect.Min.X - Padding, 0, Resolution);
+	const int32 MinY = FMath::Clamp(DirtyRect.Min.Y - Padding, 0, Resolution);
+	const int32 MaxX = FMath::Clamp(DirtyRect.Max.X + Padding, 0, Resolution);
+	const int32 MaxY = FMath::Clamp(DirtyRect.Max.Y + Padding, 0, Resolution);
+
+	return FIntRect(
+		(MinX / 32) * 32,
+		(MinY / 32) * 32,
+		FMath::Min(FMath::DivideAndRoundUp(MaxX, 32) * 32, Resolution),
+		FMath::Min(FMath::DivideAndRoundUp(MaxY, 32) * 32, Resolution));
+}
+
+
+/** どれかのレイヤーで有効なテクセルを含む32x32タイルの一覧 */
+struct FToonShadeTileList
+{
+	/** x | (y << 16) */
+	FRWBuffer TileListBuffer;
+	/** DispatchIndirectの引数 (タイル数, 1, 1) */
+	FRWBuffer IndirectArgsBuffer;
+};
+
+
+/**
+ * SeedFlagsTextureから有効なタイルを詰めてOutTileListに書き込む
+ * IntermediatesのSeedFlagsTextureはSRVの状態で渡すこと。
+ * @return 確保したバイト数
+ */
+static int64 ClassifyTiles(FRHICommandListImmediate& RHICmdList, const FToonShadeBakeInputs& Inputs, const FToonShadeBakeIntermediates& Intermediates, FToonShadeStageTimer& StageTimer, FToonShadeTileList& OutTileList)
+{
+	const int32 NumTilesX = Inputs.Resolution / 32;
+
+	OutTileList.TileListBuffer.Initialize(RHICmdList, TEXT("ToonShadePaint.TileListBuffer"), sizeof(uint32), NumTilesX * NumTilesX, PF_R32_UINT, BUF_SourceCopy);
+	OutTileList.IndirectArgsBuffer.Initialize(RHICmdList, TEXT("ToonShadePaint.TileIndirectArgsBuffer"), sizeof(uint32), 3, PF_R32_UINT, BUF_DrawIndirect | BUF_SourceCopy);
+
+	RHICmdList.Transition(FRHITransitionInfo(OutTileList.TileListBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+	RHICmdList.Transition(FRHITransitionInfo(OutTileList.IndirectArgsBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+	RHICmdList.ClearUAVUint(OutTileList.IndirectArgsBuffer.UAV, FUintVector4(0, 0, 0, 0));
+
+	{
+		TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, TileClassify);
+
+		TShaderMapRef<FTileClassifyCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+		SetShaderParametersLegacyCS(
+			RHICmdList,
+			ComputeShader,
+			Inputs.SeedTextures.Num(),
+			Intermediates.SeedFlagsTexture.SRV,
+			OutTileList.TileListBuffer.UAV,
+			OutTileList.IndirectArgsBuffer.UAV);
+		DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), NumTilesX, NumTilesX, 1);
+		UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+		StageTimer.AddDispatch(EToonShadeBakeStage::TileClassify);
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	RHICmdList.Transition(FRHITransitionInfo(OutTileList.TileListBuffer.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+	RHICmdList.Transition(FRHITransitionInfo(OutTileList.IndirectArgsBuffer.UAV, ERHIAccess::UAVCompute, ERHIAccess::IndirectArgs | ERHIAccess::SRVMask));
+
+	return static_cast<int64>(OutTileList.TileListBuffer.NumBytes) + OutTileList.IndirectArgsBuffer.NumBytes;
+}
+
+
+/** 範囲が重なっているか (接しているだけなら重ならない) */
+static bool IsOverlapped(const FIntRect& A, const FIntRect& B)
+{
+	return A.Min.X < B.Max.X && B.Min.X < A.Max.X && A.Min.Y < B.Max.Y && B.Min.Y < A.Max.Y;
+}
+
+
+/** タイルの一覧をBuildIslandRects用に読み戻しへ積む */
+static void EnqueueTileListReadback(FRHICommandListImmediate& RHICmdList, const FToonShadeTileList& TileList, FRHIGPUBufferReadback& TileListReadback, FRHIGPUBufferReadback& IndirectArgsReadback)
+{
+	RHICmdList.Transition(FRHITransitionInfo(TileList.TileListBuffer.UAV, ERHIAccess::SRVMask, ERHIAccess::CopySrc));
+	RHICmdList.Transition(FRHITransitionInfo(TileList.IndirectArgsBuffer.UAV, ERHIAccess::IndirectArgs | ERHIAccess::SRVMask, ERHIAccess::CopySrc));
+
+	TileListReadback.EnqueueCopy(RHICmdList, TileList.TileListBuffer.Buffer, TileList.TileListBuffer.NumBytes);
+	IndirectArgsReadback.EnqueueCopy(RHICmdList, TileList.IndirectArgsBuffer.Buffer, TileList.IndirectArgsBuffer.NumBytes);
+
+	RHICmdList.Transition(FRHITransitionInfo(TileList.TileListBuffer.UAV, ERHIAccess::CopySrc, ERHIAccess::SRVMask));
+	RHICmdList.Transition(FRHITransitionInfo(TileList.IndirectArgsBuffer.UAV, ERHIAccess::CopySrc, ERHIAccess::IndirectArgs | ERHIAccess::SRVMask));
+}
+
+
+/**
+ * 有効なタイルを8近傍で繋げたアイランド毎の範囲 (テクセル) をOutIslandRectsに返す
+ * 範囲が重なるアイランドと、まとめても無駄が少ない小さいアイランドは1つの範囲にまとめ、返す範囲は互いに重なりません。
+ * EnqueueTileListReadbackの読み戻しが届いてから呼ぶこと。
+ */
+static void BuildIslandRects(const FToonShadeBakeInputs& Inputs, FRHIGPUBufferReadback& TileListReadback, FRHIGPUBufferReadback& IndirectArgsReadback, TArray<FIntRect, TInlineAllocator<8>>& OutIslandRects)
+{
+	// これより小さいアイランド (タイル数) はまとめて積む
+	static constexpr int32 kSmallIslandTiles = 16;
+
+	const int32 NumTilesX = Inputs.Resolution / 32;
+
+	TBitArray<> ValidTiles(false, NumTilesX * NumTilesX);
+	{
+		const uint32* IndirectArgs = static_cast<const uint32*>(IndirectArgsReadback.Lock(sizeof(uint32) * 3));
+		const int32 NumValidTiles = IndirectArgs ? static_cast<int32>(IndirectArgs[0]) : 0;
+		IndirectArgsReadback.Unlock();
+
+		const uint32* PackedTiles = static_cast<const uint32*>(TileListReadback.Lock(sizeof(uint32) * NumTilesX * NumTilesX));
+		for (int32 TileIndex = 0; PackedTiles && TileIndex < NumValidTiles; ++TileIndex)
+		{
+			ValidTiles[(PackedTiles[TileIndex] >> 16) * NumTilesX + (PackedTiles[TileIndex] & 0xFFFF)] = true;
+		}
+		TileListReadback.Unlock();
+	}
+
+	// 塗りつぶしでアイランド毎の範囲 (タイル) を拾う
+	TArray<FIntRect> IslandRects;
+	TArray<FIntPoint> Stack;
+	for (int32 SeedIndex = ValidTiles.Find(true); SeedIndex != INDEX_NONE; SeedIndex = ValidTiles.Find(true))
+	{
+		FIntRect& IslandRect = IslandRects.Add_GetRef(FIntRect(MAX_int32, MAX_int32, MIN_int32, MIN_int32));
+
+		ValidTiles[SeedIndex] = false;
+		Stack.Add(FIntPoint(SeedIndex % NumTilesX, SeedIndex / NumTilesX));
+
+		while (!Stack.IsEmpty())
+		{
+			const FIntPoint Tile = Stack.Pop(EAllowShrinking::No);
+			IslandRect.Include(Tile);
+
+			for (int32 OffsetY = -1; OffsetY <= 1; ++OffsetY)
+			{
+				for (int32 OffsetX = -1; OffsetX <= 1; ++OffsetX)
+				{
+					const FIntPoint Neighbor(Tile.X + OffsetX, Tile.Y + OffsetY);
+					if (Neighbor.X < 0 || Neighbor.Y < 0 || Neighbor.X >= NumTilesX || Neighbor.Y >= NumTilesX)
+					{
+						continue;
+					}
+
+					const int32 NeighborIndex = Neighbor.Y * NumTilesX + Neighbor.X;
+					if (ValidTiles[NeighborIndex])
+					{
+						ValidTiles[NeighborIndex] = false;
+						Stack.Add(Neighbor);
+					}
+				}
+			}
+		}
+
+		IslandRect.Max += FIntPoint(1, 1);  // Includeは右下を含むので外側へ
+	}
+
+	// 重なる範囲は同じテクセルを二重に書くのでまとめる。小さい同士は積む回数を減らすためにまとめる
+	// まとめた範囲は他と新たに重なり得るので、確定済みから外して作業リストへ戻す (1回まとめる毎に1つ減るのでO(n^2))
+	TArray<FIntRect> MergedRects;
+	MergedRects.Reserve(IslandRects.Num());
+
+	while (!IslandRects.IsEmpty())
+	{
+		const FIntRect A = IslandRects.Pop(EAllowShrinking::No);
+
+		const int32 MergeIndex = MergedRects.IndexOfByPredicate([&A](const FIntRect& B)
+		{
+			FIntRect Union = A;
+			Union.Union(B);
+
+			const bool bIsSmall = A.Area() < kSmallIslandTiles || B.Area() < kSmallIslandTiles;
+			return IsOverlapped(A, B) || (bIsSmall && Union.Area() <= (A.Area() + B.Area()) * 2);
+		});
+
+		if (MergeIndex == INDEX_NONE)
+		{
+			MergedRects.Add(A);
+			continue;
+		}
+
+		FIntRect Union = A;
+		Union.Union(MergedRects[MergeIndex]);
+		MergedRects.RemoveAtSwap(MergeIndex, 1, EAllowShrinking::No);
+		IslandRects.Add(Union);
+	}
+
+	OutIslandRects.Reset();
+	for (const FIntRect& IslandRect : MergedRects)
+	{
+		OutIslandRects.Add(FIntRect(IslandRect.Min * 32, IslandRect.Max * 32));
+	}
+}
+
+
+/** TileListがあれば有効なタイルだけ、なければThreadGroupCountX x ThreadGroupCountYを回す */
+static void DispatchTiledComputeShader(FRHIComputeCommandList& RHICmdList, FShader* Shader, const FToonShadeTileList* TileList, uint32 ThreadGroupCountX, uint32 ThreadGroupCountY)
+{
+	if (TileList)
+	{
+		DispatchIndirectComputeShader(RHICmdList, Shader, TileList->IndirectArgsBuffer.Buffer, 0);
+	}
+	else
+	{
+		DispatchComputeShader(RHICmdList, Shader, ThreadGroupCountX, ThreadGroupCountY, 1);
+	}
+}
+
+
+/**
+ * 距離の正規化・レイヤー間の補間・閾値の書き込みを1回のSDFBlendでOutputShadowThresholdTextureに書き込む
+ * IntermediatesのSeedFlagsTexture、SDFTexture、MaxDistanceBufferはSRVの状態で渡すこと。
+ * TileListを渡すと有効なタイルだけ書き込み、残りは無効箇所の閾値でクリアします。
+ * @return 確保したバイト数
+ */
+static int64 BlendShadowThresholdMap(FRHICommandListImmediate& RHICmdList, const FToonShadeBakeInputs& Inputs, const FToonShadeBakeIntermediates& Intermediates, const FToonShadeTileList* TileList, FToonShadeStageTimer& StageTimer, FTextureRWBuffer& OutputShadowThresholdTexture)
+{
+	const int32 Resolution = Inputs.Resolution;
+	const int32 NumSeedTextures = Inputs.SeedTextures.Num();
+	const EPixelFormat PixelFormat = Inputs.PixelFormat;
+
+	const uint32 ThreadGroupCountX = Resolution / 32;
+	const uint32 ThreadGroupCountY = Resolution / 32;
+	const uint32 ThreadGroupCountZ = 1;
+
+	const ETextureCreateFlags TextureCreateFlags(TexCreate_ShaderResource | TexCreate_UAV);
+
+	OutputShadowThresholdTexture.Initialize2D(TEXT("SDF.OutputShadowThresholdTexture"), GPixelFormats[PixelFormat].BlockBytes, Resolution, Resolution, PixelFormat, TextureCreateFlags);
+
+	RHICmdList.Transition(FRHITransitionInfo(OutputShadowThresholdTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+	if (TileList)
+	{
+		RHICmdList.ClearUAVFloat(OutputShadowThresholdTexture.UAV, FVector4f(1.0f, 1.0f, 0.0f, 0.0f));  // SDFBlend.usfの無効箇所の閾値
+	}
+
+	{
+		TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, SDFBlend);
+
+		FSDFBlendCS::FPermutationDomain PermutationVector;
+		PermutationVector.Set<FSDFBlendCS::FLayerPair>(false);
+		PermutationVector.Set<FSDFBlendCS::FTileList>(TileList != nullptr);
+		TShaderMapRef<FSDFBlendCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+		SetShaderParametersLegacyCS(
+			RHICmdList,
+			ComputeShader,
+			NumSeedTextures,
+			0,
+			NumSeedTextures,
+			Intermediates.SeedFlagsTexture.SRV,
+			Intermediates.SDFTexture.SRV,
+			Intermediates.MaxDistanceBuffer.SRV,
+			TileList ? TileList->TileListBuffer.SRV.GetReference() : nullptr,
+			nullptr,
+			OutputShadowThresholdTexture.UAV);
+		DispatchTiledComputeShader(RHICmdList, ComputeShader.GetShader(), TileList, ThreadGroupCountX, ThreadGroupCountY);
+		UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+		StageTimer.AddDispatch(EToonShadeBakeStage::SDFBlend);
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	RHICmdList.Transition(FRHITransitionInfo(OutputShadowThresholdTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+
+	return OutputShadowThresholdTexture.NumBytes;
+}
+
+
+/**
+ * NumSDFSlices枚を使い回すSDFTextureのうち、LayerIndexとその次のレイヤーの組をSDFBlendで足し込む
+ * 最後の組はOutputShadowThresholdTextureへ書き込みます。SDFTextureとMaxDistanceBufferはSRVの状態で渡すこと。
+ */
+static void BlendShadowThresholdLayerPair(FRHICommandListImmediate& RHICmdList, const FToonShadeBakeInputs& Inputs, const FToonShadeBakeIntermediates& Intermediates, const FTextureRWBuffer& SDFTexture, int32 NumSDFSlices, int32 LayerIndex, const FToonShadeTileList* TileList, FToonShadeStageTimer& StageTimer, FTextureRWBuffer& AccumulatedThresholdTexture, FTextureRWBuffer& OutputShadowThresholdTexture)
+{
+	const int32 Resolution = Inputs.Resolution;
+	const int32 NumSeedTextures = Inputs.SeedTextures.Num();
+
+	if (AccumulatedThresholdTexture.UAV.IsValid())
+	{
+		// 前の組の書き込みを待つ
+		RHICmdList.Transition(FRHITransitionInfo(AccumulatedThresholdTexture.UAV, LayerIndex > 0 ? ERHIAccess::UAVCompute : ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+	}
+
+	{
+		TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, SDFBlend);
+
+		FSDFBlendCS::FPermutationDomain PermutationVector;
+		PermutationVector.Set<FSDFBlendCS::FLayerPair>(true);
+		PermutationVector.Set<FSDFBlendCS::FTileList>(TileList != nullptr);
+		TShaderMapRef<FSDFBlendCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+		SetShaderParametersLegacyCS(
+			RHICmdList,
+			ComputeShader,
+			NumSeedTextures,
+			LayerIndex,
+			NumSDFSlices,
+			Intermediates.SeedFlagsTexture.SRV,
+			SDFTexture.SRV,
+			Intermediates.MaxDistanceBuffer.SRV,
+			TileList ? TileList->TileListBuffer.SRV.GetReference() : nullptr,
+			AccumulatedThresholdTexture.UAV,
+			OutputShadowThresholdTexture.UAV);
+		DispatchTiledComputeShader(RHICmdList, ComputeShader.GetShader(), TileList, Resolution / 32, Resolution / 32);
+		UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+		StageTimer.AddDispatch(EToonShadeBakeStage::SDFBlend);
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+}
+
+
+/**
+ * 右半分の各テクセルについて左右対称の相手を探してMirrorSourceTextureに書き込み、相手の見つからない数をMirrorStatsReadbackへ積む
+ * 使えるかはReadbackMirrorStatsで判定します。MirrorAxisが不正なら何も積まずにfalseを返します。
+ * IntermediatesのSeedFlagsTextureとPositionTextureはSRVの状態で渡すこと。
+ */
+static bool EnqueueMirrorMap(FRHICommandListImmediate& RHICmdList, const FToonShadeBakeInputs& Inputs, const FToonShadeBakeIntermediates& Intermediates, FToonShadeStageTimer& StageTimer, FTextureRWBuffer& MirrorSourceTexture, FRHIGPUBufferReadback& MirrorStatsReadback)
+{
+	const int32 Resolution = Inputs.Resolution;
+	const int32 HalfResolution = Resolution / 2;
+	const FToonShadeBakeSettings& Settings = Inputs.Settings;
+
+	const FVector3f MirrorNormal(Settings.MirrorAxis.GetSafeNormal());
+	if (MirrorNormal.IsNearlyZero())
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("Invalid 'MirrorAxis'"));
+		return false;
+	}
+
+	MirrorSourceTexture.Initialize2D(TEXT("ToonShadePaint.MirrorSourceTexture"), GPixelFormats[PF_R16G16_UINT].BlockBytes, HalfResolution, Resolution, PF_R16G16_UINT, TexCreate_ShaderResource | TexCreate_UAV);
+
+	FRWBuffer MirrorStatsBuffer;
+	MirrorStatsBuffer.Initialize(RHICmdList, TEXT("ToonShadePaint.MirrorStatsBuffer"), sizeof(uint32), 3, PF_R32_UINT, BUF_SourceCopy);
+
+	RHICmdList.Transition(FRHITransitionInfo(MirrorSourceTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+	RHICmdList.Transition(FRHITransitionInfo(MirrorStatsBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+	{
+		RHICmdList.ClearUAVUint(MirrorStatsBuffer.UAV, FUintVector4(0, 0, 0, 0));
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	{
+		TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, MirrorMap);
+
+		TShaderMapRef<FMirrorMapCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+		SetShaderParametersLegacyCS(
+			RHICmdList,
+			ComputeShader,
+			FIntPoint(Resolution, Resolution),
+			Inputs.SeedTextures.Num(),
+			FVector3f(Settings.MirrorCenter),
+			MirrorNormal,
+			Intermediates.SeedFlagsTexture.SRV,
+			Intermediates.PositionTexture.SRV,
+			Intermediates.PositionBoundsBuffer.SRV,
+			MirrorSourceTexture.UAV,
+			MirrorStatsBuffer.UAV);
+		DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), HalfResolution / 32, Resolution / 32, 1);
+		UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+		StageTimer.AddDispatch(EToonShadeBakeStage::MirrorMap);
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	RHICmdList.Transition(FRHITransitionInfo(MirrorSourceTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+	RHICmdList.Transition(FRHITransitionInfo(MirrorStatsBuffer.UAV, ERHIAccess::UAVCompute, ERHIAccess::CopySrc));
+	MirrorStatsReadback.EnqueueCopy(RHICmdList, MirrorStatsBuffer.Buffer, MirrorStatsBuffer.NumBytes);
+
+	return true;
+}
+
+
+/** EnqueueMirrorMapの結果から左右対称として扱えるかを返す (届いてから呼ぶこと) */
+static bool ReadbackMirrorStats(FRHIGPUBufferReadback& MirrorStatsReadback)
+{
+	const uint32* MirrorStats = static_cast<const uint32*>(MirrorStatsReadback.Lock(sizeof(uint32) * 3));
+	if (MirrorStats == nullptr)
+	{
+		return false;
+	}
+
+	const uint32 NumValid = MirrorStats[0];
+	const uint32 NumUnmatched = MirrorStats[1];
+	const uint32 NumAsymmetric = MirrorStats[2];
+
+	MirrorStatsReadback.Unlock();
+
+	const float MaxMismatchRatio = CVarToonShadePaintMirrorMaxMismatchRatio.GetValueOnRenderThread();
+	if (NumUnmatched + NumAsymmetric > NumValid * MaxMismatchRatio)
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("bMirrorSymmetry ignored: %u of %u texels have no counterpart and %u have asymmetric shapes"), NumUnmatched, NumValid, NumAsymmetric);
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * SeedFlagsから伝搬に要る半径を見積もってMaxExtentReadbackへ積む (読むのはReadbackMaxRadius)
+ * 有効なテクセルから種類の違うテクセル(明暗の境界・アイランドの縁)までの距離を行と列で測り、近い方の全レイヤーの最大を求めます。
+ * IntermediatesのSeedFlagsTextureはSRVの状態で渡すこと。
+ */
+static void EnqueueMaxRadiusEstimate(FRHICommandListImmediate& RHICmdList, const FToonShadeBakeInputs& Inputs, const FToonShadeBakeIntermediates& Intermediates, FToonShadeStageTimer& StageTimer, FRHIGPUBufferReadback& MaxExtentReadback)
+{
+	const int32 Resolution = Inputs.Resolution;
+	const uint32 LineThreadGroupCount = FMath::DivideAndRoundUp(Resolution, 64);
+
+	FTextureRWBuffer RowExtentTexture;
+	RowExtentTexture.Initialize2D(TEXT("ToonShadePaint.RowExtentTexture"), GPixelFormats[PF_R16_UINT].BlockBytes, Resolution, Resolution, PF_R16_UINT, TexCreate_ShaderResource | TexCreate_UAV);
+
+	FRWBuffer MaxExtentBuffer;
+	MaxExtentBuffer.Initialize(RHICmdList, TEXT("ToonShadePaint.MaxExtentBuffer"), sizeof(uint32), 1, PF_R32_UINT, BUF_SourceCopy);
+
+	RHICmdList.Transition(FRHITransitionInfo(MaxExtentBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+	RHICmdList.ClearUAVUint(MaxExtentBuffer.UAV, FUintVector4(0, 0, 0, 0));
+
+	{
+		TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, EstimateMaxRadius);
+
+		for (int32 LayerIndex = 0; LayerIndex < Inputs.SeedTextures.Num(); ++LayerIndex)
+		{
+			RHICmdList.Transition(FRHITransitionInfo(RowExtentTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+			{
+				TShaderMapRef<FDistanceExtentRowCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+				SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+				SetShaderParametersLegacyCS(
+					RHICmdList,
+					ComputeShader,
+					LayerIndex,
+					FIntPoint(Resolution, Resolution),
+					Intermediates.SeedFlagsTexture.SRV,
+					RowExtentTexture.UAV);
+				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), LineThreadGroupCount, 1, 1);
+				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+				StageTimer.AddDispatch(EToonShadeBakeStage::EstimateMaxRadius);
+			}
+
+			RHICmdList.Transition(FRHITransitionInfo(RowExtentTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+
+			{
+				TShaderMapRef<FDistanceExtentColumnCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+				SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+				SetShaderParametersLegacyCS(
+					RHICmdList,
+					ComputeShader,
+					LayerIndex,
+					FIntPoint(Resolution, Resolution),
+					Intermediates.SeedFlagsTexture.SRV,
+					RowExtentTexture.SRV,
+					MaxExtentBuffer.UAV);
+				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), LineThreadGroupCount, 1, 1);
+				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+				StageTimer.AddDispatch(EToonShadeBakeStage::EstimateMaxRadius);
+			}
+		}
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	RHICmdList.Transition(FRHITransitionInfo(MaxExtentBuffer.UAV, ERHIAccess::UAVCompute, ERHIAccess::CopySrc));
+	MaxExtentReadback.EnqueueCopy(RHICmdList, MaxExtentBuffer.Buffer, MaxExtentBuffer.NumBytes);
+}
+
+
+/** EnqueueMaxRadiusEstimateの結果を読む (届いてから呼ぶこと) */
+static int32 ReadbackMaxRadius(FRHIGPUBufferReadback& MaxExtentReadback, int32 Resolution)
+{
+	const uint32* MaxExtent = static_cast<const uint32*>(MaxExtentReadback.Lock(sizeof(uint32)));
+	if (MaxExtent == nullptr)
+	{
+		return Resolution;
+	}
+
+	// 伝搬は1回で少なくとも1テクセル進むので、最も遠い距離と同じ回数あれば届く
+	const int32 MaxRadius = FMath::Clamp(static_cast<int32>(MaxExtent[0]), 1, Resolution);
+
+	MaxExtentReadback.Unlock();
+
+	return MaxRadius;
+}
+
+
+/** 並べて積む1レイヤー分の距離の作業領域 */
+struct FToonShadeDistanceWorkspace
+{
+	FTextureRWBuffer SDFInnerTexture;
+	FTextureRWBuffer SDFOuterTexture;
+	FTextureRWBuffer EnvelopeTexture;
+
+	/** 最後に回した伝搬の半径 (SDFCalcが読む側はこの偶奇で決まる) */
+	int32 LastRadius = 0;
+
+	/** 伝搬で最寄りが変わらなくなった */
+	bool bIsConverged = false;
+};
+
+
+/** 伝搬の収束判定で変化したテクセル数を読み戻す1回分 (並べて積むレイヤー毎に1つずつ数える) */
+struct FToonShadeConvergenceReadback
+{
+	FRWBuffer ChangedTexelBuffer;
+	TUniquePtr<FRHIGPUBufferReadback> Readback;
+	bool bIsPending = false;
+};
+
+
+/** 間隔内で1テクセルも変わらなかったレイヤーを収束済みにする bWaitがfalseなら読み戻しが届いている時だけ */
+static void ResolveConvergenceReadback(FRHICommandListImmediate& RHICmdList, FToonShadeConvergenceReadback& ConvergenceReadback, TArrayView<FToonShadeDistanceWorkspace> Workspaces, bool bWait)
+{
+	if (!ConvergenceReadback.bIsPending)
+	{
+		return;
+	}
+
+	if (!ConvergenceReadback.Readback->IsReady())
+	{
+		if (!bWait)
+		{
+			return;
+		}
+
+		RHICmdList.BlockUntilGPUIdle();
+	}
+
+	const uint32* ChangedTexels = static_cast<const uint32*>(ConvergenceReadback.Readback->Lock(ConvergenceReadback.ChangedTexelBuffer.NumBytes));
+	for (int32 WaveIndex = 0; WaveIndex < Workspaces.Num(); ++WaveIndex)
+	{
+		if (ChangedTexels[WaveIndex] == 0)
+		{
+			Workspaces[WaveIndex].bIsConverged = true;
+		}
+	}
+	ConvergenceReadback.Readback->Unlock();
+
+	ConvergenceReadback.bIsPending = false;
+}
+
+
+/** 全体の焼きの進み具合 (Setupの読み戻しを待ってから、レイヤーの組毎に、初期化・伝搬・SDFCalcの順で積む) */
+enum class EToonShadeBakePhase : uint8
+{
+	SetupReadback,
+	DistanceSetup,
+	DistanceIter,
+	SDFCalc,
+};
+
+
+/**
+ * 全体の焼き1回分の途中の状態
+ * 伝搬の半径の区切りで止めて、次のStepShadowThresholdMapで続きから積めます。
+ */
+struct FToonShadeBakeState
+{
+	FToonShadeBakeInputs Inputs;
+	FToonShadeBakeIntermediates* Intermediates = nullptr;
+	FTextureRWBuffer* OutputShadowThresholdTexture = nullptr;
+	FToonShadeBakeStats* OutStats = nullptr;
+
+	FToonShadeStageTimer StageTimer;
+
+	/** 0以下で渡されたら見積もった値 */
+	int32 MaxRadius = 0;
+	int32 NumLayersInFlight = 1;
+	int32 NumSDFSlices = 0;
+	int32 ConvergenceCheckInterval = 0;
+	bool bIsSeparable = false;
+	bool bMirrored = false;
+	bool bUseTileList = false;
+	bool bUseIslandRects = false;
+
+	TArray<FToonShadeDistanceWorkspace, TInlineAllocator<4>> Workspaces;
+	FToonShadeConvergenceReadback ConvergenceReadbacks[2];
+
+	FTextureRWBuffer SDFRingTexture;
+	FTextureRWBuffer AccumulatedThresholdTexture;
+	FTextureRWBuffer MirrorSourceTexture;
+	FToonShadeTileList TileList;
+
+	TArray<FIntRect, TInlineAllocator<8>> SetupRects;
+	TArray<FIntRect, TInlineAllocator<8>> CalcRects;
+
+	/** 半径を見積もる時の読み戻し (届くまで距離は積まない) */
+	TUniquePtr<FRHIGPUBufferReadback> MaxExtentReadback;
+	/** 左右対称を試す時の読み戻し (届くまで距離は積まない) */
+	TUniquePtr<FRHIGPUBufferReadback> MirrorStatsReadback;
+	/** アイランド毎の範囲を作る時のタイルの一覧の読み戻し (届くまで距離は積まない) */
+	TUniquePtr<FRHIGPUBufferReadback> TileListReadback;
+	TUniquePtr<FRHIGPUBufferReadback> TileIndirectArgsReadback;
+
+	/** 伝搬で読んでよい範囲 (DistanceMapSetupを通していない所は別レイヤーの残骸) */
+	FIntRect ValidRect;
+
+	/** 積んでいる組の先頭のレイヤー */
+	int32 FirstIndex = 0;
+	EToonShadeBakePhase Phase = EToonShadeBakePhase::SetupReadback;
+	/** 次に回す伝搬の半径 */
+	int32 Radius = 1;
+
+	int32 GetNumWaveLayers() const
+	{
+		return FMath::Min(NumLayersInFlight, Inputs.SeedTextures.Num() - FirstIndex);
+	}
+
+	FTextureRWBuffer& GetSDFTexture()
+	{
+		return Inputs.bKeepAllLayers ? Intermediates->SDFTexture : SDFRingTexture;
+	}
+
+	const FToonShadeTileList* GetTileList() const
+	{
+		return bUseTileList ? &TileList : nullptr;
+	}
+
+	/** アイランド毎に積む時は範囲がタイルの一覧の代わり */
+	const FToonShadeTileList* GetDistanceTileList() const
+	{
+		return bUseIslandRects ? nullptr : GetTileList();
+	}
+};
+
+
+/** 入力の変換と半径の見積もりまで積む (距離を積む準備の残りはResolveSetupReadbacksで) */
+static void BeginShadowThresholdMap(FRHICommandListImmediate& RHICmdList, const FToonShadeBakeInputs& Inputs, FToonShadeBakeIntermediates& Intermediates, FTextureRWBuffer& OutputShadowThresholdTexture, FToonShadeBakeStats& OutStats, FToonShadeBakeState& State)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(BeginShadowThresholdMap);
+
+	State.Inputs = Inputs;
+	State.Intermediates = &Intermediates;
+	State.OutputShadowThresholdTexture = &OutputShadowThresholdTexture;
+	State.OutStats = &OutStats;
+
+	const int32 Resolution = Inputs.Resolution;
+	const int32 NumSeedTextures = Inputs.SeedTextures.Num();
+	const FToonShadeBakeSettings& Settings = Inputs.Settings;
+
+	FToonShadeStageTimer& StageTimer = State.StageTimer;
+
+	const uint32 ThreadGroupCountX = Resolution / 32;
+	const uint32 ThreadGroupCountY = Resolution / 32;
+	const uint32 ThreadGroupCountZ = 1;
+
+	const bool bIsSeparable = Settings.DistanceMode == EToonShadeDistanceMode::Separable;
+	State.bIsSeparable = bIsSeparable;
+
+	const ETextureCreateFlags TextureCreateFlags(TexCreate_ShaderResource | TexCreate_UAV);
+
+	Intermediates.Resolution = Resolution;
+	Intermediates.NumLayers = NumSeedTextures;
+	Intermediates.MaxRadius = Inputs.MaxRadius;
+	Intermediates.DistanceMode = Settings.DistanceMode;
+
+	FTextureRWBuffer& SeedFlagsTexture = Intermediates.SeedFlagsTexture;
+	Initialize2DArray(RHICmdList, SeedFlagsTexture, TEXT("ToonShadePaint.SeedFlagsTexture"), GPixelFormats[PF_R8_UINT].BlockBytes, Resolution, Resolution, NumSeedTextures, PF_R8_UINT, TextureCreateFlags);
+
+	const EPixelFormat PositionFormat = GetPositionFormat(Settings);
+	FTextureRWBuffer& PositionTexture = Intermediates.PositionTexture;
+	PositionTexture.Initialize2D(TEXT("ToonShadePaint.PositionTexture"), GPixelFormats[PositionFormat].BlockBytes, Resolution, Resolution, PositionFormat, TextureCreateFlags);
+
+	// [0..2]: 最小値の符号反転, [3..5]: 最大値 (0のままなら量子化しない)
+	FRWBuffer& PositionBoundsBuffer = Intermediates.PositionBoundsBuffer;
+	PositionBoundsBuffer.Initialize(RHICmdList, TEXT("ToonShadePaint.PositionBoundsBuffer"), sizeof(uint32), 6, PF_R32_UINT);
+
+	// レイヤー毎の距離は互いに依存しないので、数レイヤー分の作業領域を用意して間に障壁を挟まず並べて積む
+	const int32 NumLayersInFlight = FMath::Clamp(CVarToonShadePaintLayersInFlight.GetValueOnRenderThread(), 1, FMath::Min(NumSeedTextures, Inputs.MaxLayersInFlight));
+	State.NumLayersInFlight = NumLayersInFlight;
+
+	TArray<FToonShadeDistanceWorkspace, TInlineAllocator<4>>& Workspaces = State.Workspaces;
+	Workspaces.SetNum(NumLayersInFlight);
+
+	int64 WorkspaceBytes = 0;
+	for (FToonShadeDistanceWorkspace& Workspace : Workspaces)
+	{
+		Workspace.SDFInnerTexture.Initialize2D(TEXT("ToonShadePaint.SDFInnerTexture"), GPixelFormats[PF_FloatRGBA].BlockBytes, Resolution, Resolution, PF_FloatRGBA, TextureCreateFlags);
+		Workspace.SDFOuterTexture.Initialize2D(TEXT("ToonShadePaint.SDFOuterTexture"), GPixelFormats[PF_FloatRGBA].BlockBytes, Resolution, Resolution, PF_FloatRGBA, TextureCreateFlags);
+		if (bIsSeparable)
+		{
+			Workspace.EnvelopeTexture.Initialize2D(TEXT("ToonShadePaint.EnvelopeTexture"), GPixelFormats[PF_R16G16_UINT].BlockBytes, Resolution, Resolution, PF_R16G16_UINT, TextureCreateFlags);
+		}
+
+		WorkspaceBytes += static_cast<int64>(Workspace.SDFInnerTexture.NumBytes) + Workspace.SDFOuterTexture.NumBytes + Workspace.EnvelopeTexture.NumBytes;
+	}
+
+	// 変化したテクセル数をConvergenceCheckInterval回毎に読み戻し、待たずに伝搬を続ける (読み戻しは2つを交互に使う)
+	State.ConvergenceCheckInterval = bIsSeparable ? 0 : FMath::Max(CVarToonShadePaintConvergenceCheckInterval.GetValueOnRenderThread(), 0);
+
+	if (State.ConvergenceCheckInterval > 0)
+	{
+		for (FToonShadeConvergenceReadback& ConvergenceReadback : State.ConvergenceReadbacks)
+		{
+			ConvergenceReadback.ChangedTexelBuffer.Initialize(RHICmdList, TEXT("ToonShadePaint.ChangedTexelBuffer"), sizeof(uint32), NumLayersInFlight, PF_R32_UINT, BUF_SourceCopy);
+			ConvergenceReadback.Readback = MakeUnique<FRHIGPUBufferReadback>(TEXT("ToonShadePaint.ChangedTexelReadback"));
+
+			WorkspaceBytes += ConvergenceReadback.ChangedTexelBuffer.NumBytes;
+		}
+	}
+
+	// SDFBlendで正規化するので最大値はレイヤー毎に残す
+	FRWByteAddressBuffer& MaxDistanceBuffer = Intermediates.MaxDistanceBuffer;
+	MaxDistanceBuffer.Initialize(RHICmdList, TEXT("ToonShadePaint.MaxDistanceBuffer"), sizeof(int32) * NumSeedTextures, BUF_ShaderResource | BUF_UnorderedAccess);
+
+	// 部分的な焼き直し用に残す時だけ全レイヤー分、それ以外は並べて積む分と1つ前のレイヤーの分を使い回して組毎に足し込む
+	const bool bKeepAllLayers = Inputs.bKeepAllLayers;
+	State.NumSDFSlices = bKeepAllLayers ? NumSeedTextures : FMath::Min(NumLayersInFlight + 1, NumSeedTextures);
+
+	FTextureRWBuffer& SDFTexture = State.GetSDFTexture();
+	Initialize2DArray(RHICmdList, SDFTexture, TEXT("ToonShadePaint.SDFTexture"), GPixelFormats[PF_R32_FLOAT].BlockBytes, Resolution, Resolution, State.NumSDFSlices, PF_R32_FLOAT, TextureCreateFlags);
+
+	// 2組目以降は前の組までの合計に足す (1組だけなら直接出力へ書く)
+	if (!bKeepAllLayers && NumSeedTextures > 2)
+	{
+		State.AccumulatedThresholdTexture.Initialize2D(TEXT("ToonShadePaint.AccumulatedThresholdTexture"), GPixelFormats[PF_G32R32F].BlockBytes, Resolution, Resolution, PF_G32R32F, TextureCreateFlags);
+	}
+
+	OutStats.AllocatedBytes =
+		static_cast<int64>(SeedFlagsTexture.NumBytes) +
+		PositionTexture.NumBytes +
+		PositionBoundsBuffer.NumBytes +
+		WorkspaceBytes +
+		MaxDistanceBuffer.NumBytes +
+		SDFTexture.NumBytes +
+		State.AccumulatedThresholdTexture.NumBytes;
+
+	// いつかAsnycしたいからPositionTextureとPositionTextureの寿命を切り離し
+	{
+		RHICmdList.Transition(FRHITransitionInfo(SeedFlagsTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+		RHICmdList.Transition(FRHITransitionInfo(PositionTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+		{
+			TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, SetupSeedFlags);
+
+			for (int32 LayerIndex = 0; LayerIndex < NumSeedTextures; ++LayerIndex)
+			{
+				TShaderMapRef<FSetupSeedFlagsCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+				SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+				SetShaderParametersLegacyCS(
+					RHICmdList,
+					ComputeShader,
+					LayerIndex,
+					Inputs.SampleScale,
+					FIntPoint::ZeroValue,
+					Inputs.SeedTextures[LayerIndex],
+					SeedFlagsTexture.UAV);
+				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCountX, ThreadGroupCountY, ThreadGroupCountZ);
+				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+				StageTimer.AddDispatch(EToonShadeBakeStage::SetupSeedFlags);
+			}
+		}
+
+		{
+			TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, SetupPos);
+
+			RHICmdList.Transition(FRHITransitionInfo(PositionBoundsBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+			RHICmdList.ClearUAVUint(PositionBoundsBuffer.UAV, FUintVector4(0, 0, 0, 0));
+
+			// 16bit unormへ詰める基準のAABBを先に集める
+			if (Settings.bQuantizePosition)
+			{
+				TShaderMapRef<FPositionBoundsCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+				SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+				SetShaderParametersLegacyCS(
+					RHICmdList,
+					ComputeShader,
+					Inputs.SampleScale,
+					Inputs.SeedTextures[0],
+					Inputs.PositionTexture,
+					PositionBoundsBuffer.UAV);
+				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCountX, ThreadGroupCountY, ThreadGroupCountZ);
+				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+				StageTimer.AddDispatch(EToonShadeBakeStage::SetupPos);
+			}
+
+			RHICmdList.Transition(FRHITransitionInfo(PositionBoundsBuffer.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+
+			TShaderMapRef<FSetupPosCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+			SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+			SetShaderParametersLegacyCS(
+				RHICmdList,
+				ComputeShader,
+				Inputs.SampleScale,
+				Inputs.SeedTextures[0],
+				Inputs.PositionTexture,
+				PositionBoundsBuffer.SRV,
+				PositionTexture.UAV);
+			DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCountX, ThreadGroupCountY, ThreadGroupCountZ);
+			UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+			StageTimer.AddDispatch(EToonShadeBakeStage::SetupPos);
+		}
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);  // DX12はAsyncComputeなので都度叩いて安牌
+
+		RHICmdList.Transition(FRHITransitionInfo(SeedFlagsTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+		RHICmdList.Transition(FRHITransitionInfo(PositionTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+
+		// 理想はここで終わらせて裏で頑張ってもらう
+		// Signal->Trigger();
+	}
+
+	// 0以下ならSeedFlagsから見積もる (分離型EDTは半径を使わない)
+	State.MaxRadius = Inputs.MaxRadius;
+	if (State.MaxRadius <= 0 && !bIsSeparable)
+	{
+		State.MaxExtentReadback = MakeUnique<FRHIGPUBufferReadback>(TEXT("ToonShadePaint.MaxExtentReadback"));
+		EnqueueMaxRadiusEstimate(RHICmdList, Inputs, Intermediates, StageTimer, *State.MaxExtentReadback);
+	}
+
+	// 左右対称に使えるかは相手の見つからない数を読み戻してから決める
+	if (Settings.bMirrorSymmetry && !bIsSeparable && Resolution % 64 == 0)
+	{
+		State.MirrorStatsReadback = MakeUnique<FRHIGPUBufferReadback>(TEXT("ToonShadePaint.MirrorStatsReadback"));
+		if (!EnqueueMirrorMap(RHICmdList, Inputs, Intermediates, StageTimer, State.MirrorSourceTexture, *State.MirrorStatsReadback))
+		{
+			State.MirrorStatsReadback.Reset();
+		}
+	}
+
+	// どのレイヤーでも無効なタイルを分類しておく (左右対称に決まったら使わずに捨てる)
+	if (CVarToonShadePaintTileClassification.GetValueOnRenderThread() != 0)
+	{
+		ClassifyTiles(RHICmdList, Inputs, Intermediates, StageTimer, State.TileList);
+
+		if (!bIsSeparable && CVarToonShadePaintIslandRects.GetValueOnRenderThread() != 0)
+		{
+			State.TileListReadback = MakeUnique<FRHIGPUBufferReadback>(TEXT("ToonShadePaint.TileListReadback"));
+			State.TileIndirectArgsReadback = MakeUnique<FRHIGPUBufferReadback>(TEXT("ToonShadePaint.TileIndirectArgsReadback"));
+			EnqueueTileListReadback(RHICmdList, State.TileList, *State.TileListReadback, *State.TileIndirectArgsReadback);
+		}
+	}
+
+	RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+
+	State.FirstIndex = 0;
+	State.Phase = EToonShadeBakePhase::SetupReadback;
+}
+
+
+/**
+ * Setupの読み戻しが届いていれば、半径・左右対称・タイルの分類を決めてレイヤー毎の距離を積む準備をする
+ * bWaitがfalseなら届いていない時は何も積まずにfalseを返します。
+ */
+static bool ResolveSetupReadbacks(FRHICommandListImmediate& RHICmdList, FToonShadeBakeState& State, bool bWait)
+{
+	const bool bIsMaxExtentPending = State.MaxExtentReadback && !State.MaxExtentReadback->IsReady();
+	const bool bIsMirrorStatsPending = State.MirrorStatsReadback && !State.MirrorStatsReadback->IsReady();
+	const bool bIsTileListPending = State.TileListReadback && (!State.TileListReadback->IsReady() || !State.TileIndirectArgsReadback->IsReady());
+	if (bIsMaxExtentPending || bIsMirrorStatsPending || bIsTileListPending)
+	{
+		if (!bWait)
+		{
+			return false;
+		}
+
+		RHICmdList.BlockUntilGPUIdle();
+	}
+
+	const FToonShadeBakeInputs& Inputs = State.Inputs;
+	FToonShadeBakeIntermediates& Intermediates = *State.Intermediates;
+	FTextureRWBuffer& OutputShadowThresholdTexture = *State.OutputShadowThresholdTexture;
+	FToonShadeBakeStats& OutStats = *State.OutStats;
+
+	const int32 Resolution = Inputs.Resolution;
+	const bool bKeepAllLayers = Inputs.bKeepAllLayers;
+
+	const FIntRect TextureRect(0, 0, Resolution, Resolution);
+	const ETextureCreateFlags TextureCreateFlags(TexCreate_ShaderResource | TexCreate_UAV);
+
+	int32 MaxRadius = State.MaxRadius;
+	if (State.MaxExtentReadback)
+	{
+		MaxRadius = ReadbackMaxRadius(*State.MaxExtentReadback, Resolution);
+		State.MaxExtentReadback.Reset();
+
+		UE_LOG(LogToonShadePaint, Verbose, TEXT("MaxRadius not specified, using %d for %dx%d"), MaxRadius, Resolution, Resolution);
+	}
+
+	Intermediates.ResolvedMaxRadius = MaxRadius;
+	State.MaxRadius = MaxRadius;
+
+	// 左右対称なら左半分と、そこへ伝搬が届く範囲だけ距離を計算する
+	const bool bMirrored = State.MirrorStatsReadback && ReadbackMirrorStats(*State.MirrorStatsReadback);
+	State.MirrorStatsReadback.Reset();
+	State.bMirrored = bMirrored;
+
+	if (!bMirrored)
+	{
+		State.MirrorSourceTexture = FTextureRWBuffer();  // 使わないので解放
+	}
+
+	const FIntRect HalfRect(0, 0, Resolution / 2, Resolution);
+	const FIntRect SetupRect = bMirrored ? PadDirtyRect(HalfRect, MaxRadius * 2, Resolution) : TextureRect;
+	const FIntRect CalcRect = bMirrored ? PadDirtyRect(HalfRect, MaxRadius, Resolution) : TextureRect;
+
+	OutStats.AllocatedBytes += State.MirrorSourceTexture.NumBytes;
+	OutStats.bMirrored = bMirrored;
+
+	// どのレイヤーでも無効なタイルは伝搬・SDFCalc・SDFBlendを飛ばす (左右対称は半分だけ回すので使わない)
+	State.bUseTileList = !bMirrored && State.TileList.TileListBuffer.Buffer.IsValid();
+	if (State.bUseTileList)
+	{
+		OutStats.AllocatedBytes += static_cast<int64>(State.TileList.TileListBuffer.NumBytes) + State.TileList.IndirectArgsBuffer.NumBytes;
+	}
+	else
+	{
+		State.TileList = FToonShadeTileList();
+	}
+
+	// 距離はアイランド毎の範囲だけ計算する (範囲外は全レイヤーで無効なタイルなのでSDFBlendも触らない)
+	State.bUseIslandRects = State.bUseTileList && State.TileListReadback.IsValid();
+	if (State.bUseIslandRects)
+	{
+		BuildIslandRects(Inputs, *State.TileListReadback, *State.TileIndirectArgsReadback, State.SetupRects);
+		State.CalcRects = State.SetupRects;
+	}
+	else
+	{
+		State.SetupRects.Add(SetupRect);
+		State.CalcRects.Add(CalcRect);
+	}
+
+	State.TileListReadback.Reset();
+	State.TileIndirectArgsReadback.Reset();
+
+	// アイランドの範囲は積む量を絞るだけで、伝搬は隣のアイランド(UVの継ぎ目の向こう)からも拾う
+	State.ValidRect = SetupRect;
+
+	if (!bKeepAllLayers)
+	{
+		OutputShadowThresholdTexture.Initialize2D(TEXT("SDF.OutputShadowThresholdTexture"), GPixelFormats[Inputs.PixelFormat].BlockBytes, Resolution, Resolution, Inputs.PixelFormat, TextureCreateFlags);
+		OutStats.AllocatedBytes += OutputShadowThresholdTexture.NumBytes;
+
+		RHICmdList.Transition(FRHITransitionInfo(OutputShadowThresholdTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+		// 飛ばしたタイルは無効箇所の閾値のまま残す
+		if (State.bUseTileList)
+		{
+			RHICmdList.ClearUAVFloat(OutputShadowThresholdTexture.UAV, FVector4f(1.0f, 1.0f, 0.0f, 0.0f));
+		}
+	}
+
+	FRWByteAddressBuffer& MaxDistanceBuffer = Intermediates.MaxDistanceBuffer;
+	RHICmdList.Transition(FRHITransitionInfo(MaxDistanceBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+	{
+		RHICmdList.ClearUAVUint(MaxDistanceBuffer.UAV, FUintVector4(0, 0, 0, 0));
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	return true;
+}
+
+
+/** 組の距離を初期化する (分離型EDTはここで距離まで求める) */
+static void DispatchDistanceSetup(FRHICommandListImmediate& RHICmdList, FToonShadeBakeState& State)
+{
+	const FToonShadeBakeIntermediates& Intermediates = *State.Intermediates;
+	const FTextureRWBuffer& SeedFlagsTexture = Intermediates.SeedFlagsTexture;
+	const FTextureRWBuffer& PositionTexture = Intermediates.PositionTexture;
+	TArray<FToonShadeDistanceWorkspace, TInlineAllocator<4>>& Workspaces = State.Workspaces;
+	FToonShadeStageTimer& StageTimer = State.StageTimer;
+
+	const int32 Resolution = State.Inputs.Resolution;
+	const FIntPoint TextureSize(Resolution, Resolution);
+	const int32 FirstIndex = State.FirstIndex;
+	const int32 NumWaveLayers = State.GetNumWaveLayers();
+
+	// 分離型EDTは1スレッド1行(列)
+	const uint32 LineThreadGroupCount = FMath::DivideAndRoundUp(Resolution, 64);
+
+	for (int32 WaveIndex = 0; WaveIndex < NumWaveLayers; ++WaveIndex)
+	{
+		RHICmdList.Transition(FRHITransitionInfo(Workspaces[WaveIndex].SDFInnerTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+		RHICmdList.Transition(FRHITransitionInfo(Workspaces[WaveIndex].SDFOuterTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+	}
+
+	if (State.bIsSeparable)
+	{
+		TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, DistanceMapEDT);
+
+		for (int32 WaveIndex = 0; WaveIndex < NumWaveLayers; ++WaveIndex)
+		{
+			const FToonShadeDistanceWorkspace& Workspace = Workspaces[WaveIndex];
+
+			RHICmdList.Transition(FRHITransitionInfo(Workspace.EnvelopeTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+			TShaderMapRef<FDistanceMapEDTRowCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+			SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+			SetShaderParametersLegacyCS(
+				RHICmdList,
+				ComputeShader,
+				FirstIndex + WaveIndex,
+				TextureSize,
+				SeedFlagsTexture.SRV,
+				Workspace.SDFInnerTexture.UAV,
+				Workspace.SDFOuterTexture.UAV);
+			DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), LineThreadGroupCount, 1, 1);
+			UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+			StageTimer.AddDispatch(EToonShadeBakeStage::DistanceMapEDT);
+		}
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+
+		for (int32 WaveIndex = 0; WaveIndex < NumWaveLayers; ++WaveIndex)
+		{
+			RHICmdList.Transition(FRHITransitionInfo(Workspaces[WaveIndex].SDFInnerTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::UAVCompute));
+			RHICmdList.Transition(FRHITransitionInfo(Workspaces[WaveIndex].SDFOuterTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::UAVCompute));
+		}
+
+		for (int32 WaveIndex = 0; WaveIndex < NumWaveLayers; ++WaveIndex)
+		{
+			const FToonShadeDistanceWorkspace& Workspace = Workspaces[WaveIndex];
+
+			TShaderMapRef<FDistanceMapEDTColumnCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+			SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+			SetShaderParametersLegacyCS(
+				RHICmdList,
+				ComputeShader,
+				TextureSize,
+				PositionTexture.SRV,
+				Workspace.SDFInnerTexture.UAV,
+				Workspace.SDFOuterTexture.UAV,
+				Workspace.EnvelopeTexture.UAV);
+			DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), LineThreadGroupCount, 1, 1);
+			UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+			StageTimer.AddDispatch(EToonShadeBakeStage::DistanceMapEDT);
+		}
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+		return;
+	}
+
+	{
+		TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, DistanceMapSetup);
+
+		TShaderMapRef<FDistanceMapSetupCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+
+		for (int32 WaveIndex = 0; WaveIndex < NumWaveLayers; ++WaveIndex)
+		{
+			const FToonShadeDistanceWorkspace& Workspace = Workspaces[WaveIndex];
+
+			for (const FIntRect& Rect : State.SetupRects)
+			{
+				SetShaderParametersLegacyCS(
+					RHICmdList,
+					ComputeShader,
+					FirstIndex + WaveIndex,
+					Rect.Min,
+					SeedFlagsTexture.SRV,
+					Workspace.SDFInnerTexture.UAV,
+					Workspace.SDFOuterTexture.UAV);
+				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), Rect.Width() / 32, Rect.Height() / 32, 1);
+				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+				StageTimer.AddDispatch(EToonShadeBakeStage::DistanceMapSetup);
+			}
+		}
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	for (int32 WaveIndex = 0; WaveIndex < NumWaveLayers; ++WaveIndex)
+	{
+		Workspaces[WaveIndex].LastRadius = 0;
+		Workspaces[WaveIndex].bIsConverged = false;
+	}
+
+	for (FToonShadeConvergenceReadback& ConvergenceReadback : State.ConvergenceReadbacks)
+	{
+		ConvergenceReadback.bIsPending = false;  // 前の組の読み戻しは捨てる
+	}
+
+	State.Radius = 1;
+}
+
+
+/**
+ * 組の伝搬を1半径ずつ積む
+ * ディスパッチ数がDispatchLimitに達したら半径の区切りで止めます。(1半径は必ず積む)
+ * @return 組の伝搬を積み終えた場合はtrueを返します。
+ */
+static bool DispatchDistanceIter(FRHICommandListImmediate& RHICmdList, FToonShadeBakeState& State, int64 DispatchLimit)
+{
+	const FToonShadeBakeIntermediates& Intermediates = *State.Intermediates;
+	const FTextureRWBuffer& SeedFlagsTexture = Intermediates.SeedFlagsTexture;
+	const FTextureRWBuffer& PositionTexture = Intermediates.PositionTexture;
+	FToonShadeStageTimer& StageTimer = State.StageTimer;
+
+	const int32 FirstIndex = State.FirstIndex;
+	const int32 NumWaveLayers = State.GetNumWaveLayers();
+	const int32 MaxRadius = State.MaxRadius;
+	const int32 ConvergenceCheckInterval = State.ConvergenceCheckInterval;
+
+	const FToonShadeTileList* DistanceTileList = State.GetDistanceTileList();
+	FRHIShaderResourceView* TileListSRV = DistanceTileList ? DistanceTileList->TileListBuffer.SRV.GetReference() : nullptr;
+
+	TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, DistanceMapIter);
+
+	const TArrayView<FToonShadeDistanceWorkspace> WaveWorkspaces(State.Workspaces.GetData(), NumWaveLayers);
+
+	// 同じ半径を全レイヤー分並べてから次の半径へ (同じレイヤーの前後だけが依存する)
+	const int32 FirstRadius = State.Radius;
+	for (; State.Radius <= MaxRadius; ++State.Radius)
+	{
+		const int32 Radius = State.Radius;
+
+		if (Algo::AllOf(WaveWorkspaces, [](const FToonShadeDistanceWorkspace& Workspace) { return Workspace.bIsConverged; }))
+		{
+			break;
+		}
+
+		if (Radius != FirstRadius && StageTimer.GetNumDispatches() >= DispatchLimit)
+		{
+			return false;  // 続きは次の呼び出しで
+		}
+
+		FToonShadeConvergenceReadback* ConvergenceReadback = nullptr;
+		if (ConvergenceCheckInterval > 0)
+		{
+			const int32 CheckIndex = (Radius - 1) / ConvergenceCheckInterval;
+			ConvergenceReadback = &State.ConvergenceReadbacks[CheckIndex % UE_ARRAY_COUNT(State.ConvergenceReadbacks)];
+
+			if ((Radius - 1) % ConvergenceCheckInterval == 0)
+			{
+				// 2つ前の間隔の読み戻しがまだなら待つ
+				ResolveConvergenceReadback(RHICmdList, *ConvergenceReadback, WaveWorkspaces, true);
+
+				RHICmdList.Transition(FRHITransitionInfo(ConvergenceReadback->ChangedTexelBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+				RHICmdList.ClearUAVUint(ConvergenceReadback->ChangedTexelBuffer.UAV, FUintVector4(0, 0, 0, 0));
+			}
+		}
+
+		FDistanceMapIterCS::FPermutationDomain PermutationVector;
+		PermutationVector.Set<FDistanceMapIterCS::FFlip>(Radius % 2 == 0);
+		PermutationVector.Set<FDistanceMapIterCS::FTileList>(DistanceTileList != nullptr);
+		PermutationVector.Set<FDistanceMapIterCS::FCountChangedTexels>(ConvergenceReadback != nullptr);
+		TShaderMapRef<FDistanceMapIterCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+
+		for (int32 WaveIndex = 0; WaveIndex < NumWaveLayers; ++WaveIndex)
+		{
+			FToonShadeDistanceWorkspace& Workspace = WaveWorkspaces[WaveIndex];
+			if (Workspace.bIsConverged)
+			{
+				continue;
+			}
+
+			// アイランド同士は重ならないので間に障壁は要らない
+			for (const FIntRect& Rect : State.SetupRects)
+			{
+				SetShaderParametersLegacyCS(
+					RHICmdList,
+					ComputeShader,
+					FirstIndex + WaveIndex,
+					Rect.Min,
+					State.ValidRect,
+					Radius,
+					SeedFlagsTexture.SRV,
+					PositionTexture.SRV,
+					TileListSRV,
+					Workspace.SDFInnerTexture.UAV,
+					Workspace.SDFOuterTexture.UAV,
+					WaveIndex,
+					ConvergenceReadback ? ConvergenceReadback->ChangedTexelBuffer.UAV.GetReference() : nullptr);
+				DispatchTiledComputeShader(RHICmdList, ComputeShader.GetShader(), DistanceTileList, Rect.Width() / 32, Rect.Height() / 32);
+				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+				StageTimer.AddDispatch(EToonShadeBakeStage::DistanceMapIter);
+			}
+
+			Workspace.LastRadius = Radius;
+			++State.OutStats->NumIterations;
+		}
+
+		if (ConvergenceReadback && (Radius % ConvergenceCheckInterval == 0 || Radius == MaxRadius))
+		{
+			RHICmdList.Transition(FRHITransitionInfo(ConvergenceReadback->ChangedTexelBuffer.UAV, ERHIAccess::UAVCompute, ERHIAccess::CopySrc));
+			ConvergenceReadback->Readback->EnqueueCopy(RHICmdList, ConvergenceReadback->ChangedTexelBuffer.Buffer, ConvergenceReadback->ChangedTexelBuffer.NumBytes);
+			ConvergenceReadback->bIsPending = true;
+		}
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+
+		// 届いている読み戻しだけ拾う (待つと伝搬が止まる)
+		for (FToonShadeConvergenceReadback& PendingReadback : State.ConvergenceReadbacks)
+		{
+			ResolveConvergenceReadback(RHICmdList, PendingReadback, WaveWorkspaces, false);
+		}
+	}
+
+	return true;
+}
+
+
+/** 組の距離からSDFを求めて、使い回す時は1つ前のレイヤーとの閾値まで足し込む */
+static void DispatchSDFCalc(FRHICommandListImmediate& RHICmdList, FToonShadeBakeState& State)
+{
+	const FToonShadeBakeInputs& Inputs = State.Inputs;
+	const FToonShadeBakeIntermediates& Intermediates = *State.Intermediates;
+	const FTextureRWBuffer& SeedFlagsTexture = Intermediates.SeedFlagsTexture;
+	const FTextureRWBuffer& PositionTexture = Intermediates.PositionTexture;
+	const FRWByteAddressBuffer& MaxDistanceBuffer = Intermediates.MaxDistanceBuffer;
+	const TArray<FToonShadeDistanceWorkspace, TInlineAllocator<4>>& Workspaces = State.Workspaces;
+	FTextureRWBuffer& SDFTexture = State.GetSDFTexture();
+	FToonShadeStageTimer& StageTimer = State.StageTimer;
+
+	const int32 Resolution = Inputs.Resolution;
+	const FIntPoint TextureSize(Resolution, Resolution);
+	const int32 FirstIndex = State.FirstIndex;
+	const int32 NumWaveLayers = State.GetNumWaveLayers();
+	const int32 NumSDFSlices = State.NumSDFSlices;
+
+	const FToonShadeTileList* DistanceTileList = State.GetDistanceTileList();
+	FRHIShaderResourceView* TileListSRV = DistanceTileList ? DistanceTileList->TileListBuffer.SRV.GetReference() : nullptr;
+
+	for (int32 WaveIndex = 0; WaveIndex < NumWaveLayers; ++WaveIndex)
+	{
+		RHICmdList.Transition(FRHITransitionInfo(Workspaces[WaveIndex].SDFInnerTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+		RHICmdList.Transition(FRHITransitionInfo(Workspaces[WaveIndex].SDFOuterTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+	}
+
+	RHICmdList.Transition(FRHITransitionInfo(SDFTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+	RHICmdList.Transition(FRHITransitionInfo(MaxDistanceBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+	{
+		TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, SDFCalc);
+
+		for (int32 WaveIndex = 0; WaveIndex < NumWaveLayers; ++WaveIndex)
+		{
+			const FToonShadeDistanceWorkspace& Workspace = Workspaces[WaveIndex];
+			const int32 Index = FirstIndex + WaveIndex;
+
+			// 収束で打ち切るとレイヤー毎に最後に書いた側が異なる
+			FSDFCalcCS::FPermutationDomain PermutationVector;
+			PermutationVector.Set<FSDFCalcCS::FFlip>(!State.bIsSeparable && Workspace.LastRadius % 2 == 0);  // 分離型EDTは.zwに書く
+			PermutationVector.Set<FSDFCalcCS::FTileList>(DistanceTileList != nullptr);
+			TShaderMapRef<FSDFCalcCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+			SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+
+			for (const FIntRect& Rect : State.CalcRects)
+			{
+				// 使い回す時は、前の周でSDFBlendが読み終えたスライスへ書き込む
+				SetShaderParametersLegacyCS(
+					RHICmdList,
+					ComputeShader,
+					Index,
+					Index % NumSDFSlices,
+					TextureSize,
+					Rect.Min,
+					SeedFlagsTexture.SRV,
+					PositionTexture.SRV,
+					Intermediates.PositionBoundsBuffer.SRV,
+					Workspace.SDFInnerTexture.SRV,
+					Workspace.SDFOuterTexture.SRV,
+					TileListSRV,
+					SDFTexture.UAV,
+					MaxDistanceBuffer.UAV);
+				DispatchTiledComputeShader(RHICmdList, ComputeShader.GetShader(), DistanceTileList, Rect.Width() / 32, Rect.Height() / 32);
+				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+				StageTimer.AddDispatch(EToonShadeBakeStage::SDFCalc);
+			}
+		}
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	if (State.bMirrored)
+	{
+		TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, SDFMirror);
+
+		RHICmdList.Transition(FRHITransitionInfo(SDFTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::UAVCompute));
+
+		TShaderMapRef<FSDFMirrorCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+
+		for (int32 WaveIndex = 0; WaveIndex < NumWaveLayers; ++WaveIndex)
+		{
+			SetShaderParametersLegacyCS(
+				RHICmdList,
+				ComputeShader,
+				TextureSize,
+				(FirstIndex + WaveIndex) % NumSDFSlices,
+				State.MirrorSourceTexture.SRV,
+				SDFTexture.UAV);
+			DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), Resolution / 64, Resolution / 32, 1);
+			UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+			StageTimer.AddDispatch(EToonShadeBakeStage::SDFMirror);
+		}
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	if (!Inputs.bKeepAllLayers)
+	{
+		RHICmdList.Transition(FRHITransitionInfo(SDFTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+		RHICmdList.Transition(FRHITransitionInfo(MaxDistanceBuffer.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+
+		for (int32 Index = FMath::Max(FirstIndex, 1); Index < FirstIndex + NumWaveLayers; ++Index)
+		{
+			BlendShadowThresholdLayerPair(RHICmdList, Inputs, Intermediates, SDFTexture, NumSDFSlices, Index - 1, State.GetTileList(), StageTimer, State.AccumulatedThresholdTexture, *State.OutputShadowThresholdTexture);
+		}
+	}
+}
+
+
+/**
+ * レイヤーの距離を続きから積む
+ * ディスパッチ数がDispatchBudgetを超えたら伝搬の半径の区切りで止めます。
+ * bWaitForReadbacksがfalseなら、Setupの読み戻しが届くまでは何も積まずに戻ります。
+ * @return 全レイヤーを積み終えた場合はtrueを返します。
+ */
+static bool StepShadowThresholdMap(FRHICommandListImmediate& RHICmdList, FToonShadeBakeState& State, int32 DispatchBudget, bool bWaitForReadbacks)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(StepShadowThresholdMap);
+
+	const int64 DispatchLimit = State.StageTimer.GetNumDispatches() + static_cast<int64>(DispatchBudget);
+
+	while (State.FirstIndex < State.Inputs.SeedTextures.Num())
+	{
+		if (State.StageTimer.GetNumDispatches() >= DispatchLimit)
+		{
+			return false;
+		}
+
+		switch (State.Phase)
+		{
+		case EToonShadeBakePhase::SetupReadback:
+			if (!ResolveSetupReadbacks(RHICmdList, State, bWaitForReadbacks))
+			{
+				return false;  // 続きは次の呼び出しで
+			}
+			State.Phase = EToonShadeBakePhase::DistanceSetup;
+			break;
+		case EToonShadeBakePhase::DistanceSetup:
+			DispatchDistanceSetup(RHICmdList, State);
+			State.Phase = State.bIsSeparable ? EToonShadeBakePhase::SDFCalc : EToonShadeBakePhase::DistanceIter;
+			break;
+		case EToonShadeBakePhase::DistanceIter:
+			if (DispatchDistanceIter(RHICmdList, State, DispatchLimit))
+			{
+				State.Phase = EToonShadeBakePhase::SDFCalc;
+			}
+			break;
+		case EToonShadeBakePhase::SDFCalc:
+			DispatchSDFCalc(RHICmdList, State);
+			State.FirstIndex += State.NumLayersInFlight;
+			State.Phase = EToonShadeBakePhase::DistanceSetup;
+			break;
+		}
+	}
+
+	return true;
+}
+
+
+/** 積み終えた距離から閾値を出力する (計測の集計はStageTimer.Resolveで) */
+static void EndShadowThresholdMap(FRHICommandListImmediate& RHICmdList, FToonShadeBakeState& State)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(EndShadowThresholdMap);
+
+	FToonShadeBakeStats& OutStats = *State.OutStats;
+	FTextureRWBuffer& OutputShadowThresholdTexture = *State.OutputShadowThresholdTexture;
+
+	if (State.Inputs.bKeepAllLayers)
+	{
+		FTextureRWBuffer& SDFTexture = State.GetSDFTexture();
+		RHICmdList.Transition(FRHITransitionInfo(SDFTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+		RHICmdList.Transition(FRHITransitionInfo(State.Intermediates->MaxDistanceBuffer.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+
+		OutStats.AllocatedBytes += BlendShadowThresholdMap(RHICmdList, State.Inputs, *State.Intermediates, State.GetTileList(), State.StageTimer, OutputShadowThresholdTexture);
+	}
+	else
+	{
+		RHICmdList.Transition(FRHITransitionInfo(OutputShadowThresholdTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+	}
+
+	SET_MEMORY_STAT(STAT_ToonShadePaint_LastBakeMemory, OutStats.AllocatedBytes);
+}
+
+
+/** 積み終えた割合 (伝搬はレイヤーと半径の数で数える) */
+static float GetShadowThresholdMapProgress(const FToonShadeBakeState& State)
+{
+	const int32 NumSeedTextures = State.Inputs.SeedTextures.Num();
+	const int32 NumRadii = State.bIsSeparable ? 1 : FMath::Max(State.MaxRadius, 1);
+
+	int64 NumCompleted = static_cast<int64>(FMath::Min(State.FirstIndex, NumSeedTextures)) * NumRadii;
+	if (State.FirstIndex < NumSeedTextures)
+	{
+		if (State.Phase == EToonShadeBakePhase::DistanceIter)
+		{
+			NumCompleted += static_cast<int64>(State.GetNumWaveLayers()) * FMath::Clamp(State.Radius - 1, 0, NumRadii);
+		}
+		else if (State.Phase == EToonShadeBakePhase::SDFCalc)
+		{
+			NumCompleted += static_cast<int64>(State.GetNumWaveLayers()) * NumRadii;
+		}
+	}
+
+	return NumSeedTextures > 0 ? static_cast<float>(static_cast<double>(NumCompleted) / (static_cast<double>(NumSeedTextures) * NumRadii)) : 1.0f;
+}
+
+
+/**
+ * DirtyRectの焼き直し1回分の途中の状態
+ * 伝搬の半径の区切りで止めて、次のStepShadowThresholdMapRegionで続きから積めます。
+ */
+struct FToonShadeRegionBakeState
+{
+	FToonShadeBakeInputs Inputs;
+	/** 前回の焼きで残したもの (範囲の分をその場で書き換える) */
+	FToonShadeBakeIntermediates* Intermediates = nullptr;
+	FTextureRWBuffer* OutputShadowThresholdTexture = nullptr;
+	FToonShadeBakeStats* OutStats = nullptr;
+
+	FToonShadeStageTimer StageTimer;
+
+	/** 前回の焼きで決まった伝搬半径 */
+	int32 MaxRadius = 0;
+	/** 距離を書き直す範囲 */
+	FIntRect CalcRect;
+	/** Seedと伝搬の範囲 */
+	FIntRect SetupRect;
+
+	FTextureRWBuffer SDFInnerTexture;
+	FTextureRWBuffer SDFOuterTexture;
+
+	/** 積んでいるレイヤー */
+	int32 Index = 0;
+	EToonShadeBakePhase Phase = EToonShadeBakePhase::DistanceSetup;
+	/** 次に回す伝搬の半径 */
+	int32 Radius = 1;
+};
+
+
+/**
+ * DirtyRectの焼き直しの、Seedの取り込みまで積む (距離はStepShadowThresholdMapRegionで)
+ * Seedと距離は範囲を伝搬半径分広げた中だけ計算し、範囲外の距離は前回のものを使い回します。
+ * 伝搬は半径MaxRadiusまでしか拾わない前提なので、それより遠くから届いていた最寄りは拾い損ねます。
+ */
+static void BeginShadowThresholdMapRegion(FRHICommandListImmediate& RHICmdList, const FToonShadeBakeInputs& Inputs, const FIntRect& DirtyRect, FToonShadeBakeIntermediates& Intermediates, FTextureRWBuffer& OutputShadowThresholdTexture, FToonShadeBakeStats& OutStats, FToonShadeRegionBakeState& State)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(BeginShadowThresholdMapRegion);
+
+	const int32 Resolution = Inputs.Resolution;
+	const int32 NumSeedTextures = Inputs.SeedTextures.Num();
+	const int32 MaxRadius = Intermediates.ResolvedMaxRadius;
+
+	State.Inputs = Inputs;
+	State.Intermediates = &Intermediates;
+	State.OutputShadowThresholdTexture = &OutputShadowThresholdTexture;
+	State.OutStats = &OutStats;
+	State.MaxRadius = MaxRadius;
+
+	// 距離を書き直す範囲は伝搬半径分、その範囲まで正しく伝搬するようにSeedは更に伝搬半径分広げる
+	State.CalcRect = PadDirtyRect(DirtyRect, MaxRadius, Resolution);
+	State.SetupRect = PadDirtyRect(DirtyRect, MaxRadius * 2, Resolution);
+
+	const FIntPoint SetupThreadGroupCount = State.SetupRect.Size() / 32;
+
+	const ETextureCreateFlags TextureCreateFlags(TexCreate_ShaderResource | TexCreate_UAV);
+
+	FTextureRWBuffer& SeedFlagsTexture = Intermediates.SeedFlagsTexture;
+	FRWByteAddressBuffer& MaxDistanceBuffer = Intermediates.MaxDistanceBuffer;
+	FToonShadeStageTimer& StageTimer = State.StageTimer;
+
+	State.SDFInnerTexture.Initialize2D(TEXT("ToonShadePaint.SDFInnerTexture"), GPixelFormats[PF_FloatRGBA].BlockBytes, Resolution, Resolution, PF_FloatRGBA, TextureCreateFlags);
+	State.SDFOuterTexture.Initialize2D(TEXT("ToonShadePaint.SDFOuterTexture"), GPixelFormats[PF_FloatRGBA].BlockBytes, Resolution, Resolution, PF_FloatRGBA, TextureCreateFlags);
+
+	// 使い回す分は前回の焼きで確保済み
+	OutStats.AllocatedBytes =
+		static_cast<int64>(State.SDFInnerTexture.NumBytes) +
+		State.SDFOuterTexture.NumBytes;
+
+	// 範囲外の距離は正規化前のまま残っているので、最大値だけ拾い直す
+	{
+		RHICmdList.Transition(FRHITransitionInfo(MaxDistanceBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+		RHICmdList.ClearUAVUint(MaxDistanceBuffer.UAV, FUintVector4(0, 0, 0, 0));
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	// モデル座標は変わっていない前提なのでSeedだけ撮り直した分を取り込む
+	{
+		RHICmdList.Transition(FRHITransitionInfo(SeedFlagsTexture.UAV, ERHIAccess::SRVMask, ERHIAccess::UAVCompute));
+
+		{
+			TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, SetupSeedFlags);
+
+			for (int32 LayerIndex = 0; LayerIndex < NumSeedTextures; ++LayerIndex)
+			{
+				TShaderMapRef<FSetupSeedFlagsCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+				SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+				SetShaderParametersLegacyCS(
+					RHICmdList,
+					ComputeShader,
+					LayerIndex,
+					Inputs.SampleScale,
+					State.SetupRect.Min,
+					Inputs.SeedTextures[LayerIndex],
+					SeedFlagsTexture.UAV);
+				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), SetupThreadGroupCount.X, SetupThreadGroupCount.Y, 1);
+				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+				StageTimer.AddDispatch(EToonShadeBakeStage::SetupSeedFlags);
+			}
+		}
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+
+		RHICmdList.Transition(FRHITransitionInfo(SeedFlagsTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+	}
+}
+
+
+/** 範囲の中でレイヤーの距離を初期化する */
+static void DispatchDistanceSetupRegion(FRHICommandListImmediate& RHICmdList, FToonShadeRegionBakeState& State)
+{
+	const FIntPoint SetupThreadGroupCount = State.SetupRect.Size() / 32;
+
+	RHICmdList.Transition(FRHITransitionInfo(State.SDFInnerTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+	RHICmdList.Transition(FRHITransitionInfo(State.SDFOuterTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+	TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, State.StageTimer, DistanceMapSetup);
+
+	TShaderMapRef<FDistanceMapSetupCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+	SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+	SetShaderParametersLegacyCS(
+		RHICmdList,
+		ComputeShader,
+		State.Index,
+		State.SetupRect.Min,
+		State.Intermediates->SeedFlagsTexture.SRV,
+		State.SDFInnerTexture.UAV,
+		State.SDFOuterTexture.UAV);
+	DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), SetupThreadGroupCount.X, SetupThreadGroupCount.Y, 1);
+	UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+	State.StageTimer.AddDispatch(EToonShadeBakeStage::DistanceMapSetup);
+
+	RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+}
+
+
+/**
+ * 範囲の中でレイヤーの伝搬を続きから回す
+ * ディスパッチ数がDispatchLimitに届いたら、少なくとも1半径は回してから止めます。
+ * @return 半径MaxRadiusまで回し終えた場合はtrueを返します。
+ */
+static bool DispatchDistanceIterRegion(FRHICommandListImmediate& RHICmdList, FToonShadeRegionBakeState& State, int64 DispatchLimit)
+{
+	const FIntPoint SetupThreadGroupCount = State.SetupRect.Size() / 32;
+	const FToonShadeBakeIntermediates& Intermediates = *State.Intermediates;
+
+	TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, State.StageTimer, DistanceMapIter);
+
+	for (const int32 FirstRadius = State.Radius; State.Radius <= State.MaxRadius; ++State.Radius)
+	{
+		if (State.Radius != FirstRadius && State.StageTimer.GetNumDispatches() >= DispatchLimit)
+		{
+			return false;
+		}
+
+		FDistanceMapIterCS::FPermutationDomain PermutationVector;
+		PermutationVector.Set<FDistanceMapIterCS::FFlip>(State.Radius % 2 == 0);
+		TShaderMapRef<FDistanceMapIterCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+		SetShaderParametersLegacyCS(
+			RHICmdList,
+			ComputeShader,
+			State.Index,
+			State.SetupRect.Min,
+			State.SetupRect,  // 範囲外のSDFInner/SDFOuterは別レイヤーの残骸
+			State.Radius,
+			Intermediates.SeedFlagsTexture.SRV,
+			Intermediates.PositionTexture.SRV,
+			nullptr,
+			State.SDFInnerTexture.UAV,
+			State.SDFOuterTexture.UAV,
+			0,
+			nullptr);
+		DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), SetupThreadGroupCount.X, SetupThreadGroupCount.Y, 1);
+		UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+		State.StageTimer.AddDispatch(EToonShadeBakeStage::DistanceMapIter);
+		++State.OutStats->NumIterations;
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	return true;
+}
+
+
+/** 範囲の距離からレイヤーのSDFを書き直して、範囲外も含めた最大値を拾う */
+static void DispatchSDFCalcRegion(FRHICommandListImmediate& RHICmdList, FToonShadeRegionBakeState& State)
+{
+	const int32 Resolution = State.Inputs.Resolution;
+	const FIntPoint TextureSize(Resolution, Resolution);
+	const FIntPoint CalcThreadGroupCount = State.CalcRect.Size() / 32;
+
+	FToonShadeBakeIntermediates& Intermediates = *State.Intermediates;
+	FTextureRWBuffer& SDFTexture = Intermediates.SDFTexture;
+	FRWByteAddressBuffer& MaxDistanceBuffer = Intermediates.MaxDistanceBuffer;
+	FToonShadeStageTimer& StageTimer = State.StageTimer;
+
+	RHICmdList.Transition(FRHITransitionInfo(State.SDFInnerTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+	RHICmdList.Transition(FRHITransitionInfo(State.SDFOuterTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+
+	RHICmdList.Transition(FRHITransitionInfo(SDFTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+	RHICmdList.Transition(FRHITransitionInfo(MaxDistanceBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+	{
+		TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, SDFCalc);
+
+		FSDFCalcCS::FPermutationDomain PermutationVector;
+		PermutationVector.Set<FSDFCalcCS::FFlip>(State.MaxRadius % 2 == 0);
+		TShaderMapRef<FSDFCalcCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+		SetShaderParametersLegacyCS(
+			RHICmdList,
+			ComputeShader,
+			State.Index,
+			State.Index,
+			TextureSize,
+			State.CalcRect.Min,
+			Intermediates.SeedFlagsTexture.SRV,
+			Intermediates.PositionTexture.SRV,
+			Intermediates.PositionBoundsBuffer.SRV,
+			State.SDFInnerTexture.SRV,
+			State.SDFOuterTexture.SRV,
+			nullptr,
+			SDFTexture.UAV,
+			MaxDistanceBuffer.UAV);
+		DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), CalcThreadGroupCount.X, CalcThreadGroupCount.Y, 1);
+		UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+		StageTimer.AddDispatch(EToonShadeBakeStage::SDFCalc);
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	RHICmdList.Transition(FRHITransitionInfo(SDFTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+
+	// 焼き直していない範囲の最大値も拾う
+	{
+		TOONSHADEPAINT_STAGE_SCOPE(RHICmdList, StageTimer, SDFCalc);
+
+		TShaderMapRef<FSDFRegionMaxCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+		SetShaderParametersLegacyCS(
+			RHICmdList,
+			ComputeShader,
+			State.Index,
+			State.CalcRect,
+			Intermediates.SeedFlagsTexture.SRV,
+			SDFTexture.SRV,
+			MaxDistanceBuffer.UAV);
+		DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), Resolution / 32, Resolution / 32, 1);
+		UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+		StageTimer.AddDispatch(EToonShadeBakeStage::SDFCalc);
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+}
+
+
+/**
+ * DirtyRectの焼き直しのレイヤーの距離を続きから積む
+ * ディスパッチ数がDispatchBudgetを超えたら伝搬の半径の区切りで止めます。
+ * @return 全レイヤーを積み終えた場合はtrueを返します。
+ */
+static bool StepShadowThresholdMapRegion(FRHICommandListImmediate& RHICmdList, FToonShadeRegionBakeState& State, int32 DispatchBudget)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(StepShadowThresholdMapRegion);
+
+	const int64 DispatchLimit = State.StageTimer.GetNumDispatches() + static_cast<int64>(DispatchBudget);
+
+	while (State.Index < State.Inputs.SeedTextures.Num())
+	{
+		if (State.StageTimer.GetNumDispatches() >= DispatchLimit)
+		{
+			return false;
+		}
+
+		switch (State.Phase)
+		{
+		case EToonShadeBakePhase::DistanceSetup:
+			DispatchDistanceSetupRegion(RHICmdList, State);
+			State.Radius = 1;
+			State.Phase = EToonShadeBakePhase::DistanceIter;
+			break;
+		case EToonShadeBakePhase::DistanceIter:
+			if (DispatchDistanceIterRegion(RHICmdList, State, DispatchLimit))
+			{
+				State.Phase = EToonShadeBakePhase::SDFCalc;
+			}
+			break;
+		case EToonShadeBakePhase::SDFCalc:
+			DispatchSDFCalcRegion(RHICmdList, State);
+			++State.Index;
+			State.Phase = EToonShadeBakePhase::DistanceSetup;
+			break;
+		default:
+			checkNoEntry();  // Setupの読み戻しは前回の焼きで済んでいる
+			return true;
+		}
+	}
+
+	return true;
+}
+
+
+/** DirtyRectの焼き直しで積み終えた距離から閾値を出力する (計測の集計はStageTimer.Resolveで) */
+static void EndShadowThresholdMapRegion(FRHICommandListImmediate& RHICmdList, FToonShadeRegionBakeState& State)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(EndShadowThresholdMapRegion);
+
+	FToonShadeBakeStats& OutStats = *State.OutStats;
+
+	RHICmdList.Transition(FRHITransitionInfo(State.Intermediates->MaxDistanceBuffer.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+
+	OutStats.AllocatedBytes += BlendShadowThresholdMap(RHICmdList, State.Inputs, *State.Intermediates, nullptr, State.StageTimer, *State.OutputShadowThresholdTexture);
+
+	SET_MEMORY_STAT(STAT_ToonShadePaint_LastBakeMemory, OutStats.AllocatedBytes);
+}
+
+
+/** DirtyRectの焼き直しを積み終えた割合 */
+static float GetShadowThresholdMapRegionProgress(const FToonShadeRegionBakeState& State)
+{
+	const int32 NumSeedTextures = State.Inputs.SeedTextures.Num();
+	const int32 NumRadii = FMath::Max(State.MaxRadius, 1);
+
+	int64 NumCompleted = static_cast<int64>(FMath::Min(State.Index, NumSeedTextures)) * NumRadii;
+	if (State.Index < NumSeedTextures)
+	{
+		if (State.Phase == EToonShadeBakePhase::DistanceIter)
+		{
+			NumCompleted += FMath::Clamp(State.Radius - 1, 0, NumRadii);
+		}
+		else if (State.Phase == EToonShadeBakePhase::SDFCalc)
+		{
+			NumCompleted += NumRadii;
+		}
+	}
+
+	return NumSeedTextures > 0 ? static_cast<float>(static_cast<double>(NumCompleted) / (static_cast<double>(NumSeedTextures) * NumRadii)) : 1.0f;
+}
+
+
+/** DirtyRectの焼き直しにIntermediatesを使い回せるか */
+static bool CanBakeShadowThresholdMapRegion(const FToonShadeBakeInputs& Inputs, const FToonShadeBakeIntermediates& Intermediates, const FIntRect& DirtyRect)
+{
+	if (DirtyRect.Area() <= 0 || !Intermediates.SDFTexture.Buffer.IsValid())
+	{
+		return false;
+	}
+
+	// 分離型EDTは行・列を丸ごと走査するので範囲を絞れない
+	if (Inputs.Settings.DistanceMode == EToonShadeDistanceMode::Separable)
+	{
+		return false;
+	}
+
+	return Inputs.SampleScale == 1
+		&& Intermediates.Resolution == Inputs.Resolution
+		&& Intermediates.NumLayers == Inputs.SeedTextures.Num()
+		&& Intermediates.MaxRadius == Inputs.MaxRadius
+		&& Intermediates.DistanceMode == Inputs.Settings.DistanceMode;
+}
+
+
+/** タイル毎のモデル座標のAABBを積む (形状のワールド範囲から焼き直す範囲を引く用) */
+static void EnqueuePositionTileBounds(FRHICommandListImmediate& RHICmdList, const FToonShadeBakeInputs& Inputs, FRHIGPUBufferReadback& TileBoundsReadback)
+{
+	SCOPED_DRAW_EVENT(RHICmdList, ToonShadePaint_PositionTileBounds);
+
+	const int32 NumTilesX = Inputs.Resolution / kToonShadePositionTileSize;
+
+	FRWBuffer TileBoundsBuffer;
+	TileBoundsBuffer.Initialize(RHICmdList, TEXT("ToonShadePaint.TileBoundsBuffer"), sizeof(FVector4f), NumTilesX * NumTilesX * 2, PF_A32B32G32R32F, BUF_SourceCopy);
+
+	RHICmdList.Transition(FRHITransitionInfo(TileBoundsBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+	{
+		TShaderMapRef<FPositionTileBoundsCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+		SetShaderParametersLegacyCS(
+			RHICmdList,
+			ComputeShader,
+			NumTilesX,
+			Inputs.SeedTextures[0],
+			Inputs.PositionTexture,
+			TileBoundsBuffer.UAV);
+		DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), NumTilesX, NumTilesX, 1);
+		UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	RHICmdList.Transition(FRHITransitionInfo(TileBoundsBuffer.UAV, ERHIAccess::UAVCompute, ERHIAccess::CopySrc));
+	TileBoundsReadback.EnqueueCopy(RHICmdList, TileBoundsBuffer.Buffer, TileBoundsBuffer.NumBytes);
+}
+
+
+static void ReadbackPositionTileBounds(FRHICommandListImmediate& RHICmdList, FRHIGPUBufferReadback& TileBoundsReadback, int32 Resolution, TArray<FBox3f>& OutTileBounds, int32& OutNumTilesX)
+{
+	const int32 NumTilesX = Resolution / kToonShadePositionTileSize;
+	const int32 NumTiles = NumTilesX * NumTilesX;
+
+	// 焼きの前に積んだので大抵は読める
+	if (!TileBoundsReadback.IsReady())
+	{
+		RHICmdList.BlockUntilGPUIdle();
+	}
+
+	const FVector4f* TileBounds = static_cast<const FVector4f*>(TileBoundsReadback.Lock(NumTiles * 2 * sizeof(FVector4f)));
+	if (TileBounds == nullptr)
+	{
+		return;
+	}
+
+	OutTileBounds.SetNumUninitialized(NumTiles);
+	for (int32 TileIndex = 0; TileIndex < NumTiles; ++TileIndex)
+	{
+		const FVector3f Min(TileBounds[TileIndex * 2 + 0]);
+		const FVector3f Max(TileBounds[TileIndex * 2 + 1]);
+		OutTileBounds[TileIndex] = Min.X <= Max.X ? FBox3f(Min, Max) : FBox3f(ForceInit);  // 有効なテクセルなし
+	}
+	OutNumTilesX = NumTilesX;
+
+	TileBoundsReadback.Unlock();
+}
+
+
+/** 縮小して焼いたプレビューを出力解像度に拡大 */
+static void UpsamplePreview(FRHICommandListImmediate& RHICmdList, const FToonShadeBakeInputs& PreviewInputs, FRHITexture* SeedTexture, const FTextureRWBuffer& PreviewShadowThresholdTexture, FTextureRWBuffer& OutputShadowThresholdTexture)
+{
+	SCOPED_DRAW_EVENT(RHICmdList, ToonShadePaint_PreviewUpsample);
+
+	const int32 Resolution = PreviewInputs.Resolution * PreviewInputs.SampleScale;
+
+	const ETextureCreateFlags TextureCreateFlags(TexCreate_ShaderResource | TexCreate_UAV);
+	OutputShadowThresholdTexture.Initialize2D(TEXT("SDF.OutputShadowThresholdTexture"), GPixelFormats[PreviewInputs.PixelFormat].BlockBytes, Resolution, Resolution, PreviewInputs.PixelFormat, TextureCreateFlags);
+
+	RHICmdList.Transition(FRHITransitionInfo(OutputShadowThresholdTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+	{
+		TShaderMapRef<FPreviewUpsampleCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+		SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+		SetShaderParametersLegacyCS(
+			RHICmdList,
+			ComputeShader,
+			PreviewInputs.SampleScale,
+			FIntPoint(PreviewInputs.Resolution, PreviewInputs.Resolution),
+			SeedTexture,
+			PreviewShadowThresholdTexture.SRV,
+			OutputShadowThresholdTexture.UAV);
+		DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), Resolution / 32, Resolution / 32, 1);
+		UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	}
+
+	RHICmdList.Transition(FRHITransitionInfo(OutputShadowThresholdTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+}
+
+
+/** 焼きを積み終えるまで持ち越すもの (ジョブと一緒にゲームスレッドで作るが、中身は描画スレッド専用) */
+struct FToonShadeBakeTask
+{
+	/** 積んでいる途中の状態 (積み終えるか取り消したら空、DirtyRectの焼き直しはRegionState) */
+	TUniquePtr<FToonShadeBakeState> State;
+	TUniquePtr<FToonShadeRegionBakeState> RegionState;
+
+	/** Stateは縮小プレビューで、出力する時に拡大する */
+	bool bIsPreview = false;
+
+	FToonShadeBakeIntermediates Intermediates;
+	FTextureRWBuffer OutputShadowThresholdTexture;
+	FTextureRHIRef DstTexture;
+
+	/** bRetainIntermediatesの時の残し先 (予算に収めるために残さない時は空) */
+	TSharedPtr<FToonShadeBakeIntermediates, ESPMode::ThreadSafe> RetainedIntermediates;
+	TUniquePtr<FRHIGPUBufferReadback> TileBoundsReadback;
+
+	/** 0以下なら分けずに積み切る (AdvanceShadowThresholdMapで指定がなければこの数ずつ積む) */
+	int32 DispatchesPerSlice = 0;
+
+	/** 出力は書き込み済みで、計測とタイル毎のAABBの読み戻しを待っている */
+	bool bIsOutputWritten = false;
+
+	/** 前に積んだ分をGPUが終えたか (終えるまで続きは積まない) */
+	FGPUFenceRHIRef SliceFence;
+
+	/** 入力のキャプチャをSeedFlagsとPositionTextureへ写し終えたか (bAreInputsConsumedを立てるまで) */
+	FGPUFenceRHIRef InputFence;
+
+	/** 後から同じ出力へ焼き直されたら続きは捨てる */
+	TSharedPtr<FThreadSafeCounter, ESPMode::ThreadSafe> RefineGeneration;
+	int32 Generation = 0;
+
+	FEvent* Signal = nullptr;
+};
+
+
+/** 出力毎の焼き直しの世代 (ゲームスレッド専用) */
+static TMap<FObjectKey, TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe>>& GetRefineGenerationsMap()
+{
+	check(IsInGameThread());
+
+	static TMap<FObjectKey, TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe>> RefineGenerations;
+	return RefineGenerations;
+}
+
+
+/**
+ * 出力が破棄された分の世代を捨てる
+ * 出力が生きている間は、積んだままの焼きが古いかの判定に使うので残すこと。
+ */
+static void PruneRefineGenerations()
+{
+	for (auto It = GetRefineGenerationsMap().CreateIterator(); It; ++It)
+	{
+		if (It.Key().ResolveObjectPtr() == nullptr)
+		{
+			It.RemoveCurrent();
+		}
+	}
+}
+
+
+static TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe> GetRefineGeneration(const UTextureRenderTarget2D* OutShadowThresholdMapTexture)
+{
+	PruneRefineGenerations();
+
+	TMap<FObjectKey, TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe>>& RefineGenerations = GetRefineGenerationsMap();
+	if (TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe>* RefineGeneration = RefineGenerations.Find(FObjectKey(OutShadowThresholdMapTexture)))
+	{
+		return *RefineGeneration;
+	}
+	return RefineGenerations.Add(FObjectKey(OutShadowThresholdMapTexture), MakeShared<FThreadSafeCounter, ESPMode::ThreadSafe>());
+}
+
+
+/** 出力毎にbRetainIntermediatesで残した中間リソース (マップはゲームスレッド専用、中身は描画スレッド専用) */
+static TMap<FObjectKey, TSharedRef<FToonShadeBakeIntermediates, ESPMode::ThreadSafe>>& GetRetainedIntermediatesMap()
+{
+	check(IsInGameThread());
+
+	static TMap<FObjectKey, TSharedRef<FToonShadeBakeIntermediates, ESPMode::ThreadSafe>> RetainedIntermediates;
+	return RetainedIntermediates;
+}
+
+
+void ReleaseShadowThresholdMapIntermediates(const UTextureRenderTarget2D* OutShadowThresholdMapTexture)
+{
+	PruneRefineGenerations();
+
+	TMap<FObjectKey, TSharedRef<FToonShadeBakeIntermediates, ESPMode::ThreadSafe>>& RetainedIntermediatesMap = GetRetainedIntermediatesMap();
+
+	const TSharedRef<FToonShadeBakeIntermediates, ESPMode::ThreadSafe>* Found = RetainedIntermediatesMap.Find(FObjectKey(OutShadowThresholdMapTexture));
+	if (Found == nullptr)
+	{
+		return;
+	}
+
+	TSharedRef<FToonShadeBakeIntermediates, ESPMode::ThreadSafe> Intermediates = *Found;
+	RetainedIntermediatesMap.Remove(FObjectKey(OutShadowThresholdMapTexture));
+
+	// 描画スレッドが使用中なら、そちらの参照が切れた時に解放される
+	ENQUEUE_RENDER_COMMAND(ToonShadePaintBlueprintLibrary_ReleaseShadowThresholdMapIntermediates)(
+		[Intermediates](FRHICommandListImmediate& RHICmdList)
+	{
+		SetRetainedIntermediates(Intermediates.Get(), FToonShadeBakeIntermediates());
+	});
+}
+
+
+static void CopyShadowThresholdMap(FRHICommandListImmediate& RHICmdList, const FTextureRWBuffer& OutputShadowThresholdTexture, FRHITexture* DstTexture)
+{
+	FRHITexture* SrcTexture = OutputShadowThresholdTexture.Buffer;
+	RHICmdList.Transition(FRHITransitionInfo(SrcTexture, ERHIAccess::Unknown, ERHIAccess::CopySrc));
+	RHICmdList.Transition(FRHITransitionInfo(DstTexture, ERHIAccess::Unknown, ERHIAccess::CopyDest));
+	RHICmdList.CopyTexture(SrcTexture, DstTexture, {});
+
+	RHICmdList.ImmediateFlush(EImmediateFlushType::FlushRHIThreadFlushResources);
+}
+
+
+/** 積んでいる途中の焼きがあるか */
+static bool IsShadowThresholdMapTaskPending(const FToonShadeBakeTask& Task)
 {
-	SeedFlagsTexture.NumBytes = SizeX * SizeY * ArraySize * BytesPerElement;
+	return Task.State.IsValid() || Task.RegionState.IsValid();
+}
 
-	const FRHITextureCreateDesc Desc =
-		FRHITextureCreateDesc::Create2DArray(InDebugName, SizeX, SizeY, ArraySize, Format)
-		.SetFlags(Flags);
 
-	SeedFlagsTexture.Buffer = RHICreateTexture(Desc);
-	SeedFlagsTexture.UAV = RHICmdList.CreateUnorderedAccessView(SeedFlagsTexture.Buffer);
-	SeedFlagsTexture.SRV = RHICmdList.CreateShaderResourceView(SeedFlagsTexture.Buffer, 0);
+/** 焼きの途中で持ち越したものを解放する */
+static void ReleaseShadowThresholdMapTask(FToonShadeBakeTask& Task)
+{
+	Task.State.Reset();
+	Task.RegionState.Reset();
+	Task.bIsPreview = false;
+	Task.Intermediates = FToonShadeBakeIntermediates();
+	Task.OutputShadowThresholdTexture = FTextureRWBuffer();
+	Task.DstTexture.SafeRelease();
+	Task.RetainedIntermediates.Reset();
+	Task.TileBoundsReadback.Reset();
+	Task.bIsOutputWritten = false;
+	Task.SliceFence.SafeRelease();
+	Task.InputFence.SafeRelease();
 }
 
 
-void UToonShadePaintBlueprintLibrary::CreateShadowThresholdMap(
-	UObject* WorldContextObject,
-	TArray<UTextureRenderTarget2D*> InSeedTextures,
-	UTextureRenderTarget2D* InPositionTexture,
-	int32 MaxRadius,
-	UTextureRenderTarget2D* OutShadowThresholdMapTexture)
+/**
+ * 焼きを続きから積む
+ * ディスパッチ数がDispatchBudgetを超えたら伝搬の半径の区切りで止めます。
+ * @return 全レイヤーを積み終えた場合はtrueを返します。
+ */
+static bool StepShadowThresholdMapTask(FRHICommandListImmediate& RHICmdList, FToonShadeBakeTask& Task, int32 DispatchBudget, bool bWaitForReadbacks)
 {
-	const double StartTime = FPlatformTime::Seconds();
+	if (Task.RegionState)
+	{
+		return StepShadowThresholdMapRegion(RHICmdList, *Task.RegionState, DispatchBudget);
+	}
+	return StepShadowThresholdMap(RHICmdList, *Task.State, DispatchBudget, bWaitForReadbacks);
+}
 
-	FEvent* Signal = FGenericPlatformProcess::GetSynchEventFromPool(false);
 
-	ENQUEUE_RENDER_COMMAND(ToonShadePaintBlueprintLibrary_CreateShadowThresholdMap)(
-		[&InSeedTextures, &InPositionTexture, MaxRadius, &OutShadowThresholdMapTexture, &Signal](FRHICommandListImmediate& RHICmdList)
+static float GetShadowThresholdMapTaskProgress(const FToonShadeBakeTask& Task)
+{
+	return Task.RegionState ? GetShadowThresholdMapRegionProgress(*Task.RegionState) : GetShadowThresholdMapProgress(*Task.State);
+}
+
+
+/** 焼きの出力を書き込む (計測と読み戻しはResolveShadowThresholdMapで拾う) */
+static void FinishShadowThresholdMap(FRHICommandListImmediate& RHICmdList, FToonShadeBakeTask& Task)
+{
+	if (Task.RegionState)
+	{
+		// 残した中間リソースはその場で書き換え済み
+		EndShadowThresholdMapRegion(RHICmdList, *Task.RegionState);
+		CopyShadowThresholdMap(RHICmdList, Task.OutputShadowThresholdTexture, Task.DstTexture);
+	}
+	else if (Task.bIsPreview)
+	{
+		EndShadowThresholdMap(RHICmdList, *Task.State);
+
+		FTextureRWBuffer UpsampledShadowThresholdTexture;
+		UpsamplePreview(RHICmdList, Task.State->Inputs, Task.State->Inputs.SeedTextures[0], Task.OutputShadowThresholdTexture, UpsampledShadowThresholdTexture);
+		CopyShadowThresholdMap(RHICmdList, UpsampledShadowThresholdTexture, Task.DstTexture);
+	}
+	else
 	{
-		RHICmdList.ImmediateFlush(EImmediateFlushType::FlushRHIThreadFlushResources);
+		EndShadowThresholdMap(RHICmdList, *Task.State);
+		CopyShadowThresholdMap(RHICmdList, Task.OutputShadowThresholdTexture, Task.DstTexture);
 
-		if (!IsValid(OutShadowThresholdMapTexture))
+		if (Task.RetainedIntermediates)
 		{
-			UE_LOG(LogToonShadePaint, Warning, TEXT("Invalid 'OutShadowThresholdMapTexture'"));
-			Signal->Trigger();
-			return;  // 出力先が欲しい
+			SetRetainedIntermediates(*Task.RetainedIntermediates, Task.Intermediates);
 		}
+	}
+
+	Task.bIsOutputWritten = true;
+}
+
+
+/**
+ * 書き込んだ焼きの計測とタイル毎のAABBを拾って、持ち越したものを解放する
+ * bWaitがfalseならGPUが届いていない時は何もせずfalseを返すので、次の分で呼び直すこと。
+ */
+static bool ResolveShadowThresholdMap(FRHICommandListImmediate& RHICmdList, FToonShadeBakeTask& Task, FToonShadeBakeJob& Job, bool bWait)
+{
+	if (!bWait && Task.TileBoundsReadback && !Task.TileBoundsReadback->IsReady())
+	{
+		return false;
+	}
+
+	const FToonShadeStageTimer& StageTimer = Task.RegionState ? Task.RegionState->StageTimer : Task.State->StageTimer;
+	if (!StageTimer.Resolve(Job.Stats, bWait))
+	{
+		return false;
+	}
+
+	if (Task.TileBoundsReadback)
+	{
+		ReadbackPositionTileBounds(RHICmdList, *Task.TileBoundsReadback, Task.Intermediates.Resolution, Job.PositionTileBounds, Job.NumPositionTilesX);
+		Job.ResolvedMaxRadius = Task.Intermediates.ResolvedMaxRadius;
+	}
+
+	ReleaseShadowThresholdMapTask(Task);
+	return true;
+}
+
+
+/** ジョブを完了にして待っている呼び出し元へ知らせる */
+static void CompleteShadowThresholdMap(FToonShadeBakeJob& Job, FEvent* Signal)
+{
+	Job.Stats.WallMilliseconds = static_cast<float>((FPlatformTime::Seconds() - Job.StartTime) * 1000.0);
+	Job.Progress = 1.0f;
+	Job.bAreInputsConsumed = true;
+	Job.bIsCompleted = true;
+
+	if (Signal)
+	{
+		Signal->Trigger();
+	}
+}
+
+
+/** CreateShadowThresholdMapの描画スレッド側 入力を検証して焼く */
+static void ExecuteShadowThresholdMap(
+	FRHICommandListImmediate& RHICmdList,
+	const FToonShadeBakeRequest& Request,
+	FToonShadeBakeJob& Job,
+	FToonShadeBakeTask& Task)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(ExecuteShadowThresholdMap);
+	LLM_SCOPE_BYTAG(ToonShadePaint);
+
+	FToonShadeBakeIntermediates* RetainedIntermediates = Task.RetainedIntermediates.Get();
+
+	const TArray<UTextureRenderTarget2D*>& InSeedTextures = Request.SeedTextures;
+	UTextureRenderTarget2D* InPositionTexture = Request.PositionTexture;
+	const int32 MaxRadius = Request.MaxRadius;
+	UTextureRenderTarget2D* OutShadowThresholdMapTexture = Request.OutShadowThresholdMapTexture;
+	const FToonShadeBakeSettings& Settings = Request.Settings;
+	FToonShadeBakeStats& OutStats = Job.Stats;
+
+	RHICmdList.ImmediateFlush(EImmediateFlushType::FlushRHIThreadFlushResources);
+
+	if (!IsValid(OutShadowThresholdMapTexture))
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("Invalid 'OutShadowThresholdMapTexture'"));
+		return;  // 出力先が欲しい
+	}
+
+	if (!IsValid(InPositionTexture))
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("Invalid 'InPositionTexture'"));
+		return;  // モデル座標が欲しい
+	}
+
+	const int32 NumSeedTextures = Algo::CountIf(InSeedTextures, [](const UTextureRenderTarget2D* InSeedTexture) { return IsValid(InSeedTexture); });
+	if (NumSeedTextures < 2)
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("Requires at least two valid 'InSeedTextures'"));
+		return;  // 最低でも2枚は必要
+	}
+
+	// テクスチャ画像は先頭に合わせる
+	const int32 Resolution = (*Algo::FindByPredicate(InSeedTextures, [](const UTextureRenderTarget2D* InSeedTexture) { return IsValid(InSeedTexture); }))->SizeX;
 
-		if (!IsValid(InPositionTexture))
+	const int32 NumMismatchSeedTextures = Algo::CountIf(InSeedTextures, [Resolution](const UTextureRenderTarget2D* InSeedTexture)
+	{
+		if (IsValid(InSeedTexture) && InSeedTexture->SizeX != Resolution)
 		{
-			UE_LOG(LogToonShadePaint, Warning, TEXT("Invalid 'InPositionTexture'"));
-			Signal->Trigger();
-			return;  // モデル座標が欲しい
+			// RT作る時にName未指定だからログ出しても訳分からないけど、ないよりマシ
+			UE_LOG(LogToonShadePaint, Warning, TEXT("Texture size for '%s' is '%d', but requests '%d'"), *InSeedTexture->GetName(), InSeedTexture->SizeX, Resolution);
+			return true;
 		}
+		return false;
+	});
+	if (NumMismatchSeedTextures > 0)
+	{
+		return;  // SeedTexturesの解像度がバラバラ
+	}
+
+	if (InPositionTexture->SizeX != Resolution)
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("Texture size for '%s' is '%d', but requests '%d'"), *InPositionTexture->GetName(), InPositionTexture->SizeX, Resolution);
+		return;  // モデル座標の解像度が不一致
+	}
+
+	if (OutShadowThresholdMapTexture->SizeX != Resolution)
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("Texture size for '%s' is '%d', but requests '%d'"), *OutShadowThresholdMapTexture->GetName(), OutShadowThresholdMapTexture->SizeX, Resolution);
+		return;  // 出力の解像度が不一致
+	}
+
+	const EPixelFormat PixelFormat = OutShadowThresholdMapTexture->GetFormat();
+	switch (PixelFormat)
+	{
+	case EPixelFormat::PF_R8G8B8A8:
+	case EPixelFormat::PF_FloatRGBA:
+	case EPixelFormat::PF_A32B32G32R32F:
+	case EPixelFormat::PF_R8G8:
+	case EPixelFormat::PF_G16R16:
+	case EPixelFormat::PF_G16R16F:
+	case EPixelFormat::PF_G32R32F:
+		break;  // 書き込むのは.rgだけなので2チャンネルで十分
+	default:
+		UE_LOG(LogToonShadePaint, Warning, TEXT("'%s' only supports PF_R8G8B8A8, PF_FloatRGBA, PF_A32B32G32R32F, PF_R8G8, PF_G16R16, PF_G16R16F, PF_G32R32F formats."), *OutShadowThresholdMapTexture->GetName());
+		return;  // 出力の解像度が不一致
+	}
 
-		const int32 NumSeedTextures = Algo::CountIf(InSeedTextures, [](const UTextureRenderTarget2D* InSeedTexture) { return IsValid(InSeedTexture); });
-		if (NumSeedTextures < 2)
+	FToonShadeBakeInputs Inputs;
+	for (UTextureRenderTarget2D* SeedTexture : InSeedTextures)
+	{
+		if (IsValid(SeedTexture))
 		{
-			UE_LOG(LogToonShadePaint, Warning, TEXT("Requires at least two valid 'InSeedTextures'"));
-			Signal->Trigger();
-			return;  // 最低でも2枚は必要
+			Inputs.SeedTextures.Add(SeedTexture->GetResource()->TextureRHI);
 		}
+	}
+	Inputs.PositionTexture = InPositionTexture->GetResource()->TextureRHI;
+	Inputs.Resolution = Resolution;
+	Inputs.MaxRadius = MaxRadius;
+	Inputs.PixelFormat = PixelFormat;
+	Inputs.Settings = Settings;
 
-		const int32 NumGradients = NumSeedTextures - 1;
-		const float InvNumGradients = 1.0f / NumGradients;
+	FRHITexture* DstTexture = OutShadowThresholdMapTexture->GetResource()->TextureRHI;
 
-		// テクスチャ画像は先頭に合わせる
-		const int32 Resolution = (*Algo::FindByPredicate(InSeedTextures, [](const UTextureRenderTarget2D* InSeedTexture) { return IsValid(InSeedTexture); }))->SizeX;
+	const int32 PreviewResolution = GetPreviewResolution(Resolution);
+	if (Settings.bProgressivePreview && PreviewResolution < Resolution)
+	{
+		FToonShadeBakeInputs PreviewInputs = Inputs;
+		PreviewInputs.Resolution = PreviewResolution;
+		PreviewInputs.SampleScale = Resolution / PreviewResolution;
+		PreviewInputs.MaxRadius = FMath::DivideAndRoundUp(MaxRadius, PreviewInputs.SampleScale);  // 半径はテクセル単位なので縮小に合わせる
 
-		const int32 NumMismatchSeedTextures = Algo::CountIf(InSeedTextures, [Resolution](const UTextureRenderTarget2D* InSeedTexture)
+		if (!FitBakeToMemoryBudget(PreviewInputs))
 		{
-			if (IsValid(InSeedTexture) && InSeedTexture->SizeX != Resolution)
-			{
-				// RT作る時にName未指定だからログ出しても訳分からないけど、ないよりマシ
-				UE_LOG(LogToonShadePaint, Warning, TEXT("Texture size for '%s' is '%d', but requests '%d'"), *InSeedTexture->GetName(), InSeedTexture->SizeX, Resolution);
-				return true;
-			}
-			return false;
-		});
-		if (NumMismatchSeedTextures > 0)
+			return;  // 縮小しても予算に収まらない
+		}
+
+		// 本焼きはEnqueueShadowThresholdMapが別のジョブとして分けて積む
+		Job.bIsPreview = true;
+
+		if (RetainedIntermediates)
 		{
-			Signal->Trigger();
-			return;  // SeedTexturesの解像度がバラバラ
+			SetRetainedIntermediates(*RetainedIntermediates, FToonShadeBakeIntermediates());  // Seedが変わったので使い回せない
+			Task.RetainedIntermediates.Reset();
 		}
 
-		if (InPositionTexture->SizeX != Resolution)
+		Task.DstTexture = DstTexture;
+		Task.bIsPreview = true;
+		Task.State = MakeUnique<FToonShadeBakeState>();
+		BeginShadowThresholdMap(RHICmdList, PreviewInputs, Task.Intermediates, Task.OutputShadowThresholdTexture, OutStats, *Task.State);
+	}
+	else if (RetainedIntermediates && CanBakeShadowThresholdMapRegion(Inputs, *RetainedIntermediates, Request.DirtyRect))
+	{
+		Job.bIsPartial = true;
+
+		Task.DstTexture = DstTexture;
+		Task.RegionState = MakeUnique<FToonShadeRegionBakeState>();
+		BeginShadowThresholdMapRegion(RHICmdList, Inputs, Request.DirtyRect, *RetainedIntermediates, Task.OutputShadowThresholdTexture, OutStats, *Task.RegionState);
+	}
+	else
+	{
+		Inputs.bKeepAllLayers = RetainedIntermediates != nullptr;
+
+		if (!FitBakeToMemoryBudget(Inputs))
 		{
-			UE_LOG(LogToonShadePaint, Warning, TEXT("Texture size for '%s' is '%d', but requests '%d'"), *InPositionTexture->GetName(), InPositionTexture->SizeX, Resolution);
-			Signal->Trigger();
-			return;  // モデル座標の解像度が不一致
+			return;  // 予算に収まらない
 		}
 
-		if (OutShadowThresholdMapTexture->SizeX != Resolution)
+		// 予算に収めるために全レイヤーを残さない時は、次も部分的には焼き直せない
+		if (RetainedIntermediates && !Inputs.bKeepAllLayers)
 		{
-			UE_LOG(LogToonShadePaint, Warning, TEXT("Texture size for '%s' is '%d', but requests '%d'"), *OutShadowThresholdMapTexture->GetName(), OutShadowThresholdMapTexture->SizeX, Resolution);
-			Signal->Trigger();
-			return;  // 出力の解像度が不一致
+			SetRetainedIntermediates(*RetainedIntermediates, FToonShadeBakeIntermediates());
+			Task.RetainedIntermediates.Reset();
 		}
 
-		const EPixelFormat PixelFormat = OutShadowThresholdMapTexture->GetFormat();
-		switch (PixelFormat)
+		// 焼きの前に積んでおけば、焼き終わる頃には読み戻せる
+		if (Task.RetainedIntermediates)
 		{
-		case EPixelFormat::PF_R8G8B8A8:
-		case EPixelFormat::PF_FloatRGBA:
-		case EPixelFormat::PF_A32B32G32R32F:
-			break;
-		default:
-			UE_LOG(LogToonShadePaint, Warning, TEXT("'%s' only supports PF_R8G8B8A8, PF_FloatRGBA, PF_A32B32G32R32F formats."), *OutShadowThresholdMapTexture->GetName());
-			Signal->Trigger();
-			return;  // 出力の解像度が不一致
+			Task.TileBoundsReadback = MakeUnique<FRHIGPUBufferReadback>(TEXT("ToonShadePaint.TileBoundsReadback"));
+			EnqueuePositionTileBounds(RHICmdList, Inputs, *Task.TileBoundsReadback);
 		}
 
-		const FIntPoint TextureSize(Resolution, Resolution);
+		Task.DstTexture = DstTexture;
+		Task.State = MakeUnique<FToonShadeBakeState>();
+		BeginShadowThresholdMap(RHICmdList, Inputs, Task.Intermediates, Task.OutputShadowThresholdTexture, OutStats, *Task.State);
+	}
+
+	// 分ける時は続きをAdvanceShadowThresholdMapで積む
+	if (Task.DispatchesPerSlice <= 0)
+	{
+		StepShadowThresholdMapTask(RHICmdList, Task, MAX_int32, true);
+		FinishShadowThresholdMap(RHICmdList, Task);
+		ResolveShadowThresholdMap(RHICmdList, Task, Job, true);
+	}
+	else if (!Task.bIsPreview)  // プレビューは拡大でSeedのキャプチャを読み直すので、終わるまで重ねない
+	{
+		// 以降はキャプチャを読まないので、GPUがここを越えたら次の焼きのキャプチャと重ねられる
+		Task.InputFence = RHICreateGPUFence(TEXT("ToonShadePaint.InputFence"));
+		RHICmdList.WriteGPUFence(Task.InputFence);
+	}
+}
 
-		const uint32 ThreadGroupCountX = Resolution / 32;
-		const uint32 ThreadGroupCountY = Resolution / 32;
-		const uint32 ThreadGroupCountZ = 1;
 
-		const ETextureCreateFlags TextureCreateFlags(TexCreate_ShaderResource | TexCreate_UAV);
+/** ExecuteShadowThresholdMapが縮小プレビューを焼くか (入力が揃っていなければ焼かずに終わるので、本焼きもすぐ終わる) */
+static bool WillBakePreview(const FToonShadeBakeRequest& Request)
+{
+	if (!Request.Settings.bProgressivePreview || !IsValid(Request.OutShadowThresholdMapTexture))
+	{
+		return false;
+	}
 
-		FTextureRWBuffer SeedFlagsTexture;
-		Initialize2DArray(RHICmdList, SeedFlagsTexture, TEXT("ToonShadePaint.SeedFlagsTexture"), GPixelFormats[PF_R8_UINT].BlockBytes, Resolution, Resolution, NumSeedTextures, PF_R8_UINT, TextureCreateFlags);
+	const int32 Resolution = Request.OutShadowThresholdMapTexture->SizeX;
+	return GetPreviewResolution(Resolution) < Resolution;
+}
 
-		FTextureRWBuffer PositionTexture;
-		PositionTexture.Initialize2D(TEXT("ToonShadePaint.PositionTexture"), GPixelFormats[PF_A32B32G32R32F].BlockBytes, Resolution, Resolution, PF_A32B32G32R32F, TextureCreateFlags);
 
-		FTextureRWBuffer SDFInnerTexture;
-		SDFInnerTexture.Initialize2D(TEXT("ToonShadePaint.SDFInnerTexture"), GPixelFormats[PF_FloatRGBA].BlockBytes, Resolution, Resolution, PF_FloatRGBA, TextureCreateFlags);
+/** ジョブを作って積む (Generationより後に同じ出力へ焼き直されたら、積んだままの続きは捨てる) */
+static TSharedRef<FToonShadeBakeJob, ESPMode::ThreadSafe> EnqueueShadowThresholdMapJob(const FToonShadeBakeRequest& Request, const TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe>& RefineGeneration, int32 Generation)
+{
+	TSharedRef<FToonShadeBakeJob, ESPMode::ThreadSafe> Job = MakeShared<FToonShadeBakeJob, ESPMode::ThreadSafe>();
+	Job->StartTime = FPlatformTime::Seconds();
+
+	TSharedRef<FToonShadeBakeTask, ESPMode::ThreadSafe> Task = MakeShared<FToonShadeBakeTask, ESPMode::ThreadSafe>();
+	Task->DispatchesPerSlice = Request.bTimeSliced ? FMath::Max(CVarToonShadePaintDispatchesPerSlice.GetValueOnGameThread(), 0) : 0;
+	Task->RefineGeneration = RefineGeneration;
+	Task->Generation = Generation;
+	Task->Signal = Request.Signal;
+	Job->Task = Task;
+
+	// 残さない焼きが挟まると、残した中間リソースは出力と食い違う
+	if (Request.bRetainIntermediates)
+	{
+		TMap<FObjectKey, TSharedRef<FToonShadeBakeIntermediates, ESPMode::ThreadSafe>>& RetainedIntermediatesMap = GetRetainedIntermediatesMap();
+		if (TSharedRef<FToonShadeBakeIntermediates, ESPMode::ThreadSafe>* Intermediates = RetainedIntermediatesMap.Find(FObjectKey(Request.OutShadowThresholdMapTexture)))
+		{
+			Task->RetainedIntermediates = *Intermediates;
+		}
+		else
+		{
+			Task->RetainedIntermediates = RetainedIntermediatesMap.Add(FObjectKey(Request.OutShadowThresholdMapTexture), MakeShared<FToonShadeBakeIntermediates, ESPMode::ThreadSafe>());
+		}
+	}
+	else
+	{
+		ReleaseShadowThresholdMapIntermediates(Request.OutShadowThresholdMapTexture);
+	}
 
-		FTextureRWBuffer SDFOuterTexture;
-		SDFOuterTexture.Initialize2D(TEXT("ToonShadePaint.SDFOuterTexture"), GPixelFormats[PF_FloatRGBA].BlockBytes, Resolution, Resolution, PF_FloatRGBA, TextureCreateFlags);
+	ENQUEUE_RENDER_COMMAND(ToonShadePaintBlueprintLibrary_CreateShadowThresholdMap)(
+		[Request, Job, Task](FRHICommandListImmediate& RHICmdList)
+	{
+		ExecuteShadowThresholdMap(RHICmdList, Request, *Job, *Task);
 
-		FRWByteAddressBuffer MaxDistanceBuffer;
-		MaxDistanceBuffer.Initialize(RHICmdList, TEXT("ToonShadePaint.MaxDistanceBuffer"), sizeof(int32) * 1, BUF_ShaderResource | BUF_UnorderedAccess);
+		if (IsShadowThresholdMapTaskPending(*Task))
+		{
+			return;  // 続きはAdvanceShadowThresholdMapで積む
+		}
 
-		FTextureRWBuffer SDFNormalizedTexture;
-		Initialize2DArray(RHICmdList, SDFNormalizedTexture, TEXT("ToonShadePaint.SDFNormalizedTexture"), GPixelFormats[PF_R32_FLOAT].BlockBytes, Resolution, Resolution, NumSeedTextures, PF_R32_FLOAT, TextureCreateFlags);
+		ReleaseShadowThresholdMapTask(*Task);  // ジョブはゲームスレッドで破棄されるので、ここで参照を切る
+		CompleteShadowThresholdMap(*Job, Request.Signal);
+	});
 
-		FTextureRWBuffer ShadowThresholdTexture;
-		ShadowThresholdTexture.Initialize2D(TEXT("SDF.ShadowThresholdTexture"), GPixelFormats[PF_A32B32G32R32F].BlockBytes, Resolution, Resolution, PF_A32B32G32R32F, TextureCreateFlags);
+	// プレビューを焼く時は、本焼きを分けて積む別のジョブとして後ろに積む
+	// (世代はプレビューと同じなので、後から焼き直しが来ればプレビューも本焼きも捨てられる)
+	if (Request.bAutoRefine && WillBakePreview(Request))
+	{
+		FToonShadeBakeRequest RefineRequest = Request;
+		RefineRequest.Settings.bProgressivePreview = false;
+		RefineRequest.Signal = nullptr;
+		RefineRequest.bTimeSliced = true;
 
-		FTextureRWBuffer OutputShadowThresholdTexture;
-		OutputShadowThresholdTexture.Initialize2D(TEXT("SDF.OutputShadowThresholdTexture"), GPixelFormats[PixelFormat].BlockBytes, Resolution, Resolution, PixelFormat, TextureCreateFlags);
+		TSharedRef<FToonShadeBakeJob, ESPMode::ThreadSafe> RefineJob = EnqueueShadowThresholdMapJob(RefineRequest, RefineGeneration, Generation);
+		Job->RefineJob = RefineJob;
 
-		// いつかAsnycしたいからPositionTextureとPositionTextureの寿命を切り離し
+		// 呼び出し元は待たないので、続きはコアのティッカーで1フレームに1回分ずつ積む
+		FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([RefineJob](float DeltaTime)
 		{
-			RHICmdList.Transition(FRHITransitionInfo(SeedFlagsTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
-			RHICmdList.Transition(FRHITransitionInfo(PositionTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
-
-			int32 LayerIndex = 0;
-			for (UTextureRenderTarget2D* SeedTexture : InSeedTextures)
+			if (!RefineJob->bIsCompleted)
 			{
-				if (IsValid(SeedTexture))
-				{
-					TShaderMapRef<FSetupSeedFlagsCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
-					SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
-					SetShaderParametersLegacyCS(
-						RHICmdList,
-						ComputeShader,
-						LayerIndex++,
-						SeedTexture->GetResource()->TextureRHI,
-						SeedFlagsTexture.UAV);
-					DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCountX, ThreadGroupCountY, ThreadGroupCountZ);
-					UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
-				}
+				AdvanceShadowThresholdMap(RefineJob);
+				return true;
 			}
 
-			{
-				TShaderMapRef<FSetupPosCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
-				SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
-				SetShaderParametersLegacyCS(
-					RHICmdList,
-					ComputeShader,
-					InPositionTexture->GetResource()->TextureRHI,
-					PositionTexture.UAV);
-				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCountX, ThreadGroupCountY, ThreadGroupCountZ);
-				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
-			}
+			const FToonShadeBakeStats& RefineStats = RefineJob->Stats;
+			UE_LOG(LogToonShadePaint, Display, TEXT("CreateShadowThresholdMap: Refined (GPU: %.3fms, Dispatches: %d, Iterations: %d)%s"),
+				RefineStats.GPUMilliseconds, RefineStats.NumDispatches, RefineStats.NumIterations, RefineStats.bCancelled ? TEXT(" [Cancelled]") : TEXT(""));
+			return false;
+		}));
+	}
 
-			RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);  // DX12はAsyncComputeなので都度叩いて安牌
+	return Job;
+}
 
-			RHICmdList.Transition(FRHITransitionInfo(SeedFlagsTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
-			RHICmdList.Transition(FRHITransitionInfo(PositionTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
 
-			// 理想はここで終わらせて裏で頑張ってもらう
-			// Signal->Trigger();
-		}
+TSharedRef<FToonShadeBakeJob, ESPMode::ThreadSafe> EnqueueShadowThresholdMap(const FToonShadeBakeRequest& Request)
+{
+	// 同じ出力へ焼き直したら、積んだままの続きは古いので捨てる
+	TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe> RefineGeneration = GetRefineGeneration(Request.OutShadowThresholdMapTexture);
+	const int32 Generation = RefineGeneration->Increment();
 
-		RHICmdList.Transition(FRHITransitionInfo(SDFNormalizedTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+	return EnqueueShadowThresholdMapJob(Request, RefineGeneration, Generation);
+}
 
-		for (int32 Index = 0; Index < NumSeedTextures; ++Index)
-		{
-			RHICmdList.Transition(FRHITransitionInfo(SDFInnerTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
-			RHICmdList.Transition(FRHITransitionInfo(SDFOuterTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
 
-			{
-				TShaderMapRef<FDistanceMapSetupCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
-				SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
-				SetShaderParametersLegacyCS(
-					RHICmdList,
-					ComputeShader,
-					Index,
-					SeedFlagsTexture.SRV,
-					SDFInnerTexture.UAV,
-					SDFOuterTexture.UAV);
-				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCountX, ThreadGroupCountY, ThreadGroupCountZ);
-				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+void AdvanceShadowThresholdMap(const TSharedRef<FToonShadeBakeJob, ESPMode::ThreadSafe>& Job, int32 DispatchesPerSlice)
+{
+	check(IsInGameThread());
 
-				RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
-			}
+	if (Job->bIsCompleted || Job->bIsSliceQueued)
+	{
+		return;  // 描画スレッドに続きを溜めない
+	}
 
-			for (int32 Radius = 1; Radius <= MaxRadius; ++Radius)
-			{
-				FDistanceMapIterCS::FPermutationDomain PermutationVector;
-				PermutationVector.Set<FDistanceMapIterCS::FFlip>(Radius % 2 == 0);
-				TShaderMapRef<FDistanceMapIterCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
-				SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
-				SetShaderParametersLegacyCS(
-					RHICmdList,
-					ComputeShader,
-					Index,
-					TextureSize,
-					Radius,
-					SeedFlagsTexture.SRV,
-					PositionTexture.SRV,
-					SDFInnerTexture.UAV,
-					SDFOuterTexture.UAV);
-				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCountX, ThreadGroupCountY, ThreadGroupCountZ);
-				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+	Job->bIsSliceQueued = true;
 
-				RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
-			}
+	ENQUEUE_RENDER_COMMAND(ToonShadePaintBlueprintLibrary_AdvanceShadowThresholdMap)(
+		[Job, DispatchesPerSlice](FRHICommandListImmediate& RHICmdList)
+	{
+		TRACE_CPUPROFILER_EVENT_SCOPE(ToonShadePaintBlueprintLibrary_AdvanceShadowThresholdMap);
+		LLM_SCOPE_BYTAG(ToonShadePaint);
 
-			RHICmdList.Transition(FRHITransitionInfo(SDFInnerTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
-			RHICmdList.Transition(FRHITransitionInfo(SDFOuterTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+		Job->bIsSliceQueued = false;
 
-			RHICmdList.Transition(FRHITransitionInfo(MaxDistanceBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+		FToonShadeBakeTask& Task = *Job->Task;
+		if (!IsShadowThresholdMapTaskPending(Task))
+		{
+			return;  // 分けずに積み切ったか、最初の分がまだ
+		}
 
+		// 出力は書き込み済みなので、取り消しは受け付けずに計測が届くのを待つ
+		if (Task.bIsOutputWritten)
+		{
+			if (ResolveShadowThresholdMap(RHICmdList, Task, *Job, false))
 			{
-				RHICmdList.ClearUAVUint(MaxDistanceBuffer.UAV, FUintVector4(0, 0, 0, 0));
-				RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+				CompleteShadowThresholdMap(*Job, Task.Signal);
 			}
+			return;
+		}
 
+		// 取り消したか後から焼き直されたら、出力は書き換えずに捨てる
+		if (Job->bIsCancelRequested || Task.RefineGeneration->GetValue() != Task.Generation)
+		{
+			// DirtyRectの焼き直しは残した中間リソースを書き換えている途中なので、次は全体を焼かせる
+			if (Task.RegionState && Task.RetainedIntermediates)
 			{
-				FSDFCalcCS::FPermutationDomain PermutationVector;
-				PermutationVector.Set<FSDFCalcCS::FFlip>(MaxRadius % 2 == 0);
-				TShaderMapRef<FSDFCalcCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
-				SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
-				SetShaderParametersLegacyCS(
-					RHICmdList,
-					ComputeShader,
-					Index,
-					TextureSize,
-					SeedFlagsTexture.SRV,
-					PositionTexture.SRV,
-					SDFInnerTexture.SRV,
-					SDFOuterTexture.SRV,
-					SDFNormalizedTexture.UAV,
-					MaxDistanceBuffer.UAV);
-				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCountX, ThreadGroupCountY, ThreadGroupCountZ);
-				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
-
-				RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+				SetRetainedIntermediates(*Task.RetainedIntermediates, FToonShadeBakeIntermediates());
 			}
 
-			RHICmdList.Transition(FRHITransitionInfo(MaxDistanceBuffer.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
-
-			{
-				TShaderMapRef<FSDFNormalizedCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
-				SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
-				SetShaderParametersLegacyCS(
-					RHICmdList,
-					ComputeShader,
-					Index,
-					MaxDistanceBuffer.SRV,  // Readback面倒だからSRV
-					SDFNormalizedTexture.UAV);
-				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCountX, ThreadGroupCountY, ThreadGroupCountZ);
-				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+			ReleaseShadowThresholdMapTask(Task);
+			Job->Stats.bCancelled = true;
 
-				RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
-			}
+			CompleteShadowThresholdMap(*Job, Task.Signal);
+			return;
 		}
 
-		RHICmdList.Transition(FRHITransitionInfo(SDFNormalizedTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
-
-		RHICmdList.Transition(FRHITransitionInfo(ShadowThresholdTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+		if (Task.InputFence.IsValid() && Task.InputFence->Poll())
+		{
+			Task.InputFence.SafeRelease();
+			Job->bAreInputsConsumed = true;
+		}
 
+		// GPUが前の分を終えるまで積まない (溜めるとGPUが応答しなくなる)
+		if (Task.SliceFence.IsValid() && !Task.SliceFence->Poll())
 		{
-			RHICmdList.ClearUAVFloat(ShadowThresholdTexture.UAV, FVector4f(0.0f, 0.0f, 0.0f, 0.0f));
-			RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+			return;
 		}
 
-		for (int32 Index = 0; Index < NumSeedTextures - 1; ++Index)
+		const bool bIsFinished = StepShadowThresholdMapTask(RHICmdList, Task, DispatchesPerSlice > 0 ? DispatchesPerSlice : Task.DispatchesPerSlice, false);
+		Job->Progress = GetShadowThresholdMapTaskProgress(Task);
+
+		if (bIsFinished)
 		{
-			float Start = InvNumGradients * Index;
-			float End = InvNumGradients * (Index + 1);
+			// 計測のクエリは待たずに、届いていなければ次の分で拾う
+			FinishShadowThresholdMap(RHICmdList, Task);
+			if (ResolveShadowThresholdMap(RHICmdList, Task, *Job, false))
 			{
-				FSDFBlendCS::FPermutationDomain PermutationVector;
-				PermutationVector.Set<FSDFBlendCS::FFlip>(Index % 2 == 0);
-				TShaderMapRef<FSDFBlendCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
-				SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
-				SetShaderParametersLegacyCS(
-					RHICmdList,
-					ComputeShader,
-					Start,
-					End,
-					Index,
-					SeedFlagsTexture.SRV,
-					SDFNormalizedTexture.SRV,
-					ShadowThresholdTexture.UAV);
-				DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCountX, ThreadGroupCountY, ThreadGroupCountZ);
-				UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
-
-				RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+				CompleteShadowThresholdMap(*Job, Task.Signal);
 			}
+			return;
 		}
 
-		RHICmdList.Transition(FRHITransitionInfo(ShadowThresholdTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+		if (Task.SliceFence.IsValid())
+		{
+			Task.SliceFence->Clear();
+		}
+		else
+		{
+			Task.SliceFence = RHICreateGPUFence(TEXT("ToonShadePaint.SliceFence"));
+		}
 
-		RHICmdList.Transition(FRHITransitionInfo(OutputShadowThresholdTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+		RHICmdList.WriteGPUFence(Task.SliceFence);
+		RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+	});
+}
 
-		{
-			FShadowThresholdCS::FPermutationDomain PermutationVector;
-			PermutationVector.Set<FShadowThresholdCS::FFlip>(NumSeedTextures % 2 == 0);
-			TShaderMapRef<FShadowThresholdCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
-			SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
-			SetShaderParametersLegacyCS(
-				RHICmdList,
-				ComputeShader,
-				SeedFlagsTexture.SRV,
-				ShadowThresholdTexture.SRV,
-				OutputShadowThresholdTexture.UAV);
-			DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), ThreadGroupCountX, ThreadGroupCountY, ThreadGroupCountZ);
-			UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
 
-			RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
-		}
+#define LOCTEXT_NAMESPACE "ToonShadePaintBlueprintLibrary"
 
-		RHICmdList.Transition(FRHITransitionInfo(OutputShadowThresholdTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVMask));
+void UToonShadePaintBlueprintLibrary::CreateShadowThresholdMap(
+	UObject* WorldContextObject,
+	TArray<UTextureRenderTarget2D*> InSeedTextures,
+	UTextureRenderTarget2D* InPositionTexture,
+	int32 MaxRadius,
+	UTextureRenderTarget2D* OutShadowThresholdMapTexture,
+	const FToonShadeBakeSettings& Settings,
+	FToonShadeBakeStats& OutStats)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(UToonShadePaintBlueprintLibrary::CreateShadowThresholdMap);
+	CSV_SCOPED_TIMING_STAT(ToonShadePaint, CreateShadowThresholdMap);
+
+	FEvent* Signal = FGenericPlatformProcess::GetSynchEventFromPool(false);
+
+	FToonShadeBakeRequest Request;
+	Request.SeedTextures = InSeedTextures;
+	Request.PositionTexture = InPositionTexture;
+	Request.MaxRadius = MaxRadius;
+	Request.OutShadowThresholdMapTexture = OutShadowThresholdMapTexture;
+	Request.Settings = Settings;
+	Request.Signal = Signal;
+	Request.bTimeSliced = true;
+
+	TSharedRef<FToonShadeBakeJob, ESPMode::ThreadSafe> Job = EnqueueShadowThresholdMap(Request);
+
+	// 次の分を積みに戻る間隔 (ミリ秒) 短いほど分の間にGPUが遊ばないが、ゲームスレッドが空回りする
+	static constexpr uint32 kPollMilliseconds = 4;
 
+	// 分けて積む間もゲームスレッドを回して進捗を出し、取り消しを受け付ける
+	// AsyncにするとOutShadowThresholdMapTextureの書き込み面倒だから終わるまで待つが、
+	// 描画キューを丸ごと流すと後ろに積んだ本焼きまで待たされるので、このジョブのSignalだけを待つ
+	{
+		FScopedSlowTask SlowTask(1.0f, LOCTEXT("CreateShadowThresholdMap", "Baking shadow threshold map..."));
+		SlowTask.MakeDialogDelayed(0.5f, true);
+
+		float ReportedProgress = 0.0f;
+		for (bool bIsSignaled = false; !bIsSignaled;)
 		{
-			FRHITexture* SrcTexture = OutputShadowThresholdTexture.Buffer;
-			FRHITexture* DstTexture = OutShadowThresholdMapTexture->GetResource()->TextureRHI;
-			RHICmdList.Transition(FRHITransitionInfo(SrcTexture, ERHIAccess::Unknown, ERHIAccess::CopySrc));
-			RHICmdList.Transition(FRHITransitionInfo(DstTexture, ERHIAccess::Unknown, ERHIAccess::CopyDest));
-			RHICmdList.CopyTexture(SrcTexture, DstTexture, {});
+			if (SlowTask.ShouldCancel())
+			{
+				Job->bIsCancelRequested = true;
+			}
 
-			RHICmdList.ImmediateFlush(EImmediateFlushType::FlushRHIThreadFlushResources);
-		}
+			AdvanceShadowThresholdMap(Job);
+			bIsSignaled = Signal->Wait(kPollMilliseconds);
 
-		Signal->Trigger();
-	});
+			const float Progress = Job->Progress;
+			SlowTask.EnterProgressFrame(Progress - ReportedProgress);
+			ReportedProgress = Progress;
+		}
+	}
 
-	// AsyncにするとOutShadowThresholdMapTextureの書き込み面倒だから終わるまで待つ
-	Signal->Wait();
 	FGenericPlatformProcess::ReturnSynchEventToPool(Signal);
 
-	const double EndTime = FPlatformTime::Seconds();
-	const double ElapsedTime = EndTime - StartTime;
+	OutStats = Job->Stats;
+
+	const double ElapsedTime = OutStats.WallMilliseconds / 1000.0;
 
-	UE_LOG(LogToonShadePaint, Display, TEXT("CreateShadowThresholdMap: %f"), ElapsedTime);
+	CSV_CUSTOM_STAT(ToonShadePaint, WallMilliseconds, OutStats.WallMilliseconds, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(ToonShadePaint, GPUMilliseconds, OutStats.GPUMilliseconds, ECsvCustomStatOp::Set);
+
+	UE_LOG(LogToonShadePaint, Display, TEXT("CreateShadowThresholdMap: %f (GPU: %.3fms, Dispatches: %d, Iterations: %d, Allocated: %.1fMB)%s"),
+		ElapsedTime, OutStats.GPUMilliseconds, OutStats.NumDispatches, OutStats.NumIterations, OutStats.AllocatedBytes / (1024.0 * 1024.0), OutStats.bCancelled ? TEXT(" [Cancelled]") : Job->bIsPreview ? TEXT(" [Preview]") : TEXT(""));
 }
 
 void UToonShadePaintBlueprintLibrary::LayerSort(TArray<AToonShadeCaptureTargetActor*>& InValues)
@@ -787,3 +3953,5 @@ void UToonShadePaintBlueprintLibrary::LayerSort(TArray<AToonShadeCaptureTargetAc
 		return A.Layer < B.Layer;
 	});
 }
+
+#undef LOCTEXT_NAMESPACE
@@ -0,0 +1,430 @@
+// Copyright © 2024-2025 kafues511 All Rights Reserved.
+
+#include "ToonShadePaintBlueprintLibrary.h"
+#include "Engine/Texture2D.h"
+#include "Engine/TextureRenderTarget2D.h"
+#include "Containers/Ticker.h"
+#include "HAL/ThreadSafeBool.h"
+#include "DataDrivenShaderPlatformInfo.h"
+#include "GlobalShader.h"
+#include "ShaderParameterUtils.h"
+#include "RHIGPUReadback.h"
+#include "UObject/Package.h"
+#include "Misc/PackageName.h"
+#include "AssetRegistry/AssetRegistryModule.h"
+
+
+class FShadowThresholdMipCS : public FGlobalShader
+{
+	DECLARE_SHADER_TYPE(FShadowThresholdMipCS, Global);
+
+public:
+	FShadowThresholdMipCS() = default;
+	explicit FShadowThresholdMipCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer)
+	{
+		SourceSize.Bind(Initializer.ParameterMap, TEXT("SourceSize"));
+		DestSize.Bind(Initializer.ParameterMap, TEXT("DestSize"));
+		bSourceHasValidity.Bind(Initializer.ParameterMap, TEXT("bSourceHasValidity"));
+		SourceTexture.Bind(Initializer.ParameterMap, TEXT("SourceTexture"));
+		RWDestTexture.Bind(Initializer.ParameterMap, TEXT("RWDestTexture"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsPCPlatform(Parameters.Platform) && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM6);
+	}
+
+	void SetParameters(
+		FRHIBatchedShaderParameters& BatchedParameters,
+		FIntPoint InSourceSize,
+		FIntPoint InDestSize,
+		bool bInSourceHasValidity,
+		FRHITexture* InSourceTexture,
+		FRHIUnorderedAccessView* InRWDestTexture)
+	{
+		SetShaderValue(BatchedParameters, SourceSize, InSourceSize);
+		SetShaderValue(BatchedParameters, DestSize, InDestSize);
+		SetShaderValue(BatchedParameters, bSourceHasValidity, bInSourceHasValidity ? 1u : 0u);
+		SetTextureParameter(BatchedParameters, SourceTexture, InSourceTexture);
+		SetUAVParameter(BatchedParameters, RWDestTexture, InRWDestTexture);
+	}
+
+	void UnsetParameters(FRHIBatchedShaderUnbinds& BatchedUnbinds)
+	{
+		UnsetUAVParameter(BatchedUnbinds, RWDestTexture);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderParameter, SourceSize);
+	LAYOUT_FIELD(FShaderParameter, DestSize);
+	LAYOUT_FIELD(FShaderParameter, bSourceHasValidity);
+	LAYOUT_FIELD(FShaderResourceParameter, SourceTexture);
+	LAYOUT_FIELD(FShaderResourceParameter, RWDestTexture);
+};
+
+
+IMPLEMENT_SHADER_TYPE(, FShadowThresholdMipCS, TEXT("/Plugin/ToonShadePaint/Private/ShadowThresholdMip.usf"), TEXT("MainCS"), SF_Compute);
+
+
+/** ミップ1段分の読み戻し */
+struct FToonShadeExportMip
+{
+	TUniquePtr<FRHIGPUTextureReadback> Readback;
+
+	FIntPoint Size = FIntPoint::ZeroValue;
+	EPixelFormat Format = PF_Unknown;
+};
+
+
+/**
+ * 読み戻し1回分の状態
+ * 描画スレッドでPixelsを埋めてbIsReadyを立て、ゲームスレッドがアセットを作る。
+ */
+struct FToonShadeExportRequest
+{
+	/** [0]は出力そのもの、[1..]はFShadowThresholdMipCSで縮小したもの */
+	TArray<FToonShadeExportMip> Mips;
+
+	FString PackagePath;
+	FString AssetName;
+	EToonShadeTextureCompression Compression = EToonShadeTextureCompression::BC5;
+	FOnToonShadeExportCompleted OnCompleted;
+
+	/** 閾値(.rg)を展開したもの (全ミップを順に連結) */
+	TArray<FFloat16Color> Pixels;
+
+	/** .gが.rと異なるテクセルがあった (BC4では捨てられる) */
+	bool bHasSecondChannel = false;
+
+	FThreadSafeBool bIsPolling = false;
+	FThreadSafeBool bIsReady = false;
+};
+
+
+static bool IsSupportedExportFormat(EPixelFormat Format)
+{
+	switch (Format)
+	{
+	case PF_R8G8B8A8:
+	case PF_FloatRGBA:
+	case PF_A32B32G32R32F:
+	case PF_R8G8:
+	case PF_G16R16:
+	case PF_G16R16F:
+	case PF_G32R32F:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+static bool DecodeShadowThreshold(const uint8* Src, EPixelFormat Format, FVector2f& OutThreshold)
+{
+	switch (Format)
+	{
+	case PF_R8G8B8A8:
+		OutThreshold = FVector2f(Src[0] / 255.0f, Src[1] / 255.0f);
+		return true;
+	case PF_FloatRGBA:
+	{
+		const FFloat16Color& Color = *reinterpret_cast<const FFloat16Color*>(Src);
+		OutThreshold = FVector2f(Color.R.GetFloat(), Color.G.GetFloat());
+		return true;
+	}
+	case PF_A32B32G32R32F:
+	{
+		const FLinearColor& Color = *reinterpret_cast<const FLinearColor*>(Src);
+		OutThreshold = FVector2f(Color.R, Color.G);
+		return true;
+	}
+	case PF_R8G8:
+		OutThreshold = FVector2f(Src[0] / 255.0f, Src[1] / 255.0f);
+		return true;
+	case PF_G16R16:
+	{
+		const uint16* Color = reinterpret_cast<const uint16*>(Src);
+		OutThreshold = FVector2f(Color[0] / 65535.0f, Color[1] / 65535.0f);
+		return true;
+	}
+	case PF_G16R16F:
+	{
+		const FFloat16* Color = reinterpret_cast<const FFloat16*>(Src);
+		OutThreshold = FVector2f(Color[0].GetFloat(), Color[1].GetFloat());
+		return true;
+	}
+	case PF_G32R32F:
+	{
+		const float* Color = reinterpret_cast<const float*>(Src);
+		OutThreshold = FVector2f(Color[0], Color[1]);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+
+/** .bに有効フラグ(SDFBlend.usf)を持つ形式か */
+static bool HasValidityChannel(EPixelFormat Format)
+{
+	return GPixelFormats[Format].NumComponents >= 3;
+}
+
+
+static int32 GetNumPixels(const FToonShadeExportRequest& Request)
+{
+	int32 NumPixels = 0;
+	for (const FToonShadeExportMip& Mip : Request.Mips)
+	{
+		NumPixels += Mip.Size.X * Mip.Size.Y;
+	}
+	return NumPixels;
+}
+
+
+static bool IsReadbackReady(const FToonShadeExportRequest& Request)
+{
+	for (const FToonShadeExportMip& Mip : Request.Mips)
+	{
+		if (!Mip.Readback->IsReady())
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+
+static bool ReadbackShadowThresholdMip(FToonShadeExportMip& Mip, bool bIsBC4, FFloat16Color* OutPixels, bool& bOutHasSecondChannel)
+{
+	int32 RowPitchInPixels = 0;
+	const uint8* Data = static_cast<const uint8*>(Mip.Readback->Lock(RowPitchInPixels));
+	if (Data == nullptr)
+	{
+		return false;
+	}
+
+	const int32 BlockBytes = GPixelFormats[Mip.Format].BlockBytes;
+
+	for (int32 Y = 0; Y < Mip.Size.Y; ++Y)
+	{
+		const uint8* Row = Data + static_cast<SIZE_T>(Y) * RowPitchInPixels * BlockBytes;
+
+		for (int32 X = 0; X < Mip.Size.X; ++X)
+		{
+			FVector2f Threshold = FVector2f::ZeroVector;
+			DecodeShadowThreshold(Row + X * BlockBytes, Mip.Format, Threshold);
+
+			// 8bitで潰れる差は.rだけでも同じ
+			bOutHasSecondChannel |= FMath::Abs(Threshold.X - Threshold.Y) > 1.0f / 255.0f;
+
+			// BC4はどのチャンネルを拾われても良いように全チャンネルに複製
+			const FLinearColor Color = bIsBC4 ? FLinearColor(Threshold.X, Threshold.X, Threshold.X, Threshold.X) : FLinearColor(Threshold.X, Threshold.Y, 0.0f, 1.0f);
+			OutPixels[Y * Mip.Size.X + X] = FFloat16Color(Color);
+		}
+	}
+
+	Mip.Readback->Unlock();
+
+	return true;
+}
+
+
+static void ReadbackShadowThreshold(FToonShadeExportRequest& Request)
+{
+	const bool bIsBC4 = Request.Compression == EToonShadeTextureCompression::BC4;
+
+	TArray<FFloat16Color> Pixels;
+	Pixels.SetNumUninitialized(GetNumPixels(Request));
+
+	FFloat16Color* MipPixels = Pixels.GetData();
+	for (FToonShadeExportMip& Mip : Request.Mips)
+	{
+		if (!ReadbackShadowThresholdMip(Mip, bIsBC4, MipPixels, Request.bHasSecondChannel))
+		{
+			return;
+		}
+		MipPixels += Mip.Size.X * Mip.Size.Y;
+	}
+
+	Request.Pixels = MoveTemp(Pixels);
+}
+
+
+/** 出力からミップチェーンを作って各段の読み戻しを積む */
+static void EnqueueShadowThresholdMips(FRHICommandListImmediate& RHICmdList, FToonShadeExportRequest& Request, FRHITexture* SourceTexture)
+{
+	RHICmdList.Transition(FRHITransitionInfo(SourceTexture, ERHIAccess::Unknown, ERHIAccess::CopySrc));
+	Request.Mips[0].Readback->EnqueueCopy(RHICmdList, SourceTexture);
+	RHICmdList.Transition(FRHITransitionInfo(SourceTexture, ERHIAccess::CopySrc, ERHIAccess::SRVMask));
+
+	const ETextureCreateFlags TextureCreateFlags(TexCreate_ShaderResource | TexCreate_UAV);
+
+	FTextureRHIRef PrevTexture = SourceTexture;
+
+	for (int32 MipIndex = 1; MipIndex < Request.Mips.Num(); ++MipIndex)
+	{
+		const FToonShadeExportMip& PrevMip = Request.Mips[MipIndex - 1];
+		FToonShadeExportMip& Mip = Request.Mips[MipIndex];
+
+		FTextureRWBuffer MipTexture;
+		MipTexture.Initialize2D(TEXT("ToonShadePaint.ExportMipTexture"), GPixelFormats[Mip.Format].BlockBytes, Mip.Size.X, Mip.Size.Y, Mip.Format, TextureCreateFlags);
+
+		RHICmdList.Transition(FRHITransitionInfo(MipTexture.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+		{
+			TShaderMapRef<FShadowThresholdMipCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+			SetComputePipelineState(RHICmdList, ComputeShader.GetComputeShader());
+			SetShaderParametersLegacyCS(
+				RHICmdList,
+				ComputeShader,
+				PrevMip.Size,
+				Mip.Size,
+				HasValidityChannel(PrevMip.Format),
+				PrevTexture,
+				MipTexture.UAV);
+			DispatchComputeShader(RHICmdList, ComputeShader.GetShader(), FMath::DivideAndRoundUp(Mip.Size.X, 32), FMath::DivideAndRoundUp(Mip.Size.Y, 32), 1);
+			UnsetShaderParametersLegacyCS(RHICmdList, ComputeShader);
+		}
+
+		RHICmdList.Transition(FRHITransitionInfo(MipTexture.UAV, ERHIAccess::UAVCompute, ERHIAccess::CopySrc));
+		Mip.Readback->EnqueueCopy(RHICmdList, MipTexture.Buffer);
+		RHICmdList.Transition(FRHITransitionInfo(MipTexture.Buffer, ERHIAccess::CopySrc, ERHIAccess::SRVMask));
+
+		PrevTexture = MipTexture.Buffer;
+	}
+}
+
+
+static UTexture2D* CreateShadowThresholdAsset(const FToonShadeExportRequest& Request)
+{
+#if WITH_EDITOR
+	if (Request.Mips.IsEmpty() || Request.Pixels.Num() != GetNumPixels(Request))
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("Failed to read back '%s'"), *Request.AssetName);
+		return nullptr;
+	}
+
+	const FString PackageName = FPaths::Combine(Request.PackagePath, Request.AssetName);
+	if (!FPackageName::IsValidLongPackageName(PackageName))
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("Invalid package name '%s'"), *PackageName);
+		return nullptr;
+	}
+
+	if (Request.Compression == EToonShadeTextureCompression::BC4 && Request.bHasSecondChannel)
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("'%s' has a second threshold channel (.g) that BC4 discards. Export with BC5 to keep both."), *Request.AssetName);
+	}
+
+	UPackage* Package = CreatePackage(*PackageName);
+	Package->FullyLoad();
+
+	UTexture2D* Texture = NewObject<UTexture2D>(Package, *Request.AssetName, RF_Public | RF_Standalone | RF_Transactional);
+	Texture->PreEditChange(nullptr);
+
+	const FIntPoint& Size = Request.Mips[0].Size;
+	Texture->Source.Init(Size.X, Size.Y, 1, Request.Mips.Num(), TSF_RGBA16F, reinterpret_cast<const uint8*>(Request.Pixels.GetData()));
+
+	// 閾値は線形値
+	Texture->SRGB = false;
+	// UE5.4には汎用の2チャンネルBC5がないのでTC_Normalmapで圧縮する (読む側はxyが[-1,1]へ展開される)
+	Texture->CompressionSettings = Request.Compression == EToonShadeTextureCompression::BC4 ? TC_Alpha : TC_Normalmap;
+	// 箱フィルタで作り直されると明暗の境界がずれるので、閾値用に作ったミップをそのまま使う
+	Texture->MipGenSettings = TMGS_LeaveExistingMips;
+	Texture->Filter = TF_Bilinear;
+	Texture->AddressX = TA_Clamp;
+	Texture->AddressY = TA_Clamp;
+
+	Texture->PostEditChange();
+
+	FAssetRegistryModule::AssetCreated(Texture);
+	Package->MarkPackageDirty();
+
+	return Texture;
+#else
+	UE_LOG(LogToonShadePaint, Warning, TEXT("ExportShadowThresholdMap is only available in the editor."));
+	return nullptr;
+#endif
+}
+
+
+void UToonShadePaintBlueprintLibrary::ExportShadowThresholdMap(
+	UTextureRenderTarget2D* InShadowThresholdMapTexture,
+	const FString& PackagePath,
+	const FString& AssetName,
+	EToonShadeTextureCompression Compression,
+	FOnToonShadeExportCompleted OnCompleted)
+{
+	if (!IsValid(InShadowThresholdMapTexture) || InShadowThresholdMapTexture->GetResource() == nullptr)
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("Invalid 'InShadowThresholdMapTexture'"));
+		OnCompleted.ExecuteIfBound(nullptr);
+		return;
+	}
+
+	const EPixelFormat PixelFormat = InShadowThresholdMapTexture->GetFormat();
+	if (!IsSupportedExportFormat(PixelFormat))
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("'%s' has an unsupported format for export."), *InShadowThresholdMapTexture->GetName());
+		OnCompleted.ExecuteIfBound(nullptr);
+		return;
+	}
+
+	TSharedRef<FToonShadeExportRequest, ESPMode::ThreadSafe> Request = MakeShared<FToonShadeExportRequest, ESPMode::ThreadSafe>();
+	const FIntPoint Size(InShadowThresholdMapTexture->SizeX, InShadowThresholdMapTexture->SizeY);
+	const int32 NumMips = FMath::FloorLog2(FMath::Max(Size.X, Size.Y)) + 1;
+
+	Request->Mips.SetNum(NumMips);
+	for (int32 MipIndex = 0; MipIndex < NumMips; ++MipIndex)
+	{
+		FToonShadeExportMip& Mip = Request->Mips[MipIndex];
+		Mip.Readback = MakeUnique<FRHIGPUTextureReadback>(TEXT("ToonShadePaint.ExportReadback"));
+		Mip.Size = FIntPoint(FMath::Max(Size.X >> MipIndex, 1), FMath::Max(Size.Y >> MipIndex, 1));
+		// 縮小したミップは半精度で十分 (.bに有効フラグを引き継ぐので4チャンネル)
+		Mip.Format = MipIndex == 0 ? PixelFormat : PF_FloatRGBA;
+	}
+	Request->PackagePath = PackagePath;
+	Request->AssetName = AssetName;
+	Request->Compression = Compression;
+	Request->OnCompleted = OnCompleted;
+
+	FTextureRHIRef SourceTexture = InShadowThresholdMapTexture->GetResource()->TextureRHI;
+
+	ENQUEUE_RENDER_COMMAND(ToonShadePaintBlueprintLibrary_ExportShadowThresholdMap)(
+		[Request, SourceTexture](FRHICommandListImmediate& RHICmdList)
+	{
+		EnqueueShadowThresholdMips(RHICmdList, *Request, SourceTexture);
+	});
+
+	// 描画スレッドでフェンスを覗いて、終わっていればゲームスレッドでアセット化
+	FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([Request](float DeltaTime)
+	{
+		if (Request->bIsReady)
+		{
+			UTexture2D* Texture = CreateShadowThresholdAsset(*Request);
+			Request->OnCompleted.ExecuteIfBound(Texture);
+			return false;
+		}
+
+		if (!Request->bIsPolling)
+		{
+			Request->bIsPolling = true;
+
+			ENQUEUE_RENDER_COMMAND(ToonShadePaintBlueprintLibrary_PollExportReadback)(
+				[Request](FRHICommandListImmediate& RHICmdList)
+			{
+				if (IsReadbackReady(*Request))
+				{
+					ReadbackShadowThreshold(*Request);
+					Request->bIsReady = true;
+				}
+				Request->bIsPolling = false;
+			});
+		}
+
+		return true;
+	}));
+}
@@ -0,0 +1,24 @@
+// Copyright © 2024-2025 kafues511 All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/LowLevelMemTracker.h"
+#include "Stats/Stats.h"
+
+/** 焼きとキャプチャが確保するテクスチャ・バッファのLLMタグ */
+LLM_DECLARE_TAG(ToonShadePaint);
+
+DECLARE_STATS_GROUP(TEXT("ToonShadePaint"), STATGROUP_ToonShadePaint, STATCAT_Advanced);
+
+/** 直近の焼き1回分で確保した量 */
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Last Bake Allocated"), STAT_ToonShadePaint_LastBakeMemory, STATGROUP_ToonShadePaint, );
+
+/** bRetainIntermediatesで出力毎に残している量 */
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Retained Intermediates"), STAT_ToonShadePaint_RetainedMemory, STATGROUP_ToonShadePaint, );
+
+/** AToonShadeCaptureTargetActorのレンダーターゲット */
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Capture Targets"), STAT_ToonShadePaint_CaptureTargetMemory, STATGROUP_ToonShadePaint, );
+
+/** AToonShadeCaptureTargetActor::CaptureAllで使い回しているアトラス */
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Capture Atlases"), STAT_ToonShadePaint_CaptureAtlasMemory, STATGROUP_ToonShadePaint, );
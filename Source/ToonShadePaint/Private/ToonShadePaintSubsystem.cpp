@@ -1,11 +1,65 @@
 // Copyright © 2024-2025 kafues511 All Rights Reserved.
 
 #include "ToonShadePaintSubsystem.h"
+#include "Algo/Compare.h"
 #include "Algo/IndexOf.h"
+#include "Engine/TextureRenderTarget2D.h"
+#include "HAL/IConsoleManager.h"
+#include "Kismet/KismetRenderingLibrary.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
 #include "ToonShadePaintActor.h"
+#include "ToonShadeCaptureTargetActor.h"
+#include "ToonShadePaintBake.h"
+#include "ToonShadePaintBakeCache.h"
+#include "ToonShadePaintMemory.h"
+
+
+static TAutoConsoleVariable<float> CVarToonShadePaintAutoRebakeDebounce(
+	TEXT("r.ToonShadePaint.AutoRebake.Debounce"),
+	0.1f,
+	TEXT("Seconds without further changes before an automatic rebake starts."),
+	ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarToonShadePaintAutoRebakeRefineDelay(
+	TEXT("r.ToonShadePaint.AutoRebake.RefineDelay"),
+	0.5f,
+	TEXT("Seconds without further changes before a preview bake is replaced by a full-resolution bake."),
+	ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarToonShadePaintAutoRebakeGPUBudget(
+	TEXT("r.ToonShadePaint.AutoRebake.GPUBudget"),
+	4.0f,
+	TEXT("GPU time in milliseconds per frame that an automatic rebake may use. Each frame's slice is sized from the GPU time per dispatch measured on the previous bake of the same kind."),
+	ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarToonShadePaintAutoRebakeMaxDirtyRatio(
+	TEXT("r.ToonShadePaint.AutoRebake.MaxDirtyRatio"),
+	0.5f,
+	TEXT("Largest fraction of the texture a shape edit may touch, padded by twice the propagation radius, before the whole map is rebaked instead of just the dirty region."),
+	ECVF_Default);
+
 
 UToonShadePaintSubsystem::UToonShadePaintSubsystem()
 	: Super()
+	, AutoRebakeOutput(nullptr)
+	, AutoRebakeMaxRadius(0)
+	, bAutoRebakeEnabled(false)
+	, bIsDirty(false)
+	, bNeedsRefine(false)
+	, TimeSinceLastChange(0.0f)
+	, EstimatedGPUMilliseconds(-1.0f)
+	, EstimatedMillisecondsPerDispatch(-1.0f)
+	, EstimatedPreviewMillisecondsPerDispatch(-1.0f)
+	, EstimatedPartialMillisecondsPerDispatch(-1.0f)
+	, InFlightMillisecondsPerDispatch(-1.0f)
+	, NumPositionTilesX(0)
+	, PositionTileMaxRadius(0)
+	, bCanBakeRegion(false)
+	, bIsPositionPrecaptured(false)
+	, TrackedCaptureAtlasBytes(0)
+	, bShouldLookUpCache(false)
+	, bIsCacheLookupPending(false)
+	, CacheLookupSerial(0)
 {
 	UsedLayerList.SetNum(kMaxLayer);
 }
@@ -17,27 +71,87 @@ void UToonShadePaintSubsystem::Initialize(FSubsystemCollectionBase& Collection)
 
 void UToonShadePaintSubsystem::Deinitialize()
 {
+	StopAutoRebake();
+	ReleaseCaptureAtlases();
+
 	Super::Deinitialize();
 }
 
 ETickableTickType UToonShadePaintSubsystem::GetTickableTickType() const
 {
-	return ETickableTickType::Never;
+	return ETickableTickType::Conditional;
 }
 
 bool UToonShadePaintSubsystem::IsTickable() const
 {
-	return false;
+	return bAutoRebakeEnabled || InFlightJob.IsValid();
 }
 
 bool UToonShadePaintSubsystem::IsTickableInEditor() const
 {
-	return false;
+	return true;
 }
 
 void UToonShadePaintSubsystem::Tick(float DeltaTime)
 {
 	Super::Tick(DeltaTime);
+
+	TRACE_CPUPROFILER_EVENT_SCOPE(UToonShadePaintSubsystem::Tick);
+
+	PollAutoRebake();
+
+	// 焼いている間も進める (先に撮るかの判定に使う)
+	TimeSinceLastChange += DeltaTime;
+
+	const float GPUBudget = FMath::Max(CVarToonShadePaintAutoRebakeGPUBudget.GetValueOnGameThread(), 0.0f);
+
+	// 分けて積んだ焼きは1フレームに予算分ずつ続きを積む (未計測ならr.ToonShadePaint.DispatchesPerSlice回ずつ)
+	if (InFlightJob.IsValid())
+	{
+		const int32 DispatchesPerSlice = InFlightMillisecondsPerDispatch > 0.0f ? FMath::Max(FMath::FloorToInt32(GPUBudget / InFlightMillisecondsPerDispatch), 1) : 0;
+		AdvanceShadowThresholdMap(InFlightJob.ToSharedRef(), DispatchesPerSlice);
+		PrecaptureRebake();
+	}
+
+	if (!bAutoRebakeEnabled || InFlightJob.IsValid() || bIsCacheLookupPending)
+	{
+		return;  // 焼きは1つずつ
+	}
+
+	if (bIsDirty)
+	{
+		if (TimeSinceLastChange < CVarToonShadePaintAutoRebakeDebounce.GetValueOnGameThread())
+		{
+			return;  // まだ編集中
+		}
+
+		// 形状の変更だけなら掛かる範囲だけ焼き直す
+		if (FIntRect DirtyRect; GetDirtyRect(DirtyRect))
+		{
+			if (DirtyRect.Area() <= 0)
+			{
+				bIsDirty = false;  // モデルに掛かっていない
+				DirtyBounds.Reset();
+				return;
+			}
+
+			StartRebake(false, DirtyRect);
+			return;
+		}
+
+		// 出力解像度の焼きが1フレームの予算に収まらないなら、編集中は縮小プレビューで済ませる (分けて積む分だけ反映が遅れる)
+		const bool bPreview = EstimatedGPUMilliseconds < 0.0f || EstimatedGPUMilliseconds > GPUBudget;
+		StartRebake(bPreview);
+	}
+	else if (bNeedsRefine)
+	{
+		if (TimeSinceLastChange < CVarToonShadePaintAutoRebakeRefineDelay.GetValueOnGameThread())
+		{
+			return;
+		}
+
+		StartRebake(false);
+	}
 }
 
 TStatId UToonShadePaintSubsystem::GetStatId() const
@@ -112,6 +226,8 @@ void UToonShadePaintSubsystem::ChangeLayer(int32 InPrevLayer, int32 InNewLayer,
 			// プロパティ変更を発火させるほどでもないので強制変更
 			// TODO: CB更新はしないとダメじゃんね
 			Owner->CachedLayer = Owner->Layer = InPrevLayer;
+
+			NotifyShapeChanged(Owner);
 		}
 	}
 
@@ -119,3 +235,558 @@ void UToonShadePaintSubsystem::ChangeLayer(int32 InPrevLayer, int32 InNewLayer,
 	UsedLayerList[InNewLayer].bUsed = true;
 	UsedLayerList[InNewLayer].Owner = InTestShadePaint;
 }
+
+void UToonShadePaintSubsystem::RegisterCaptureTarget(AToonShadeCaptureTargetActor* InCaptureTargetActor)
+{
+	if (IsValid(InCaptureTargetActor))
+	{
+		CaptureTargets.AddUnique(InCaptureTargetActor);
+	}
+}
+
+void UToonShadePaintSubsystem::UnregisterCaptureTarget(AToonShadeCaptureTargetActor* InCaptureTargetActor)
+{
+	CaptureTargets.Remove(InCaptureTargetActor);
+	DirtyCaptureTargets.Remove(InCaptureTargetActor);
+}
+
+void UToonShadePaintSubsystem::RegisterShape(AToonShadeShapeActor* InShapeActor)
+{
+	if (IsValid(InShapeActor))
+	{
+		Shapes.AddUnique(InShapeActor);
+	}
+}
+
+void UToonShadePaintSubsystem::UnregisterShape(AToonShadeShapeActor* InShapeActor)
+{
+	Shapes.Remove(InShapeActor);
+}
+
+bool UToonShadePaintSubsystem::GetBakeTargets(TArray<AToonShadeCaptureTargetActor*>& OutSeedTargets, AToonShadeCaptureTargetActor*& OutPositionTarget) const
+{
+	OutSeedTargets.Reset();
+	OutPositionTarget = nullptr;
+
+	for (AToonShadeCaptureTargetActor* CaptureTarget : CaptureTargets)
+	{
+		if (!IsValid(CaptureTarget) || !CaptureTarget->bEnabled)
+		{
+			continue;
+		}
+
+		if (CaptureTarget->ResolutionType == EResolutionType::Seed)
+		{
+			OutSeedTargets.Add(CaptureTarget);
+		}
+		else if (OutPositionTarget == nullptr)
+		{
+			OutPositionTarget = CaptureTarget;
+		}
+	}
+
+	if (OutPositionTarget == nullptr || OutSeedTargets.Num() < 2)
+	{
+		return false;
+	}
+
+	UToonShadePaintBlueprintLibrary::LayerSort(OutSeedTargets);
+	return true;
+}
+
+bool UToonShadePaintSubsystem::BakeAll(UTextureRenderTarget2D* OutShadowThresholdMapTexture, int32 MaxRadius, const FToonShadeBakeSettings& Settings, FToonShadeBakeStats& OutStats)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(UToonShadePaintSubsystem::BakeAll);
+
+	OutStats = FToonShadeBakeStats();
+
+	TArray<AToonShadeCaptureTargetActor*> SeedTargets;
+	AToonShadeCaptureTargetActor* PositionTarget = nullptr;
+	if (!GetBakeTargets(SeedTargets, PositionTarget))
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("BakeAll requires at least two enabled Seed capture targets and one Position capture target"));
+		return false;
+	}
+
+	// 撮るのは描画スレッドに積まれるだけなので、全部積んでから焼きを積めば同じフレームで揃う
+	TArray<AToonShadeCaptureTargetActor*> CaptureTargets = SeedTargets;
+	CaptureTargets.Add(PositionTarget);
+
+	for (AToonShadeCaptureTargetActor* CaptureTarget : CaptureTargets)
+	{
+		CaptureTarget->CaptureSetup();
+	}
+	AToonShadeCaptureTargetActor::CaptureAll(CaptureTargets);
+
+	TArray<UTextureRenderTarget2D*> SeedTextures;
+	for (AToonShadeCaptureTargetActor* CaptureTarget : SeedTargets)
+	{
+		SeedTextures.Add(CaptureTarget->TextureRenderTarget);
+	}
+
+	UToonShadePaintBlueprintLibrary::CreateShadowThresholdMap(this, SeedTextures, PositionTarget->TextureRenderTarget, MaxRadius, OutShadowThresholdMapTexture, Settings, OutStats);
+
+	return OutStats.NumDispatches > 0 && !OutStats.bCancelled;
+}
+
+UTextureRenderTarget2D* UToonShadePaintSubsystem::GetCaptureAtlas(ETextureRenderTargetFormat Format, int32 SizeX, int32 SizeY)
+{
+	for (UTextureRenderTarget2D* CaptureAtlas : CaptureAtlases)
+	{
+		if (IsValid(CaptureAtlas) && CaptureAtlas->RenderTargetFormat == Format && CaptureAtlas->SizeX == SizeX && CaptureAtlas->SizeY == SizeY)
+		{
+			return CaptureAtlas;
+		}
+	}
+
+	LLM_SCOPE_BYTAG(ToonShadePaint);
+
+	UTextureRenderTarget2D* CaptureAtlas = UKismetRenderingLibrary::CreateRenderTarget2D(GetWorld(), SizeX, SizeY, Format, FLinearColor(0.0f, 0.0f, 0.0f, 0.0f));
+	if (!IsValid(CaptureAtlas))
+	{
+		return nullptr;
+	}
+
+	const int64 AtlasBytes = CaptureAtlas->CalcTextureMemorySizeEnum(TMC_ResidentMips);
+	TrackedCaptureAtlasBytes += AtlasBytes;
+	INC_MEMORY_STAT_BY(STAT_ToonShadePaint_CaptureAtlasMemory, AtlasBytes);
+
+	CaptureAtlases.Add(CaptureAtlas);
+	return CaptureAtlas;
+}
+
+void UToonShadePaintSubsystem::ReleaseCaptureAtlases()
+{
+	// 描画スレッドで切り出している最中の分は、解放がその後ろに積まれる
+	for (UTextureRenderTarget2D* CaptureAtlas : CaptureAtlases)
+	{
+		if (IsValid(CaptureAtlas))
+		{
+			CaptureAtlas->ReleaseResource();
+		}
+	}
+	CaptureAtlases.Reset();
+
+	DEC_MEMORY_STAT_BY(STAT_ToonShadePaint_CaptureAtlasMemory, TrackedCaptureAtlasBytes);
+	TrackedCaptureAtlasBytes = 0;
+}
+
+void UToonShadePaintSubsystem::StartAutoRebake(UTextureRenderTarget2D* OutShadowThresholdMapTexture, int32 MaxRadius, const FToonShadeBakeSettings& Settings)
+{
+	if (!IsValid(OutShadowThresholdMapTexture))
+	{
+		UE_LOG(LogToonShadePaint, Warning, TEXT("Invalid 'OutShadowThresholdMapTexture'"));
+		return;
+	}
+
+	AutoRebakeOutput = OutShadowThresholdMapTexture;
+	AutoRebakeMaxRadius = MaxRadius;
+	AutoRebakeSettings = Settings;
+	AutoRebakeSettings.bProgressivePreview = false;  // プレビューかどうかはこちらで決める
+
+	bAutoRebakeEnabled = true;
+
+	// 動かす前の範囲を引けるように今の配置を覚えておく
+	ShapeBounds.Reset();
+	DirtyBounds.Reset();
+	for (AToonShadeShapeActor* ShapeActor : Shapes)
+	{
+		if (IsValid(ShapeActor))
+		{
+			ShapeBounds.Add(ShapeActor, ShapeActor->GetPaintBounds());
+		}
+	}
+
+	PositionTileBounds.Reset();
+	NumPositionTilesX = 0;
+	PositionTileMaxRadius = 0;
+	bCanBakeRegion = false;
+
+	// 設定が変わったので計測し直し
+	EstimatedGPUMilliseconds = -1.0f;
+	EstimatedMillisecondsPerDispatch = -1.0f;
+	EstimatedPreviewMillisecondsPerDispatch = -1.0f;
+	EstimatedPartialMillisecondsPerDispatch = -1.0f;
+
+	// レベルを開き直した時もここから始まるので、最初の全体の焼きの前に1回だけDDCを引く (前の設定で引いている分は捨てる)
+	bShouldLookUpCache = true;
+	bIsCacheLookupPending = false;
+	++CacheLookupSerial;
+
+	MarkDirty();
+}
+
+void UToonShadePaintSubsystem::StopAutoRebake()
+{
+	bAutoRebakeEnabled = false;
+	bIsDirty = false;
+	bNeedsRefine = false;
+
+	// 焼いている最中の分は次の区切りで止める (取り消しを描画スレッドへ届ける)
+	if (InFlightJob.IsValid())
+	{
+		InFlightJob->bIsCancelRequested = true;
+		AdvanceShadowThresholdMap(InFlightJob.ToSharedRef());
+	}
+
+	if (AutoRebakeOutput)
+	{
+		ReleaseShadowThresholdMapIntermediates(AutoRebakeOutput);
+	}
+
+	AutoRebakeOutput = nullptr;
+	DirtyCaptureTargets.Reset();
+	PrecapturedSeedTargets.Reset();
+
+	DirtyBounds.Reset();
+	ShapeBounds.Reset();
+	PositionTileBounds.Reset();
+	NumPositionTilesX = 0;
+	PositionTileMaxRadius = 0;
+	bCanBakeRegion = false;
+
+	// 次に撮るのはいつになるか分からない
+	ReleaseCaptureAtlases();
+
+	// 引いている最中の分は届いても捨てる
+	bShouldLookUpCache = false;
+	bIsCacheLookupPending = false;
+	++CacheLookupSerial;
+}
+
+void UToonShadePaintSubsystem::NotifyShapeChanged(AToonShadeShapeActor* InShapeActor)
+{
+	if (!bAutoRebakeEnabled || InShapeActor == nullptr)
+	{
+		return;
+	}
+
+	// 動かす前と後の両方で塗りが変わる
+	if (const FBox* PrevBounds = ShapeBounds.Find(InShapeActor); PrevBounds != nullptr && PrevBounds->IsValid)
+	{
+		DirtyBounds.Add(*PrevBounds);
+	}
+
+	if (InShapeActor->IsActorBeingDestroyed())
+	{
+		ShapeBounds.Remove(InShapeActor);
+	}
+	else
+	{
+		const FBox NewBounds = InShapeActor->GetPaintBounds();
+		if (NewBounds.IsValid)
+		{
+			DirtyBounds.Add(NewBounds);
+		}
+		ShapeBounds.Add(InShapeActor, NewBounds);
+	}
+
+	MarkDirty();
+}
+
+void UToonShadePaintSubsystem::NotifyCaptureTargetChanged(AToonShadeCaptureTargetActor* InCaptureTargetActor)
+{
+	if (!bAutoRebakeEnabled || !IsValid(InCaptureTargetActor))
+	{
+		return;
+	}
+
+	DirtyCaptureTargets.Add(InCaptureTargetActor);
+
+	MarkDirty();
+}
+
+void UToonShadePaintSubsystem::MarkDirty()
+{
+	bIsDirty = true;
+	TimeSinceLastChange = 0.0f;
+
+	// 先に撮った分は古いので、焼き直す時に撮り直す
+	PrecapturedSeedTargets.Reset();
+}
+
+void UToonShadePaintSubsystem::PollAutoRebake()
+{
+	if (!InFlightJob.IsValid() || !InFlightJob->bIsCompleted)
+	{
+		return;
+	}
+
+	const FToonShadeBakeStats& Stats = InFlightJob->Stats;
+	if (Stats.bCancelled)
+	{
+		bCanBakeRegion = false;  // 止めた
+	}
+	else if (Stats.NumDispatches > 0)
+	{
+		const float MillisecondsPerDispatch = Stats.GPUMilliseconds / Stats.NumDispatches;
+
+		if (InFlightJob->bIsPreview)
+		{
+			EstimatedPreviewMillisecondsPerDispatch = MillisecondsPerDispatch;
+			bCanBakeRegion = false;  // 出力に残した中間リソースと食い違う
+		}
+		else if (InFlightJob->bIsPartial)
+		{
+			// 全体のGPU時間は範囲次第で変わるので、1ディスパッチあたりだけ拾う
+			EstimatedPartialMillisecondsPerDispatch = MillisecondsPerDispatch;
+		}
+		else
+		{
+			EstimatedGPUMilliseconds = Stats.GPUMilliseconds;
+			EstimatedMillisecondsPerDispatch = MillisecondsPerDispatch;
+			bNeedsRefine = false;  // プレビューにできない解像度だった
+
+			PositionTileBounds = MoveTemp(InFlightJob->PositionTileBounds);
+			NumPositionTilesX = InFlightJob->NumPositionTilesX;
+			PositionTileMaxRadius = InFlightJob->ResolvedMaxRadius;
+			bCanBakeRegion = PositionTileBounds.Num() > 0;
+
+			StoreShadowThresholdMapToCache(InFlightCacheKey, AutoRebakeOutput);
+		}
+	}
+	else
+	{
+		bCanBakeRegion = false;  // 焼けなかった
+	}
+
+	UE_LOG(LogToonShadePaint, Verbose, TEXT("AutoRebake: %.3fms (GPU: %.3fms)%s"),
+		Stats.WallMilliseconds, Stats.GPUMilliseconds, InFlightJob->bIsPreview ? TEXT(" [Preview]") : InFlightJob->bIsPartial ? TEXT(" [Partial]") : TEXT(""));
+
+	InFlightJob.Reset();
+	InFlightCacheKey.Reset();
+	InFlightTextures.Reset();
+	InFlightMillisecondsPerDispatch = -1.0f;
+}
+
+void UToonShadePaintSubsystem::OnCacheLookupCompleted(bool bIsFound, AToonShadeCaptureTargetActor* PositionTarget)
+{
+	bIsCacheLookupPending = false;
+
+	if (!bIsFound)
+	{
+		bIsDirty = true;  // 焼く (引いている間に変更があっても同じ)
+		return;
+	}
+
+	UE_LOG(LogToonShadePaint, Verbose, TEXT("AutoRebake: restored from the derived data cache"));
+
+	// 中間リソースは戻らないので、次の焼きはキャプチャから全体をやり直す
+	ReleaseShadowThresholdMapIntermediates(AutoRebakeOutput);
+	bCanBakeRegion = false;
+	if (IsValid(PositionTarget))
+	{
+		DirtyCaptureTargets.Add(PositionTarget);
+	}
+
+	bNeedsRefine = false;
+	if (!bIsDirty)
+	{
+		DirtyBounds.Reset();  // 引いている間に変更がなければ焼き直さない
+	}
+}
+
+bool UToonShadePaintSubsystem::GetDirtyRect(FIntRect& OutDirtyRect) const
+{
+	// キャプチャ自体が変わったらモデル座標ごと撮り直すので全体を焼く
+	if (!bCanBakeRegion || DirtyCaptureTargets.Num() > 0 || NumPositionTilesX <= 0)
+	{
+		return false;
+	}
+
+	OutDirtyRect = FIntRect();
+
+	// モデル座標は形状と同じワールド空間なので、形状の範囲に掛かるタイルを集める
+	for (int32 TileIndex = 0; TileIndex < PositionTileBounds.Num(); ++TileIndex)
+	{
+		const FBox3f& TileBounds = PositionTileBounds[TileIndex];
+		if (!TileBounds.IsValid)
+		{
+			continue;  // モデルが展開されていない
+		}
+
+		const FBox WorldTileBounds(TileBounds);
+		if (!DirtyBounds.ContainsByPredicate([&WorldTileBounds](const FBox& Bounds) { return Bounds.Intersect(WorldTileBounds); }))
+		{
+			continue;
+		}
+
+		const FIntPoint TileMin = FIntPoint(TileIndex % NumPositionTilesX, TileIndex / NumPositionTilesX) * kToonShadePositionTileSize;
+		const FIntRect TileRect(TileMin, TileMin + FIntPoint(kToonShadePositionTileSize, kToonShadePositionTileSize));
+
+		if (OutDirtyRect.Area() <= 0)
+		{
+			OutDirtyRect = TileRect;
+		}
+		else
+		{
+			OutDirtyRect.Union(TileRect);
+		}
+	}
+
+	// 距離は伝搬半径の倍まで広げて計算するので、広げた範囲が広く掛かるなら丸ごと焼いた方が速い
+	// (MaxRadiusを見積もらせている時は設定の値が0以下なので、前回の本焼きで実際に回した半径で広げる)
+	const int32 Resolution = NumPositionTilesX * kToonShadePositionTileSize;
+	FIntRect PaddedRect(OutDirtyRect.Min - PositionTileMaxRadius * 2, OutDirtyRect.Max + PositionTileMaxRadius * 2);
+	PaddedRect.Clip(FIntRect(0, 0, Resolution, Resolution));
+
+	const float MaxDirtyRatio = CVarToonShadePaintAutoRebakeMaxDirtyRatio.GetValueOnGameThread();
+	return OutDirtyRect.Area() <= 0 || PaddedRect.Area() <= static_cast<float>(Resolution) * Resolution * MaxDirtyRatio;
+}
+
+bool UToonShadePaintSubsystem::CaptureRebakeTargets(const TArray<AToonShadeCaptureTargetActor*>& SeedTargets, AToonShadeCaptureTargetActor* PositionTarget)
+{
+	// 形状はSeedにしか影響しないので、モデル座標はキャプチャ自体が変わった時だけ撮り直す
+	const bool bRecapturePosition = DirtyCaptureTargets.Contains(PositionTarget) || !IsValid(PositionTarget->TextureRenderTarget);
+
+	TArray<AToonShadeCaptureTargetActor*> RecaptureTargets;
+	for (AToonShadeCaptureTargetActor* CaptureTarget : SeedTargets)
+	{
+		if (DirtyCaptureTargets.Contains(CaptureTarget) || !IsValid(CaptureTarget->TextureRenderTarget))
+		{
+			CaptureTarget->CaptureSetup();
+		}
+		RecaptureTargets.Add(CaptureTarget);
+	}
+
+	if (bRecapturePosition)
+	{
+		PositionTarget->CaptureSetup();
+		RecaptureTargets.Add(PositionTarget);
+	}
+
+	AToonShadeCaptureTargetActor::CaptureAll(RecaptureTargets);
+
+	return bRecapturePosition;
+}
+
+void UToonShadePaintSubsystem::PrecaptureRebake()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(UToonShadePaintSubsystem::PrecaptureRebake);
+
+	if (!bAutoRebakeEnabled || !bIsDirty || PrecapturedSeedTargets.Num() > 0)
+	{
+		return;
+	}
+
+	// 撮り直すと焼いている最中の分の入力が書き換わる
+	if (!InFlightJob->bAreInputsConsumed || InFlightJob->bIsCompleted)
+	{
+		return;
+	}
+
+	if (TimeSinceLastChange < CVarToonShadePaintAutoRebakeDebounce.GetValueOnGameThread())
+	{
+		return;  // まだ編集中
+	}
+
+	TArray<AToonShadeCaptureTargetActor*> SeedTargets;
+	AToonShadeCaptureTargetActor* PositionTarget = nullptr;
+	if (!GetBakeTargets(SeedTargets, PositionTarget))
+	{
+		return;
+	}
+
+	// 撮るのは距離を計算している最中の分の後ろに積まれるので、焼き終わる頃には撮り終えている
+	bIsPositionPrecaptured = CaptureRebakeTargets(SeedTargets, PositionTarget);
+	PrecapturedSeedTargets.Append(SeedTargets);
+
+	UE_LOG(LogToonShadePaint, Verbose, TEXT("AutoRebake: captured the next rebake while the previous one is still baking"));
+}
+
+bool UToonShadePaintSubsystem::StartRebake(bool bPreview, const FIntRect& DirtyRect)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(UToonShadePaintSubsystem::StartRebake);
+
+	UWorld* World = GetWorld();
+	if (!IsValid(World) || !IsValid(AutoRebakeOutput))
+	{
+		StopAutoRebake();
+		return false;
+	}
+
+	TArray<AToonShadeCaptureTargetActor*> SeedTargets;
+	AToonShadeCaptureTargetActor* PositionTarget = nullptr;
+	if (!GetBakeTargets(SeedTargets, PositionTarget))
+	{
+		bIsDirty = false;
+		return false;  // 焼けるだけ揃っていない
+	}
+
+	// 全体を焼く時のDDCのキー (本焼きは結果を書き込み、StartAutoRebakeの直後は先に引く)
+	const bool bShouldLookUp = bShouldLookUpCache && DirtyRect.Area() <= 0;
+	const FString CacheKey = (bShouldLookUp || !bPreview) && DirtyRect.Area() <= 0
+		? BuildShadowThresholdMapCacheKey(World, SeedTargets, PositionTarget, AutoRebakeMaxRadius, AutoRebakeSettings, AutoRebakeOutput)
+		: FString();
+
+	// 焼きに関わるものが何も変わっていなければ、前回(エディタの再起動前を含む)の結果をDDCから戻す
+	// 編集の度に引いてもまず当たらないので、StartAutoRebakeの後の最初の全体の焼きの前だけ
+	if (bShouldLookUp)
+	{
+		bShouldLookUpCache = false;
+
+		if (!CacheKey.IsEmpty())
+		{
+			// 引いている間の変更はMarkDirtyで立て直される
+			bIsDirty = false;
+			bIsCacheLookupPending = true;
+
+			LoadShadowThresholdMapFromCache(CacheKey, AutoRebakeOutput,
+				[WeakThis = TWeakObjectPtr<UToonShadePaintSubsystem>(this), WeakPositionTarget = TWeakObjectPtr<AToonShadeCaptureTargetActor>(PositionTarget), Serial = ++CacheLookupSerial](bool bIsFound)
+			{
+				if (UToonShadePaintSubsystem* This = WeakThis.Get(); This != nullptr && This->CacheLookupSerial == Serial)
+				{
+					This->OnCacheLookupCompleted(bIsFound, WeakPositionTarget.Get());
+				}
+			});
+
+			return false;  // 焼きは積んでいない
+		}
+	}
+
+	// 前の焼きの間に撮ってあればそのまま使う (撮った後の変更はMarkDirtyで捨てている)
+	const bool bIsPrecaptured = PrecapturedSeedTargets.Num() > 0 && Algo::Compare(PrecapturedSeedTargets, SeedTargets);
+	const bool bRecapturePosition = bIsPrecaptured ? bIsPositionPrecaptured : CaptureRebakeTargets(SeedTargets, PositionTarget);
+
+	PrecapturedSeedTargets.Reset();
+	DirtyCaptureTargets.Reset();
+
+	TArray<UTextureRenderTarget2D*> SeedTextures;
+	for (AToonShadeCaptureTargetActor* CaptureTarget : SeedTargets)
+	{
+		SeedTextures.Add(CaptureTarget->TextureRenderTarget);
+	}
+
+	FToonShadeBakeSettings Settings = AutoRebakeSettings;
+	Settings.bProgressivePreview = bPreview;
+
+	FToonShadeBakeRequest Request;
+	Request.SeedTextures = SeedTextures;
+	Request.PositionTexture = PositionTarget->TextureRenderTarget;
+	Request.MaxRadius = AutoRebakeMaxRadius;
+	Request.OutShadowThresholdMapTexture = AutoRebakeOutput;
+	Request.Settings = Settings;
+	Request.bAutoRefine = false;  // 本焼きは勝手に積まず、編集が止まってからこちらで積む
+	Request.bRetainIntermediates = !bPreview;
+	Request.DirtyRect = bRecapturePosition ? FIntRect() : DirtyRect;
+	Request.bTimeSliced = true;  // 本焼きで描画スレッドを占有しない
+
+	InFlightJob = EnqueueShadowThresholdMap(Request);
+	InFlightCacheKey = bPreview ? FString() : CacheKey;
+
+	// プレビューと範囲の焼き直しは未計測なら本焼きの値で見積もる (1ディスパッチあたりは本焼きが一番重い)
+	const float KindMillisecondsPerDispatch = bPreview ? EstimatedPreviewMillisecondsPerDispatch : Request.DirtyRect.Area() > 0 ? EstimatedPartialMillisecondsPerDispatch : EstimatedMillisecondsPerDispatch;
+	InFlightMillisecondsPerDispatch = KindMillisecondsPerDispatch > 0.0f ? KindMillisecondsPerDispatch : EstimatedMillisecondsPerDispatch;
+
+	InFlightTextures.Reset();
+	InFlightTextures.Append(SeedTextures);
+	InFlightTextures.Add(PositionTarget->TextureRenderTarget);
+	InFlightTextures.Add(AutoRebakeOutput);
+
+	bIsDirty = false;
+	bNeedsRefine = bPreview;
+
+	DirtyBounds.Reset();
+
+	return true;
+}
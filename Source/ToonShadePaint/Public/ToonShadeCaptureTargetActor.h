@@ -92,6 +92,9 @@ protected:
 
 public:
 	virtual void OnConstruction(const FTransform& Transform) override;
+	virtual void PostRegisterAllComponents() override;
+	virtual void PostUnregisterAllComponents() override;
+	virtual void BeginDestroy() override;
 
 #if WITH_EDITOR
 	virtual void PreEditChange(FProperty* PropertyThatWillChange) override;
@@ -105,6 +108,20 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Shade Painter")
 	void Capture();
 
+	/**
+	 * 複数のキャプチャをまとめて撮る (CaptureSetup済みのもの)
+	 * 形式と解像度が同じものは1枚のアトラスへ複数ビューで1回だけ描画してから、それぞれのTextureRenderTargetへ切り出します。
+	 * アトラスのビューで再現できない設定 (自動の奥行き・クリップ面) に変えたものは1つずつ撮ります。
+	 */
+	static void CaptureAll(TArrayView<AToonShadeCaptureTargetActor* const> InCaptureTargets);
+
+private:
+	/** 形式と解像度が同じキャプチャを1枚のアトラスへ撮って切り出す */
+	static void CaptureBatch(TArrayView<AToonShadeCaptureTargetActor* const> InCaptureTargets);
+
+	/** CaptureSetupで立てたCaptureModeを戻す (描画には積んだ後なので撮った結果は変わらない) */
+	void ResetCaptureMode();
+
 public:
 	/**
 	 * 有効性
@@ -150,4 +167,7 @@ private:
 
 	UPROPERTY()
 	TObjectPtr<USkeletalMesh> CachedSkeletalMeshAsset;
+
+	/** STAT_ToonShadePaint_CaptureTargetMemoryに足しているTextureRenderTargetの分 */
+	int64 TrackedRenderTargetBytes = 0;
 };
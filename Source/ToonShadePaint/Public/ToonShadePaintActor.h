@@ -3,6 +3,7 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Containers/StaticArray.h"
 #include "GameFramework/Actor.h"
 #include "ToonShadePaintActor.generated.h"
 
@@ -49,6 +50,19 @@ enum class EPaintShapeType : uint8
 	Capsule,
 };
 
+UENUM(BlueprintType)
+enum class EPaintArrayType : uint8
+{
+	/** 配列しない */
+	None,
+	/** 直線 (ArrayOffsetずつずらす) */
+	Linear,
+	/** 放射 (ArrayCenterを通るArrayAxis周りにArrayAngleずつ回す) */
+	Radial,
+	/** 鏡映 (ArrayCenterを通りArrayAxisを法線とする面で反転した2個) */
+	Mirror,
+};
+
 UCLASS(hidecategories = (Rendering, Replication, Collision, HLOD, Physics, Actor, Networking, Input, DataLayers, Cooking, LevelInstance))
 class TOONSHADEPAINT_API AToonShadeShapeActor : public AActor
 {
@@ -63,6 +77,21 @@ protected:
 
 public:
 	virtual void OnConstruction(const FTransform& Transform) override;
+	virtual void PostRegisterAllComponents() override;
+	virtual void PostUnregisterAllComponents() override;
+
+	/**
+	 * 塗りが及ぶワールド範囲 (配列の全インスタンスとフリップ先を含む)
+	 * 無効な場合は空のボックスを返します。
+	 */
+	FBox GetPaintBounds() const;
+
+	/** MPCのParams{Layer}00..12へ書き込む値 (焼きのキャッシュのキーにも使う) */
+	static constexpr int32 kNumShaderParameters = 13;
+
+	/** 配列で並べるインスタンス数 (配列しない時は1) */
+	int32 GetNumArrayInstances() const;
+	TStaticArray<FLinearColor, kNumShaderParameters> GetShaderParameters() const;
 
 #if WITH_EDITOR
 	virtual void PreEditChange(FProperty* PropertyThatWillChange) override;
@@ -87,6 +116,9 @@ private:
 	 */
 	TOptional<FVector> GetShapeScale(EPaintShapeType InShapeType) const;
 
+	/** 元の形状上のワールド座標をIndex番目のインスタンス上へ移す (シェーダーは逆変換で判定する) */
+	FVector TransformArrayInstance(const FVector& Position, int32 Index) const;
+
 public:
 	/**
 	 * 陰の有効性
@@ -161,6 +193,33 @@ public:
 	UPROPERTY(EditAnywhere, Category = "Shade Painter", meta = (EditCondition = "bFlip"))
 	FVector FlipAxis;
 
+	/**
+	 * 形状の配列
+	 * 似た形状を並べる時にアクターとレイヤーを1つで済ませます。フリップは配列した全体に掛かります。
+	 */
+	UPROPERTY(EditAnywhere, Category = "Shade Painter")
+	EPaintArrayType ArrayType;
+
+	/** 配列のインスタンス数 (元の形状を含む) */
+	UPROPERTY(EditAnywhere, Category = "Shade Painter", meta = (EditCondition = "ArrayType == EPaintArrayType::Linear || ArrayType == EPaintArrayType::Radial", ClampMin = "1", ClampMax = "64", UIMin = "1", UIMax = "64"))
+	int32 ArrayCount;
+
+	/** 直線配列の間隔 (ワールド) */
+	UPROPERTY(EditAnywhere, Category = "Shade Painter", meta = (EditCondition = "ArrayType == EPaintArrayType::Linear"))
+	FVector ArrayOffset;
+
+	/** 放射配列の回転中心・鏡映面の通る座標 */
+	UPROPERTY(EditAnywhere, Category = "Shade Painter", meta = (EditCondition = "ArrayType == EPaintArrayType::Radial || ArrayType == EPaintArrayType::Mirror"))
+	FVector ArrayCenter;
+
+	/** 放射配列の回転軸・鏡映面の法線 */
+	UPROPERTY(EditAnywhere, Category = "Shade Painter", meta = (EditCondition = "ArrayType == EPaintArrayType::Radial || ArrayType == EPaintArrayType::Mirror"))
+	FVector ArrayAxis;
+
+	/** 放射配列の1個あたりの回転角度 */
+	UPROPERTY(EditAnywhere, Category = "Shade Painter", meta = (EditCondition = "ArrayType == EPaintArrayType::Radial", UIMin = "-360", UIMax = "360"))
+	float ArrayAngle;
+
 private:
 	/** パラメータの格納先のMPC */
 	UPROPERTY()
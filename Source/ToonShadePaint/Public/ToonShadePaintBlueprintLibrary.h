@@ -10,6 +10,184 @@
 TOONSHADEPAINT_API DECLARE_LOG_CATEGORY_EXTERN(LogToonShadePaint, Log, All);
 
 class AToonShadeCaptureTargetActor;
+class UTexture2D;
+
+UENUM(BlueprintType)
+enum class EToonShadeDistanceMode : uint8
+{
+	/** モデル座標で近傍を伝搬させる (最大MaxRadius回のディスパッチ、収束すれば打ち切る) */
+	Propagation,
+	/**
+	 * テクセル空間の分離型EDT (行・列の2回のディスパッチ)
+	 * UVアイランドが等長に近いレイヤー向け。無効箇所で伝搬が遮られない点に注意。
+	 */
+	Separable,
+};
+
+USTRUCT(BlueprintType)
+struct FToonShadeBakeSettings
+{
+	GENERATED_BODY()
+
+	/** 距離の計算方法 */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Default")
+	EToonShadeDistanceMode DistanceMode;
+
+	/**
+	 * 1/4の解像度で焼いたプレビューを先に書き込んで戻り、出力解像度の本焼きは後からr.ToonShadePaint.DispatchesPerSlice回ずつ分けて積む
+	 * 本焼きが終わる前に同じ出力へ焼き直した場合、古い本焼きは破棄されます。
+	 */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Default")
+	bool bProgressivePreview;
+
+	/**
+	 * 左右対称の顔として左半分(U < 0.5)だけ距離を計算し、右半分は鏡像のテクセルから写す
+	 * UVがU=0.5で左右対称に展開されている前提で、モデル座標と形状がミラー面で対称にならない箇所が多ければ全体を焼きます。
+	 * 分離型EDTでは無視されます。
+	 */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Default")
+	bool bMirrorSymmetry;
+
+	/** ミラー面のピボット座標 */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Default", meta = (EditCondition = "bMirrorSymmetry"))
+	FVector MirrorCenter;
+
+	/** ミラー面の向き */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Default", meta = (EditCondition = "bMirrorSymmetry"))
+	FVector MirrorAxis;
+
+	/**
+	 * 焼きの中で保持するモデル座標を、有効なテクセルのAABBを基準に16bit unormへ量子化する
+	 * 中間リソースのモデル座標が半分になります。誤差はAABBの最も長い辺の1/65535です。(キャプチャはRGBA32fのまま)
+	 */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Default")
+	bool bQuantizePosition;
+
+	FToonShadeBakeSettings()
+		: DistanceMode(EToonShadeDistanceMode::Propagation)
+		, bProgressivePreview(false)
+		, bMirrorSymmetry(false)
+		, MirrorCenter(FVector::ZeroVector)
+		, MirrorAxis(FVector::XAxisVector)
+		, bQuantizePosition(false)
+	{
+	}
+};
+
+UENUM(BlueprintType)
+enum class EToonShadeTextureCompression : uint8
+{
+	/**
+	 * BC5 (RG, 8bpp)
+	 * UE5.4には汎用の2チャンネルBC5がないためTC_Normalmapで圧縮します。
+	 * マテリアルはSampler Type: Normalで読むことになり、xyは[-1,1]へ展開されます(zは再構築された値)。
+	 * 閾値はxy * 0.5 + 0.5で[0,1]へ戻してください。
+	 */
+	BC5,
+	/**
+	 * BC4 (R, 4bpp) 全チャンネルに.rを複製して格納します。
+	 * .gの閾値は捨てるので、.gが.rと異なる場合は書き出し時に警告します。
+	 */
+	BC4,
+};
+
+DECLARE_DYNAMIC_DELEGATE_OneParam(FOnToonShadeExportCompleted, UTexture2D*, Texture);
+
+UENUM(BlueprintType)
+enum class EToonShadeBakeStage : uint8
+{
+	SetupSeedFlags,
+	SetupPos,
+	/** MaxRadiusの見積もり */
+	EstimateMaxRadius,
+	/** 左右対称の相手探し */
+	MirrorMap,
+	/** 有効なタイルの分類 */
+	TileClassify,
+	DistanceMapSetup,
+	DistanceMapIter,
+	DistanceMapEDT,
+	SDFCalc,
+	/** 右半分へのSDFの写し */
+	SDFMirror,
+	/** 正規化・レイヤー間の補間・閾値の書き込み */
+	SDFBlend,
+	Num UMETA(Hidden),
+};
+
+USTRUCT(BlueprintType)
+struct FToonShadeBakeStageStats
+{
+	GENERATED_BODY()
+
+	/** 計測したステージ */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Default")
+	EToonShadeBakeStage Stage;
+
+	/** GPU時間(ミリ秒) 全レイヤーの合計 */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Default")
+	float Milliseconds;
+
+	/** ディスパッチ回数 */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Default")
+	int32 NumDispatches;
+
+	FToonShadeBakeStageStats()
+		: Stage(EToonShadeBakeStage::SetupSeedFlags)
+		, Milliseconds(0.0f)
+		, NumDispatches(0)
+	{
+	}
+};
+
+USTRUCT(BlueprintType)
+struct FToonShadeBakeStats
+{
+	GENERATED_BODY()
+
+	/** 呼び出しから完了までの経過時間(ミリ秒) */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Default")
+	float WallMilliseconds;
+
+	/** 各ステージのGPU時間の合計(ミリ秒) */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Default")
+	float GPUMilliseconds;
+
+	/** ステージ毎の内訳 */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Default")
+	TArray<FToonShadeBakeStageStats> Stages;
+
+	/** 全ステージのディスパッチ回数 */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Default")
+	int32 NumDispatches;
+
+	/** 距離の伝搬を回した回数 全レイヤーの合計 */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Default")
+	int32 NumIterations;
+
+	/** 中間リソースの確保量(バイト) */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Default")
+	int64 AllocatedBytes;
+
+	/** bMirrorSymmetryで半分だけ焼いた */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Default")
+	bool bMirrored;
+
+	/** 途中で取り消したので出力は書き換えていない */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Default")
+	bool bCancelled;
+
+	FToonShadeBakeStats()
+		: WallMilliseconds(0.0f)
+		, GPUMilliseconds(0.0f)
+		, NumDispatches(0)
+		, NumIterations(0)
+		, AllocatedBytes(0)
+		, bMirrored(false)
+		, bCancelled(false)
+	{
+	}
+};
 
 /**
  * 
@@ -20,13 +198,39 @@ class TOONSHADEPAINT_API UToonShadePaintBlueprintLibrary : public UBlueprintFunc
 	GENERATED_BODY()
 	
 public:
-	UFUNCTION(BlueprintCallable, Category = "ToonShadePaint", meta = (WorldContext = "WorldContextObject"))
+	/**
+	 * MaxRadiusが0以下ならSeedの明暗の境界・アイランドの縁までの最も遠い距離から決めてログに出します。
+	 * 焼きはr.ToonShadePaint.DispatchesPerSlice回ずつに分けて積み、その間は進捗を出して取り消しを受け付けます。
+	 * 取り消した場合は出力を書き換えず、OutStats.bCancelledを立てて戻ります。
+	 */
+	UFUNCTION(BlueprintCallable, Category = "ToonShadePaint", meta = (WorldContext = "WorldContextObject", AutoCreateRefTerm = "Settings"))
 	static void CreateShadowThresholdMap(
 		UObject* WorldContextObject,
 		TArray<UTextureRenderTarget2D*> InSeedTextures,
 		UTextureRenderTarget2D* InPositionTexture,
 		int32 MaxRadius,
-		UTextureRenderTarget2D* OutShadowThresholdMapTexture);
+		UTextureRenderTarget2D* OutShadowThresholdMapTexture,
+		const FToonShadeBakeSettings& Settings,
+		FToonShadeBakeStats& OutStats);
+
+	/**
+	 * 陰の閾値マップを圧縮テクスチャのアセットとして書き出す
+	 * GPUからの読み戻しは非同期で行い、完了時にOnCompletedを呼びます。(失敗時はnullptr)
+	 * ミップは明暗の境界がずれないよう閾値の中央値で縮小したものを書き込み、テクスチャストリーミングの対象になります。
+	 * BC5はSampler Type: Normalで読み、xy * 0.5 + 0.5で閾値へ戻す必要があります。(EToonShadeTextureCompression::BC5)
+	 * @param InShadowThresholdMapTexture CreateShadowThresholdMapの出力
+	 * @param PackagePath 書き出し先 (例: /Game/Characters/Face)
+	 * @param AssetName アセット名
+	 * @param Compression 圧縮形式
+	 * @param OnCompleted 完了通知
+	 */
+	UFUNCTION(BlueprintCallable, Category = "ToonShadePaint")
+	static void ExportShadowThresholdMap(
+		UTextureRenderTarget2D* InShadowThresholdMapTexture,
+		const FString& PackagePath,
+		const FString& AssetName,
+		EToonShadeTextureCompression Compression,
+		FOnToonShadeExportCompleted OnCompleted);
 
 	UFUNCTION(BlueprintCallable, Category = "ToonShadePaint")
 	static void LayerSort(UPARAM(ref) TArray<AToonShadeCaptureTargetActor*>& InValues);
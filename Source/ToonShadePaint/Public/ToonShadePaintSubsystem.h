@@ -3,10 +3,16 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Engine/TextureRenderTarget2D.h"
 #include "Subsystems/WorldSubsystem.h"
+#include "UObject/ObjectKey.h"
+#include "ToonShadePaintBlueprintLibrary.h"
 #include "ToonShadePaintSubsystem.generated.h"
 
 class AToonShadeShapeActor;
+class AToonShadeCaptureTargetActor;
+class UTextureRenderTarget2D;
+struct FToonShadeBakeJob;
 
 USTRUCT()
 struct TOONSHADEPAINT_API FToonShadePaintLayer
@@ -100,6 +106,108 @@ public:
 	 */
 	void ChangeLayer(int32 InPrevLayer, int32 InNewLayer, const TObjectPtr<AToonShadeShapeActor> InTestShadePaint);
 
+public:
+	/** 配置されたキャプチャを登録 (コンポーネントの登録・解除に合わせてアクターから呼ばれる) */
+	void RegisterCaptureTarget(AToonShadeCaptureTargetActor* InCaptureTargetActor);
+	void UnregisterCaptureTarget(AToonShadeCaptureTargetActor* InCaptureTargetActor);
+
+	/** 配置された形状を登録 (コンポーネントの登録・解除に合わせてアクターから呼ばれる) */
+	void RegisterShape(AToonShadeShapeActor* InShapeActor);
+	void UnregisterShape(AToonShadeShapeActor* InShapeActor);
+
+	/** 登録済みのキャプチャ (登録順) */
+	const TArray<TObjectPtr<AToonShadeCaptureTargetActor>>& GetCaptureTargets() const { return CaptureTargets; }
+
+	/** 登録済みの形状 (登録順) */
+	const TArray<TObjectPtr<AToonShadeShapeActor>>& GetShapes() const { return Shapes; }
+
+	/**
+	 * 焼きに使うキャプチャを登録済みのものから選ぶ
+	 * @param OutSeedTargets 有効なSeedをLayer順に並べたもの
+	 * @param OutPositionTarget 最初に登録された有効なPosition
+	 * @return Seedが2つ以上とPositionが揃っている場合はtrueを返します。
+	 */
+	bool GetBakeTargets(TArray<AToonShadeCaptureTargetActor*>& OutSeedTargets, AToonShadeCaptureTargetActor*& OutPositionTarget) const;
+
+	/**
+	 * まとめて撮る時のアトラス (形式と大きさ毎に使い回す)
+	 * 撮り直す度に作り直さないようにワールドを閉じるか自動の焼き直しを止めるまで残します。
+	 * @return 作れなかった場合はnullptrを返します。
+	 */
+	UTextureRenderTarget2D* GetCaptureAtlas(ETextureRenderTargetFormat Format, int32 SizeX, int32 SizeY);
+
+	/**
+	 * 登録済みのキャプチャを全て撮り直して閾値マップを焼く
+	 * 撮るのは同じフレームにまとめて積み、そのままCreateShadowThresholdMapへ渡します。
+	 * @param OutShadowThresholdMapTexture 書き込み先
+	 * @param MaxRadius CreateShadowThresholdMapのMaxRadius
+	 * @param Settings CreateShadowThresholdMapのSettings
+	 * @param OutStats CreateShadowThresholdMapのOutStats
+	 * @return 焼けなかった、または取り消した場合はfalseを返します。
+	 */
+	UFUNCTION(BlueprintCallable, Category = "ToonShadePaint", meta = (AutoCreateRefTerm = "Settings"))
+	bool BakeAll(UTextureRenderTarget2D* OutShadowThresholdMapTexture, int32 MaxRadius, const FToonShadeBakeSettings& Settings, FToonShadeBakeStats& OutStats);
+
+public:
+	/**
+	 * 形状やキャプチャの変更に追従して自動で焼き直す
+	 * 変更が落ち着くまで待ってから再キャプチャと焼き直しを行い、焼きは前回計測した1ディスパッチあたりのGPU時間から1フレームあたりのGPU予算に収まる分ずつ積みます。
+	 * 焼くのが予算より重い場合は編集中は縮小プレビューで焼き、編集が止まってから出力解像度で焼き直します。
+	 * 形状の変更だけなら、形状が掛かるテクスチャ上の範囲だけを焼き直します。
+	 * @param OutShadowThresholdMapTexture 書き込み先
+	 * @param MaxRadius CreateShadowThresholdMapのMaxRadius
+	 * @param Settings CreateShadowThresholdMapのSettings (bProgressivePreviewは無視)
+	 */
+	UFUNCTION(BlueprintCallable, Category = "ToonShadePaint", meta = (AutoCreateRefTerm = "Settings"))
+	void StartAutoRebake(UTextureRenderTarget2D* OutShadowThresholdMapTexture, int32 MaxRadius, const FToonShadeBakeSettings& Settings);
+
+	/** 自動の焼き直しを止める 焼いている最中の分は取り消します。(分けて積んでいない分は最後まで書き込まれます) */
+	UFUNCTION(BlueprintCallable, Category = "ToonShadePaint")
+	void StopAutoRebake();
+
+	UFUNCTION(BlueprintPure, Category = "ToonShadePaint")
+	bool IsAutoRebakeEnabled() const { return bAutoRebakeEnabled; }
+
+	/** 形状のパラメータが変わった */
+	void NotifyShapeChanged(AToonShadeShapeActor* InShapeActor);
+
+	/** キャプチャの設定か配置が変わった */
+	void NotifyCaptureTargetChanged(AToonShadeCaptureTargetActor* InCaptureTargetActor);
+
+private:
+	void MarkDirty();
+
+	/** 積んだ焼きの完了を確認 */
+	void PollAutoRebake();
+
+	/**
+	 * 形状の変更が掛かるテクスチャ上の範囲を引く
+	 * @param OutDirtyRect 焼き直す範囲 (テクセル) どこにも掛からなければ空
+	 * @return 範囲を絞って焼き直せない場合はfalseを返します。
+	 */
+	bool GetDirtyRect(FIntRect& OutDirtyRect) const;
+
+	/**
+	 * 焼き直しの入力を撮る (CaptureSetupはやり直すものだけ)
+	 * @return モデル座標も撮り直したか
+	 */
+	bool CaptureRebakeTargets(const TArray<AToonShadeCaptureTargetActor*>& SeedTargets, AToonShadeCaptureTargetActor* PositionTarget);
+
+	/** 焼いている最中の分がキャプチャを読み終えていれば、次の焼き直しの分を先に撮っておく */
+	void PrecaptureRebake();
+
+	/**
+	 * 再キャプチャして焼きを積む
+	 * @param DirtyRect 焼き直す範囲 空なら全体
+	 */
+	bool StartRebake(bool bPreview, const FIntRect& DirtyRect = FIntRect());
+
+	/** 使い回しているアトラスを解放 */
+	void ReleaseCaptureAtlases();
+
+	/** StartRebakeでDDCを引き終わった (見つかれば出力は書き込み済み) */
+	void OnCacheLookupCompleted(bool bIsFound, AToonShadeCaptureTargetActor* PositionTarget);
+
 public:
 	/** 最大レイヤー数 */
 	static constexpr int32 kMaxLayer = 64;
@@ -108,4 +216,96 @@ private:
 	/**  */
 	UPROPERTY()
 	TArray<FToonShadePaintLayer> UsedLayerList;
+
+	/** 配置されているキャプチャ */
+	UPROPERTY()
+	TArray<TObjectPtr<AToonShadeCaptureTargetActor>> CaptureTargets;
+
+	/** 配置されている形状 */
+	UPROPERTY()
+	TArray<TObjectPtr<AToonShadeShapeActor>> Shapes;
+
+	/** 自動の焼き直しの書き込み先 */
+	UPROPERTY()
+	TObjectPtr<UTextureRenderTarget2D> AutoRebakeOutput;
+
+	UPROPERTY()
+	FToonShadeBakeSettings AutoRebakeSettings;
+
+	int32 AutoRebakeMaxRadius;
+
+	bool bAutoRebakeEnabled;
+
+	/** 前回の焼き以降に変更があった */
+	bool bIsDirty;
+
+	/** 最後の焼きがプレビューだったので出力解像度で焼き直す */
+	bool bNeedsRefine;
+
+	/** 最後の変更からの経過時間(秒) */
+	float TimeSinceLastChange;
+
+	/** 直近の本焼きのGPU時間(ミリ秒) 未計測は負値 (1フレームの予算に収まらなければ編集中はプレビューで焼く) */
+	float EstimatedGPUMilliseconds;
+
+	/** 種類毎の直近の焼きの1ディスパッチあたりのGPU時間(ミリ秒) 未計測は負値 */
+	float EstimatedMillisecondsPerDispatch;
+	float EstimatedPreviewMillisecondsPerDispatch;
+	float EstimatedPartialMillisecondsPerDispatch;
+
+	/** InFlightJobの1ディスパッチあたりの見積もり(ミリ秒) 1フレームに積む数を予算から決める 未計測は負値 */
+	float InFlightMillisecondsPerDispatch;
+
+	/** 前回の焼き以降に形状が塗った、または塗らなくなったワールド範囲 */
+	TArray<FBox> DirtyBounds;
+
+	/** 形状毎の最後に通知された塗る範囲 (動かす前の範囲を引く用) */
+	TMap<TObjectKey<AToonShadeShapeActor>, FBox> ShapeBounds;
+
+	/** 前回の本焼きのタイル毎のモデル座標のAABB (行優先) */
+	TArray<FBox3f> PositionTileBounds;
+	int32 NumPositionTilesX;
+
+	/** 前回の本焼きで実際に回した半径 (AutoRebakeMaxRadiusが0以下でも正の値) */
+	int32 PositionTileMaxRadius;
+
+	/** 前回の本焼きの中間リソースが出力に残っていて、範囲を絞って焼き直せる */
+	bool bCanBakeRegion;
+
+	/** CaptureSetupからやり直すキャプチャ */
+	UPROPERTY()
+	TSet<TObjectPtr<AToonShadeCaptureTargetActor>> DirtyCaptureTargets;
+
+	/** 焼いている最中の分 (1つずつ) */
+	TSharedPtr<FToonShadeBakeJob, ESPMode::ThreadSafe> InFlightJob;
+
+	/** InFlightJobの結果を書き込むDDCのキー (本焼き以外は空) */
+	FString InFlightCacheKey;
+
+	/** InFlightJobが描画スレッドで参照するので完了まで保持 */
+	UPROPERTY()
+	TArray<TObjectPtr<UTextureRenderTarget2D>> InFlightTextures;
+
+	/** InFlightJobの途中で次の焼き直し用に撮ったSeed (撮った後に変更があれば空) */
+	UPROPERTY()
+	TArray<TObjectPtr<AToonShadeCaptureTargetActor>> PrecapturedSeedTargets;
+
+	/** 先に撮った時にモデル座標も撮り直した */
+	bool bIsPositionPrecaptured;
+
+	/** GetCaptureAtlasで使い回しているアトラス */
+	UPROPERTY()
+	TArray<TObjectPtr<UTextureRenderTarget2D>> CaptureAtlases;
+
+	/** STAT_ToonShadePaint_CaptureAtlasMemoryに足しているCaptureAtlasesの分 */
+	int64 TrackedCaptureAtlasBytes;
+
+	/** 次の全体の焼きの前にDDCを引く (StartAutoRebakeで立てる) */
+	bool bShouldLookUpCache;
+
+	/** DDCを引いている最中 (焼きは積まない) */
+	bool bIsCacheLookupPending;
+
+	/** 引いた結果が今の引きの分か (止めたら古い分を捨てる) */
+	uint32 CacheLookupSerial;
 };
@@ -28,6 +28,7 @@ public class ToonShadePaint : ModuleRules
 				"RenderCore",
 				"Renderer",
 				"RHI",
+				"DerivedDataCache",
 				"UnrealEd",
 				"AssetTools",
 				"AssetRegistry",